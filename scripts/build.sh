@@ -8,6 +8,7 @@ echo "Building C++ File System..."
 # Create build directories if they don't exist
 mkdir -p build/obj
 mkdir -p build/bin
+mkdir -p build/lib
 mkdir -p build/disk
 
 # Change to source directory
@@ -17,29 +18,100 @@ cd src
 echo "Compiling source files..."
 
 # Compile filesystem components
-g++ -c -I../src/filesystem -I../src/shell -I../src/basic -I../src/disk \
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
     filesystem/FileSys.cpp -o ../build/obj/FileSys.o
 
-g++ -c -I../src/filesystem -I../src/shell -I../src/basic -I../src/disk \
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Directory.cpp -o ../build/obj/Directory.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/NameIndex.cpp -o ../build/obj/NameIndex.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Volume.cpp -o ../build/obj/Volume.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/ReadAhead.cpp -o ../build/obj/ReadAhead.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Snapshots.cpp -o ../build/obj/Snapshots.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Fsck.cpp -o ../build/obj/Fsck.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Defrag.cpp -o ../build/obj/Defrag.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    filesystem/Pipe.cpp -o ../build/obj/Pipe.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
     shell/Shell.cpp -o ../build/obj/Shell.o
 
-g++ -c -I../src/filesystem -I../src/shell -I../src/basic -I../src/disk \
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
     basic/BasicFileSys.cpp -o ../build/obj/BasicFileSys.o
 
-g++ -c -I../src/filesystem -I../src/shell -I../src/basic -I../src/disk \
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    basic/BlockCache.cpp -o ../build/obj/BlockCache.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    basic/Journal.cpp -o ../build/obj/Journal.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    basic/IoStats.cpp -o ../build/obj/IoStats.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    basic/StripedDisk.cpp -o ../build/obj/StripedDisk.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    daemon/Protocol.cpp -o ../build/obj/Protocol.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
+    daemon/Daemon.cpp -o ../build/obj/Daemon.o
+
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
     disk/Disk.cpp -o ../build/obj/Disk.o
 
-g++ -c -I../src/filesystem -I../src/shell -I../src/basic -I../src/disk \
+g++ -c -pthread -fPIC -I../src/filesystem -I../src/shell -I../src/basic -I../src/daemon -I../src/disk \
     main.cpp -o ../build/obj/main.o
 
+# Build the library (everything below the shell)
+echo "Building libfilesys..."
+LIB_OBJS="../build/obj/FileSys.o \
+    ../build/obj/Directory.o \
+    ../build/obj/NameIndex.o \
+    ../build/obj/Volume.o \
+    ../build/obj/ReadAhead.o \
+    ../build/obj/Snapshots.o \
+    ../build/obj/Fsck.o \
+    ../build/obj/Defrag.o \
+    ../build/obj/Pipe.o \
+    ../build/obj/BasicFileSys.o \
+    ../build/obj/BlockCache.o \
+    ../build/obj/Journal.o \
+    ../build/obj/IoStats.o \
+    ../build/obj/StripedDisk.o \
+    ../build/obj/Disk.o"
+rm -f ../build/lib/libfilesys.a
+ar rcs ../build/lib/libfilesys.a $LIB_OBJS
+g++ -shared -pthread -o ../build/lib/libfilesys.so $LIB_OBJS
+
 # Link executable
 echo "Linking executable..."
-g++ -o ../build/bin/filesys \
+g++ -pthread -o ../build/bin/filesys \
     ../build/obj/main.o \
-    ../build/obj/FileSys.o \
     ../build/obj/Shell.o \
-    ../build/obj/BasicFileSys.o \
-    ../build/obj/Disk.o
+    ../build/obj/Protocol.o \
+    ../build/obj/Daemon.o \
+    ../build/lib/libfilesys.a
+
+# Build the workload generator
+echo "Building workload generator..."
+g++ -I../src/filesystem -o ../build/bin/filesys_workload bench/workload.cpp
+
+# Build the offline image loader
+echo "Building mkfs..."
+g++ -I../src/filesystem -o ../build/bin/filesys_mkfs mkfs/mkfs.cpp filesystem/Directory.cpp
 
 # Make executable
 chmod +x ../build/bin/filesys
@@ -1,7 +1,9 @@
 #!/bin/bash
 
 # C++ File System Test Script
-# This script runs all test cases
+# This script runs all test cases. Each script runs on a fresh disk and
+# its output is compared with tests/expected/<name>.out; the script fails
+# if any output differs.
 
 echo "Running C++ File System Tests..."
 
@@ -11,20 +13,181 @@ if [ ! -f "build/bin/filesys" ]; then
     exit 1
 fi
 
+OUT_DIR=/tmp/filesys-test-output
+rm -rf $OUT_DIR && mkdir -p $OUT_DIR
+FAILED=0
+
+# Masks what changes from one run to the next: timings, rates and
+# latency histograms
+normalize() {
+    sed -E -e 's/in [0-9.]+ ms \([0-9.]+ MB\/s\)/in <ms> ms (<rate> MB\/s)/' \
+           -e 's/^(Replayed [0-9]+ commands) in .*/\1 in <s> s (<rate>)/' \
+           -e 's/^(latency [a-z]+ [a-z]+:).*/\1 <histogram>/' \
+           -e 's/^([a-z()]+ +[0-9]+ +[0-9]+ +[0-9]+ +[0-9]+) +[0-9.]+$/\1 <us>/' \
+           -e 's/^([a-z]+ +[0-9]+)( +[0-9]+\.[0-9]+){4}$/\1 <latencies>/'
+}
+
+# Compares the output of a test in $OUT_DIR/<name>.raw with
+# tests/expected/<name>.out
+check() {
+    normalize < $OUT_DIR/$1.raw > $OUT_DIR/$1.out
+    if diff -u tests/expected/$1.out $OUT_DIR/$1.out; then
+        echo "PASSED: $1"
+    else
+        echo "FAILED: $1"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# Runs tests/scripts/<name>.txt on the disk as it is and checks its output
+run_on_disk() {
+    name=$1
+    shift
+    ./build/bin/filesys -s tests/scripts/$name.txt "$@" > $OUT_DIR/$name.raw 2>&1
+    check $name
+}
+
+# Runs tests/scripts/<name>.txt on a fresh disk and checks its output
+run_script() {
+    rm -f DISK DISK.*
+    run_on_disk "$@"
+}
+
+# Fails the test called $1 unless the rest of the line succeeds
+expect() {
+    name=$1
+    shift
+    if "$@"; then
+        echo "PASSED: $name"
+    else
+        echo "FAILED: $name"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
 # Run all test scripts
 echo "Running basic functionality test..."
-./build/bin/filesys -s tests/scripts/test_script.txt
+run_script test_script
 
 echo "Running large file test..."
-./build/bin/filesys -s tests/scripts/test_large_files.txt
+run_script test_large_files
 
 echo "Running edge cases test..."
-./build/bin/filesys -s tests/scripts/test_edge_cases.txt
+run_script test_edge_cases
 
 echo "Running persistence test..."
-./build/bin/filesys -s tests/scripts/test_persistence1.txt
+run_script test_persistence1
+run_script test_persist1
+run_on_disk test_persist2
 
 echo "Running newline handling test..."
-./build/bin/filesys -s tests/scripts/test_newline.txt
+run_script test_newline
+
+echo "Running name index test..."
+run_script test_index
+
+echo "Running long file name test..."
+run_script test_long_names
+
+echo "Running recursive rm/cp test..."
+run_script test_recursive
+
+echo "Running directory listing test..."
+run_script test_listing
+
+echo "Running move test..."
+run_script test_move
+
+echo "Running block cache and read-ahead test..."
+run_script test_cache
+
+echo "Running writeback and sync test..."
+run_script test_sync
+
+echo "Running snapshot test..."
+run_script test_snapshot
 
+echo "Running fsck test..."
+run_script test_fsck
+./build/bin/filesys -f > $OUT_DIR/test_fsck_offline.raw 2>&1
+check test_fsck_offline
+
+echo "Running import/export test..."
+run_script test_import
+printf 'bin\0ary\0' > /tmp/filesys-binary.bin
+printf 'import /tmp/filesys-binary.bin bin\nexport bin /tmp/filesys-binary.out\nrm bin\nquit\n' > /tmp/filesys-binary.txt
+rm -f DISK /tmp/filesys-binary.out
+./build/bin/filesys -s /tmp/filesys-binary.txt --quiet > /dev/null
+expect binary_round_trip cmp /tmp/filesys-binary.bin /tmp/filesys-binary.out
+
+echo "Running pipeline test..."
+run_script test_pipeline
+
+echo "Running I/O statistics test..."
+run_script test_iostat
+rm -f DISK /tmp/filesys-iostat.txt
+FILESYS_IOSTAT=/tmp/filesys-iostat.txt ./build/bin/filesys -s tests/scripts/test_script.txt --quiet > /dev/null
+expect iostat_dump grep -q "^I/O statistics (counting on)" /tmp/filesys-iostat.txt
+
+echo "Running defragmentation test..."
+run_script test_defrag
+
+echo "Running trim test..."
+run_script test_trim
+
+echo "Running mkfs bulk load test..."
+MKFS_DIR=/tmp/filesys-mkfs
+rm -rf $MKFS_DIR && mkdir -p $MKFS_DIR/tree/docs/notes $MKFS_DIR/tree/empty
+printf 'hello\n' > $MKFS_DIR/tree/a.txt
+head -c 5000 /dev/zero | tr '\0' 'z' > $MKFS_DIR/tree/docs/big
+printf 'note one\n' > $MKFS_DIR/tree/docs/notes/n1
+./build/bin/filesys_mkfs $MKFS_DIR/tree $MKFS_DIR/DISK > $OUT_DIR/mkfs.raw 2>&1
+(cd $MKFS_DIR && "$OLDPWD/build/bin/filesys" -s "$OLDPWD/tests/scripts/test_mkfs.txt") >> $OUT_DIR/mkfs.raw 2>&1
+check mkfs
+
+echo "Running striped disk test..."
+STRIPE_DIR=/tmp/filesys-stripe
+rm -rf $STRIPE_DIR && mkdir -p $STRIPE_DIR
+(cd $STRIPE_DIR && FILESYS_STRIPE=4:2 "$OLDPWD/build/bin/filesys" -s "$OLDPWD/tests/scripts/test_persist1.txt" --quiet) > $OUT_DIR/stripe.raw 2>&1
+ls $STRIPE_DIR >> $OUT_DIR/stripe.raw
+(cd $STRIPE_DIR && "$OLDPWD/build/bin/filesys" -s "$OLDPWD/tests/scripts/test_persist2.txt") >> $OUT_DIR/stripe.raw 2>&1
+# a stray member file makes the new disk fail and leaves nothing behind
+rm -rf $STRIPE_DIR && mkdir -p $STRIPE_DIR && touch $STRIPE_DIR/DISK.1
+(cd $STRIPE_DIR && FILESYS_STRIPE=2 "$OLDPWD/build/bin/filesys" -s "$OLDPWD/tests/scripts/test_persist2.txt") >> $OUT_DIR/stripe.raw 2>&1
+ls $STRIPE_DIR >> $OUT_DIR/stripe.raw
+check stripe
+
+echo "Running generated workload replay test..."
+./build/bin/filesys_workload -n 500 -s 42 > /tmp/filesys-workload.txt
+rm -f DISK
+./build/bin/filesys -s /tmp/filesys-workload.txt --replay > $OUT_DIR/workload.raw 2>&1
+check workload
+rm -f DISK
+./build/bin/filesys -s /tmp/filesys-workload.txt --replay 5000 > $OUT_DIR/workload_timed.raw 2>&1
+check workload_timed
+
+echo "Running quiet script test..."
+rm -f DISK
+./build/bin/filesys -s tests/scripts/test_edge_cases.txt --quiet > $OUT_DIR/quiet.raw 2>&1
+check quiet
+
+echo "Running daemon/client test..."
+SOCKET=/tmp/filesys-test.sock
+rm -f DISK $SOCKET
+./build/bin/filesys -d $SOCKET > $OUT_DIR/daemon.log 2>&1 &
+DAEMON_PID=$!
+for i in $(seq 50); do
+    [ -S $SOCKET ] && break
+    sleep 0.1
+done
+./build/bin/filesys -c $SOCKET -s tests/scripts/test_script.txt > $OUT_DIR/daemon.raw 2>&1
+check daemon
+kill $DAEMON_PID
+wait $DAEMON_PID
+rm -f $SOCKET
+
+if [ $FAILED -ne 0 ]; then
+    echo "$FAILED test(s) failed"
+    exit 1
+fi
 echo "All tests completed!"
@@ -2,109 +2,985 @@
 // Implements low-level file system functionality that interfaces with
 // the disk.
 
-#include "Disk.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+
 #include "Blocks.h"
+#include "Directory.h"
 #include "BasicFileSys.h"
 
+// A thread's reserved free blocks. They stay marked used in the bitmap
+// until they are handed out or given back.
+struct alloc_cache_t {
+  std::mutex lock;		// taken by the owning thread and by owner
+  BasicFileSys *owner;		// file system the blocks belong to
+  short blocks[ALLOC_CACHE_MAX];
+  int count;
+  int first_word;		// bitmap word its searches start at
+
+  alloc_cache_t() : owner(NULL), count(0), first_word(0) {}
+  ~alloc_cache_t();
+};
+
+static thread_local alloc_cache_t local_cache;
+
+static_assert(TXN_MAX_BLOCKS + 1 + (TXN_MAX_BLOCKS + JOURNAL_DESC_BLOCKS) /
+              JOURNAL_DESC_BLOCKS <= JOURNAL_BLOCKS - 1,
+              "a full transaction and the bitmap must fit in the journal");
+
+// A thread's open transaction. Metadata blocks it writes are kept here
+// until it commits; reads on the same thread see them.
+struct txn_t {
+  BasicFileSys *owner;		// file system the transaction runs on
+  int depth;			// nesting of begin_transaction calls
+  std::map<short, datablock_t> blocks;	// metadata blocks written
+  std::vector<short> data_blocks;	// data blocks written
+  std::vector<short> freed;	// blocks to free once committed
+  std::vector<std::mutex *> held;	// locked until committed
+  std::vector<std::function<void()> > after;	// run once committed
+  bool bitmap_dirty;		// blocks were allocated
+  bool committed;		// set under commit_mutex by the group writer
+
+  txn_t() : owner(NULL), depth(0), bitmap_dirty(false), committed(false) {}
+};
+
+static thread_local txn_t local_txn;
+
+BasicFileSys::BasicFileSys()
+  : cache(disk, iostat), bitmap_pending(false), next_first_word(0),
+    journal(cache, disk), committing(false), write_hook(NULL), was_clean(true)
+{
+}
+
+// Gives the reservations back when the thread exits
+alloc_cache_t::~alloc_cache_t()
+{
+  BasicFileSys *fs;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    fs = owner;
+  }
+  if (fs != NULL) {
+    fs->release_cache(*this);
+  }
+}
+
 // Mounts the simulated disk file. If a disk file is created, this
 // routines also "formats" the disk by initializing special blocks
-// 0 (superblock) and 1 (root directory).
-void BasicFileSys::mount()
+// 0 (superblock), 1 (root directory), 2 (volume block) and the journal.
+// An existing disk has its journal replayed, which reads only the
+// journal area. Returns false if an existing disk was formatted with a
+// different layout, or if the files of a striped disk do not make up
+// one disk. The disk is marked in use until it is unmounted, so
+// the next mount can tell whether this session ended cleanly.
+bool BasicFileSys::mount()
 {
   // mount the disk
-  bool new_disk = disk.mount("DISK");
+  bool new_disk;
+  if (!disk.mount(DISK_FILE, new_disk)) {
+    return false;
+  }
 
-  // if the disk exists, return as no further initialization is needed
-  if (!new_disk) return;
+  // if the disk exists, only check that its layout is the one we expect
+  if (!new_disk) {
+    struct volblock_t vol_block;
+    disk.read_block(2, (void *) &vol_block);
+    if (vol_block.magic != VOLUME_MAGIC_NUM ||
+        vol_block.version != VOLUME_VERSION) {
+      std::cerr << DISK_FILE << ": unsupported format (remove " << DISK_FILE
+                << " or " << DISK_FILE << ".* to reformat)" << std::endl;
+      disk.unmount();
+      return false;
+    }
+    journal.replay();
+    disk.read_block(VOLUME_BLOCK, (void *) &vol_block);
+    was_clean = (vol_block.clean == 1);
+  } else {
+    format();
+    was_clean = true;
+  }
+  set_clean(false);
+  if (getenv(IOSTAT_ENV) != NULL) {
+    iostat.enable(true);
+  }
+  cache.start();
 
-  // initialize the superblock
+  // keep the bitmap in memory while mounted
+  struct superblock_t super_block;
+  read_block(0, (void *) &super_block);
+  for (int w = 0; w < BITMAP_WORDS; w++) {
+    unsigned int word = 0;
+    for (int i = 0; i < 4; i++) {
+      word |= (unsigned int) super_block.bitmap[w * 4 + i] << (8 * i);
+    }
+    bitmap[w] = word;
+  }
+  cached_blocks = 0;
+  return true;
+}
+
+// Formats a new disk: initializes blocks 0 (superblock), 1 (root
+// directory), 2 (volume block) and the journal, and zeroes all other
+// blocks.
+void BasicFileSys::format()
+{
+  // initialize the superblock; blocks 0, 1, 2 and the journal are used
   struct superblock_t super_block;
-  super_block.bitmap[0] = 0x3;		// mark blocks 0 and 1 as used
-  for (int i = 1; i < BLOCK_SIZE; i++) {
+  for (int i = 0; i < BLOCK_SIZE; i++) {
     super_block.bitmap[i] = 0;
   }
+  for (int i = 0; i < FIRST_FREE_BLOCK; i++) {
+    super_block.bitmap[i / 8] |= 1 << (i % 8);
+  }
   disk.write_block(0, (void *) &super_block);
 
   // initialize the root directory
   struct dirblock_t dir_block;
-  dir_block.magic = DIR_MAGIC_NUM;
-  dir_block.num_entries = 0;
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-    dir_block.dir_entries[i].block_num = 0;
-  }
+  dir_init(dir_block, ROOT_BLOCK);	// root is its own parent
   disk.write_block(1, (void *) &dir_block);
 
-  // write a zeroed-out data block to all other blocks on disk
-  struct datablock_t data_block;
-  for (int i = 0; i < BLOCK_SIZE; i++) {
-    data_block.data[i] = 0;
+  // initialize the volume block; the name index starts out disabled
+  struct volblock_t vol_block;
+  vol_block.magic = VOLUME_MAGIC_NUM;
+  vol_block.version = VOLUME_VERSION;
+  vol_block.index_block = 0;
+  vol_block.snap_table = 0;
+  vol_block.clean = 0;
+  for (int i = 0; i < (int) sizeof(vol_block.reserved); i++) {
+    vol_block.reserved[i] = 0;
   }
-  for (int i = 2; i < NUM_BLOCKS; i++) {
-    disk.write_block(i, (void *) &data_block);
+  disk.write_block(2, (void *) &vol_block);
+
+  // write a zeroed-out data block to all other blocks on disk, as one
+  // batch so the members of a striped disk are written at once
+  std::vector<short> nums;
+  for (int i = FIRST_FREE_BLOCK; i < NUM_BLOCKS; i++) {
+    nums.push_back(i);
   }
+  std::vector<datablock_t> zeros(nums.size());
+  memset(zeros.data(), 0, zeros.size() * BLOCK_SIZE);
+  disk.write_blocks(nums.data(), nums.size(), zeros.data());
+
+  journal.format();
 }
 
 // Unmounts the disk
 void BasicFileSys::unmount()
 {
+  // take back every thread's reservations
+  {
+    std::lock_guard<std::mutex> guard(caches_mutex);
+    for (std::set<alloc_cache_t *>::iterator it = caches.begin();
+         it != caches.end(); ++it) {
+      std::lock_guard<std::mutex> cache_guard((*it)->lock);
+      clear_bits((*it)->blocks, (*it)->count);
+      (*it)->count = 0;
+      (*it)->owner = NULL;
+    }
+    caches.clear();
+    cached_blocks = 0;
+  }
+  write_bitmap();
+  flush_bitmap();
+
+  // everything is home once the cache is flushed, so the journal can go
+  cache.stop();
+  journal.reset();
+  set_clean(true);
+  disk.flush();
   disk.unmount();
+
+  const char *dump = getenv(IOSTAT_ENV);
+  if (dump != NULL && iostat.enabled()) {
+    std::ofstream out(dump);
+    iostat.print(out);
+  }
 }
 
-// Gets a free block from the disk.
+// Returns true if the last session unmounted the disk cleanly
+bool BasicFileSys::mounted_clean()
+{
+  return was_clean;
+}
+
+// Gets a free block from the disk. Blocks come from the calling thread's
+// cache, which is refilled with a batch from the bitmap when empty. The
+// superblock is left for the next commit or sync to update.
 short BasicFileSys::get_free_block()
 {
-  // get superblock
-  struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
-  
-  // look for first available block
-  for (int byte = 0; byte < BLOCK_SIZE; byte++) {
-
-    // check to see if byte has available slot
-    if (super_block.bitmap[byte] != 0xFF) {
- 
-      // loop to check each bit
-      for (int bit = 0; bit < 8; bit++) {
-        int mask = 1 << bit;
-	if (mask & ~super_block.bitmap[byte]) {
-
-          // Available block is found: set bit in bitmap, write result back
-	  // to superblock, and return block number.
-	  super_block.bitmap[byte] |= mask;
-	  disk.write_block(0, (void *) &super_block);
-	  return (byte * 8) + bit;
-	}
-      }
+  alloc_cache_t &cache = thread_cache();
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    if (cache.count > 0) {
+      cached_blocks--;
+      return cache.blocks[--cache.count];
     }
   }
 
-  // disk is full
-  return 0;
+  // claim a batch; other threads' reservations are only taken back when
+  // the bitmap has nothing left
+  short batch[ALLOC_BATCH];
+  int found = claim_bits(batch, ALLOC_BATCH, cache.first_word);
+  if (found == 0) {
+    drain_caches();
+    found = claim_bits(batch, 1, cache.first_word);
+    if (found == 0) {
+      return 0;		// disk is full
+    }
+  }
+  write_bitmap();
+
+  // keep the rest, so they are handed out in the order claimed
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    for (int i = found - 1; i >= 1; i--) {
+      cache.blocks[cache.count++] = batch[i];
+    }
+    cached_blocks += found - 1;
+  }
+  return batch[0];
 }
   
-// Reclaims block making it available for future use.
+// Gets count free blocks from the disk with a single update of the
+// superblock. Returns false, allocating nothing, if the disk does not
+// have count free blocks.
+bool BasicFileSys::get_free_blocks(int count, short *blocks)
+{
+  // use up the thread's reservations first
+  alloc_cache_t &cache = thread_cache();
+  int found = 0;
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    while (found < count && cache.count > 0) {
+      blocks[found++] = cache.blocks[--cache.count];
+      cached_blocks--;
+    }
+  }
+
+  found += claim_bits(blocks + found, count - found, cache.first_word);
+  if (found < count) {
+    drain_caches();
+    found += claim_bits(blocks + found, count - found, cache.first_word);
+  }
+
+  if (found < count) {
+    clear_bits(blocks, found);
+    write_bitmap();
+    return false;
+  }
+  write_bitmap();
+  return true;
+}
+
+// Allocates exactly the blocks listed. Each bit is set with one atomic
+// or; if a block turns out to be in use, the bits set so far are cleared
+// again.
+bool BasicFileSys::claim_blocks(const short *blocks, int count)
+{
+  for (int i = 0; i < count; i++) {
+    unsigned int bit = 1u << (blocks[i] % 32);
+    if (bitmap[blocks[i] / 32].fetch_or(bit) & bit) {
+      clear_bits(blocks, i);
+      return false;
+    }
+  }
+  write_bitmap();
+  return true;
+}
+
+// Reclaims block making it available for future use. The block is kept
+// in the calling thread's cache if it has room. In a transaction the
+// block is only freed once the transaction has committed.
 void BasicFileSys::reclaim_block(short block_num)
 {
-  // get superblock
-  struct superblock_t super_block;
-  disk.read_block(0, (void *) &super_block);
+  txn_t *txn = current_txn();
+  if (txn != NULL) {
+    txn->freed.push_back(block_num);
+    return;
+  }
 
-  // clear bit
-  int byte = block_num / 8;		// byte number
-  int bit = block_num % 8;		// bit number
-  unsigned char mask = ~(1 << bit);	// mask to clear bit
-  super_block.bitmap[byte] &= mask;
+  discard_blocks(&block_num, 1);
+  alloc_cache_t &cache = thread_cache();
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    if (cache.count < ALLOC_CACHE_MAX) {
+      cache.blocks[cache.count++] = block_num;
+      cached_blocks++;
+      return;
+    }
+  }
 
-  // write back superblock
-  disk.write_block(0, (void *) &super_block);
+  clear_bits(&block_num, 1);
+  write_bitmap();
 }
   
+// Reclaims count blocks with a single update of the superblock. In a
+// transaction the blocks are only freed once it has committed.
+void BasicFileSys::reclaim_blocks(const short *blocks, int count)
+{
+  txn_t *txn = current_txn();
+  if (txn != NULL) {
+    txn->freed.insert(txn->freed.end(), blocks, blocks + count);
+    return;
+  }
+  discard_blocks(blocks, count);
+  free_blocks(blocks, count);
+}
+
+// Gives back count blocks that were never used. Nothing refers to them,
+// so there is no commit to wait for.
+void BasicFileSys::return_blocks(const short *blocks, int count)
+{
+  free_blocks(blocks, count);
+}
+
+// Returns count blocks to the thread's cache and the bitmap
+void BasicFileSys::free_blocks(const short *blocks, int count)
+{
+  if (count == 0) return;
+
+  // top up the thread's cache, return the rest to the bitmap
+  alloc_cache_t &cache = thread_cache();
+  int kept = 0;
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    while (kept < count && cache.count < ALLOC_CACHE_MAX) {
+      cache.blocks[cache.count++] = blocks[kept++];
+      cached_blocks++;
+    }
+  }
+
+  if (kept < count) {
+    clear_bits(blocks + kept, count - kept);
+    write_bitmap();
+  }
+}
+
+// Punches every free block out of the disk image. Reservations are taken
+// back first so their blocks are punched too.
+int BasicFileSys::trim(int &runs)
+{
+  drain_caches();
+  std::vector<short> free_list;
+  for (int b = FIRST_FREE_BLOCK; b < NUM_BLOCKS; b++) {
+    if (!(bitmap[b / 32] & (1u << (b % 32)))) {
+      free_list.push_back(b);
+    }
+  }
+  std::vector<short> nums;
+  discardable(free_list.data(), free_list.size(), nums);
+  cache.discard(nums.data(), nums.size());
+
+  runs = 0;
+  for (size_t i = 0; i < nums.size(); i++) {
+    if (i == 0 || nums[i] != nums[i - 1] + 1) {
+      runs++;
+    }
+  }
+  return nums.size();
+}
+
+// Returns the number of free blocks, counting blocks reserved but not
+// yet handed out by thread caches.
+int BasicFileSys::num_free_blocks()
+{
+  int free_blocks = cached_blocks;
+  for (int w = 0; w < BITMAP_WORDS; w++) {
+    unsigned int word = bitmap[w];
+    for (int bit = 0; bit < 32; bit++) {
+      if (!(word & (1u << bit))) {
+        free_blocks++;
+      }
+    }
+  }
+  return free_blocks;
+}
+
 // Reads block from disk. Output parameter block points to new block.
+// The calling thread's open transaction is looked at first.
 void BasicFileSys::read_block(short block_num, void *block) {
-  disk.read_block(block_num, block);
+  IoTimer timer(iostat);
+  txn_t *txn = current_txn();
+  std::map<short, datablock_t>::iterator it;
+  if (txn != NULL && (it = txn->blocks.find(block_num)) != txn->blocks.end()) {
+    memcpy(block, &it->second, BLOCK_SIZE);
+  } else {
+    cache.read(block_num, block);
+  }
+  timer.done(IO_LEVEL_CALL, IO_OP_READ, &block_num, 1, block);
 }
 
-// Writes block to disk. Input block points to block to write.
+// Writes block to disk. Input block points to block to write. The block
+// is written back to the disk later; see sync(). In a transaction the
+// block is kept until the transaction commits.
 void BasicFileSys::write_block(short block_num, void *block) {
-  disk.write_block(block_num, block);
+  IoTimer timer(iostat);
+  stage_block(block_num, block);
+  timer.done(IO_LEVEL_CALL, IO_OP_WRITE, &block_num, 1, block);
+}
+
+// Helper that writes a metadata block: to the transaction if the calling
+// thread has one open, else to the cache
+void BasicFileSys::stage_block(short block_num, void *block) {
+  if (write_hook != NULL) {
+    write_hook->before_write(block_num);
+  }
+
+  txn_t *txn = current_txn();
+  if (txn == NULL) {
+    cache.write(block_num, block);
+    return;
+  }
+  memcpy(&txn->blocks[block_num], block, BLOCK_SIZE);
+}
+
+// Reads count blocks as one batch; blocks not cached are read from the
+// disk in ascending block order and a block named twice is read once.
+void BasicFileSys::read_blocks(const short *block_nums, int count, void *blocks)
+{
+  IoTimer timer(iostat);
+  cache.read_batch(block_nums, count, blocks);
+
+  txn_t *txn = current_txn();
+  if (txn != NULL) {
+    char *bufs = (char *) blocks;
+    for (int i = 0; i < count; i++) {
+      std::map<short, datablock_t>::iterator it = txn->blocks.find(block_nums[i]);
+      if (it != txn->blocks.end()) {
+        memcpy(bufs + i * BLOCK_SIZE, &it->second, BLOCK_SIZE);
+      }
+    }
+  }
+  timer.done(IO_LEVEL_CALL, IO_OP_READ, block_nums, count, blocks);
+}
+
+// Writes count blocks as one batch. Like write_block they reach the disk
+// later.
+void BasicFileSys::write_blocks(const short *block_nums, int count, void *blocks)
+{
+  IoTimer timer(iostat);
+  if (current_txn() == NULL) {
+    if (write_hook != NULL) {
+      for (int i = 0; i < count; i++) {
+        write_hook->before_write(block_nums[i]);
+      }
+    }
+    cache.write_batch(block_nums, count, blocks);
+  } else {
+    char *bufs = (char *) blocks;
+    for (int i = 0; i < count; i++) {
+      stage_block(block_nums[i], bufs + i * BLOCK_SIZE);
+    }
+  }
+  timer.done(IO_LEVEL_CALL, IO_OP_WRITE, block_nums, count, blocks);
+}
+
+// Writes a data file block. It is not logged, but reaches the disk before
+// the transaction that wrote it commits.
+void BasicFileSys::write_data_block(short block_num, void *block)
+{
+  write_data_blocks(&block_num, 1, block);
+}
+
+// Writes count data file blocks like write_data_block.
+void BasicFileSys::write_data_blocks(const short *block_nums, int count,
+                                     void *blocks)
+{
+  IoTimer timer(iostat);
+  if (write_hook != NULL) {
+    for (int i = 0; i < count; i++) {
+      write_hook->before_write(block_nums[i]);
+    }
+  }
+  cache.write_batch(block_nums, count, blocks);
+
+  txn_t *txn = current_txn();
+  if (txn != NULL) {
+    txn->data_blocks.insert(txn->data_blocks.end(), block_nums,
+                            block_nums + count);
+  }
+  timer.done(IO_LEVEL_CALL, IO_OP_WRITE, block_nums, count, blocks, true);
+}
+
+// Starts a transaction on the calling thread. Transactions nest; only the
+// outermost one commits.
+void BasicFileSys::begin_transaction()
+{
+  if (local_txn.depth == 0) {
+    local_txn.owner = this;
+  }
+  local_txn.depth++;
+}
+
+// Ends a transaction. The outermost one commits: it returns once its
+// blocks are in the journal, and then frees the blocks it reclaimed.
+void BasicFileSys::commit_transaction()
+{
+  txn_t &txn = local_txn;
+  if (--txn.depth > 0) {
+    return;
+  }
+
+  commit(txn);
+  txn.owner = NULL;
+}
+
+// Returns true if the calling thread's transaction can write count more
+// metadata blocks and still commit as one journal record
+bool BasicFileSys::txn_has_room(int count)
+{
+  txn_t *txn = current_txn();
+  int used = txn != NULL ? txn->blocks.size() : 0;
+  return used + count <= TXN_MAX_BLOCKS;
+}
+
+// Locks m until the calling thread's transaction has committed. Outside
+// a transaction m is only waited for.
+void BasicFileSys::lock_until_commit(std::mutex &m)
+{
+  txn_t *txn = current_txn();
+  if (txn == NULL) {
+    std::lock_guard<std::mutex> guard(m);
+    return;
+  }
+  if (std::find(txn->held.begin(), txn->held.end(), &m) == txn->held.end()) {
+    m.lock();
+    txn->held.push_back(&m);
+  }
+}
+
+// Runs fn once the calling thread's transaction has committed, or now
+// outside a transaction.
+void BasicFileSys::after_commit(const std::function<void()> &fn)
+{
+  txn_t *txn = current_txn();
+  if (txn == NULL) {
+    fn();
+    return;
+  }
+  txn->after.push_back(fn);
+}
+
+// Writes every changed block back to the disk, after bringing the
+// superblock up to date, and waits until the host has stored them.
+void BasicFileSys::sync()
+{
+  flush_bitmap();
+  cache.sync();
+  disk.flush();
+}
+
+// Writes the listed blocks back to the disk if they changed, and waits
+// until the host has stored them.
+void BasicFileSys::sync_blocks(const short *block_nums, int count)
+{
+  cache.sync_blocks(block_nums, count);
+  disk.flush();
+}
+
+// Returns true if the block is in the block cache.
+bool BasicFileSys::is_cached(short block_num)
+{
+  return cache.contains(block_num);
+}
+
+// Starts reading blocks into the block cache in the background.
+void BasicFileSys::prefetch_blocks(const short *block_nums, int count)
+{
+  cache.prefetch(block_nums, count);
+}
+
+// Copies the block cache counters into stats.
+void BasicFileSys::cache_stats(cache_stats_t &stats)
+{
+  cache.get_stats(stats);
+}
+
+// Block I/O counters and latency histograms.
+IoStats &BasicFileSys::io_stats()
+{
+  return iostat;
+}
+
+// Sets the hook told about overwrites (NULL for none).
+void BasicFileSys::set_write_hook(WriteHook *hook)
+{
+  write_hook = hook;
+}
+
+// Writes count metadata blocks as a transaction of their own. It goes
+// through the commit queue like any other, so it may share a journal
+// record, but the caller's open transaction is not part of it.
+void BasicFileSys::commit_blocks(const short *block_nums, int count,
+                                 const void *blocks)
+{
+  txn_t txn;
+  txn.owner = this;
+  txn.bitmap_dirty = true;
+  const datablock_t *images = (const datablock_t *) blocks;
+  for (int i = 0; i < count; i++) {
+    txn.blocks[block_nums[i]] = images[i];
+  }
+  commit(txn);
+}
+
+// Copies the bitmap into super_block, after taking back every thread's
+// reservations.
+void BasicFileSys::copy_bitmap(superblock_t &super_block)
+{
+  drain_caches();
+  snapshot_bitmap(super_block);
+}
+
+// Replaces the bitmap with the one in super_block. Reservations are
+// taken back first; they may be in use under the new bitmap.
+void BasicFileSys::restore_bitmap(const superblock_t &super_block)
+{
+  drain_caches();
+  for (int w = 0; w < BITMAP_WORDS; w++) {
+    unsigned int word = 0;
+    for (int i = 0; i < 4; i++) {
+      word |= (unsigned int) super_block.bitmap[w * 4 + i] << (8 * i);
+    }
+    bitmap[w] = word;
+  }
+  write_bitmap();
+}
+
+// HELPER FUNCTIONS
+
+// Returns the calling thread's cache, moving it to this file system if
+// it last served another one. A cache joining the file system is given
+// the next starting word, ALLOC_SPREAD words on from the last one.
+alloc_cache_t &BasicFileSys::thread_cache()
+{
+  alloc_cache_t &cache = local_cache;
+  BasicFileSys *fs;
+  {
+    std::lock_guard<std::mutex> guard(cache.lock);
+    fs = cache.owner;
+  }
+  if (fs != this) {
+    if (fs != NULL) {
+      fs->release_cache(cache);
+    }
+    std::lock_guard<std::mutex> guard(caches_mutex);
+    std::lock_guard<std::mutex> cache_guard(cache.lock);
+    cache.owner = this;
+    cache.first_word = next_first_word.fetch_add(1) * ALLOC_SPREAD % BITMAP_WORDS;
+    caches.insert(&cache);
+  }
+  return cache;
+}
+
+// Returns the blocks of a cache to the bitmap and forgets the cache
+void BasicFileSys::release_cache(alloc_cache_t &cache)
+{
+  {
+    std::lock_guard<std::mutex> guard(caches_mutex);
+    std::lock_guard<std::mutex> cache_guard(cache.lock);
+    if (cache.owner != this) {
+      return;		// already taken back by unmount
+    }
+    clear_bits(cache.blocks, cache.count);
+    cached_blocks -= cache.count;
+    cache.count = 0;
+    cache.owner = NULL;
+    caches.erase(&cache);
+  }
+  write_bitmap();
+}
+
+// Returns the reservations of every thread to the bitmap
+void BasicFileSys::drain_caches()
+{
+  std::lock_guard<std::mutex> guard(caches_mutex);
+  for (std::set<alloc_cache_t *>::iterator it = caches.begin();
+       it != caches.end(); ++it) {
+    std::lock_guard<std::mutex> cache_guard((*it)->lock);
+    clear_bits((*it)->blocks, (*it)->count);
+    cached_blocks -= (*it)->count;
+    (*it)->count = 0;
+  }
+}
+
+// Marks up to count free blocks used and stores their numbers in blocks.
+// The words are searched from first_word on, wrapping around, so threads
+// that start at different words do not contend for the same one. Each
+// word is claimed with compare-and-swap, so threads never wait on each
+// other. Returns the number claimed.
+int BasicFileSys::claim_bits(short *blocks, int count, int first_word)
+{
+  int found = 0;
+  for (int i = 0; i < BITMAP_WORDS && found < count; i++) {
+    int w = (first_word + i) % BITMAP_WORDS;
+    unsigned int old_word = bitmap[w].load();
+    while (old_word != 0xFFFFFFFFu) {
+      // set as many clear bits as are still needed
+      unsigned int new_word = old_word;
+      int taken = 0;
+      for (int bit = 0; bit < 32 && found + taken < count; bit++) {
+        if (!(new_word & (1u << bit))) {
+          new_word |= 1u << bit;
+          taken++;
+        }
+      }
+
+      if (bitmap[w].compare_exchange_weak(old_word, new_word)) {
+        unsigned int claimed = new_word & ~old_word;
+        for (int bit = 0; bit < 32; bit++) {
+          if (claimed & (1u << bit)) {
+            blocks[found++] = w * 32 + bit;
+          }
+        }
+        break;
+      }
+      // another thread changed the word first; old_word has its value
+    }
+  }
+  return found;
+}
+
+// Drops freed blocks from the cache and punches them out of the disk
+// image. The host only gives back whole pages, so each hole is widened
+// to the pages it touches with the free blocks stored in them; on a
+// striped disk those are not the neighbours in the volume. They are
+// held in the resident bitmap while they are punched, so no thread can
+// allocate and write one meanwhile.
+void BasicFileSys::discard_blocks(const short *blocks, int count)
+{
+  std::vector<short> nums;
+  discardable(blocks, count, nums);
+  if (nums.empty()) return;
+
+  bool listed[NUM_BLOCKS] = { false };
+  for (size_t i = 0; i < nums.size(); i++) {
+    listed[nums[i]] = true;
+  }
+  std::vector<short> borrowed;
+  std::vector<short> page;
+  for (size_t i = 0, n = nums.size(); i < n; i++) {
+    disk.page_blocks(nums[i], page);
+    for (size_t p = 0; p < page.size(); p++) {
+      short b = page[p];
+      unsigned int bit = 1u << (b % 32);
+      if (b < FIRST_FREE_BLOCK || listed[b] ||
+          (bitmap[b / 32].fetch_or(bit) & bit)) {
+        continue;
+      }
+      listed[b] = true;
+      borrowed.push_back(b);
+      if (write_hook == NULL || !write_hook->keeps_freed(b)) {
+        nums.push_back(b);
+      }
+    }
+  }
+  cache.discard(nums.data(), nums.size());
+  clear_bits(borrowed.data(), borrowed.size());
+}
+
+// Sets nums to the blocks that may be punched: those past the fixed area
+// that the write hook does not still need (old contents a snapshot has
+// not copied yet)
+void BasicFileSys::discardable(const short *blocks, int count,
+                               std::vector<short> &nums)
+{
+  for (int i = 0; i < count; i++) {
+    if (blocks[i] >= FIRST_FREE_BLOCK &&
+        (write_hook == NULL || !write_hook->keeps_freed(blocks[i]))) {
+      nums.push_back(blocks[i]);
+    }
+  }
+}
+
+// Marks count blocks free in the resident bitmap
+void BasicFileSys::clear_bits(const short *blocks, int count)
+{
+  for (int i = 0; i < count; i++) {
+    bitmap[blocks[i] / 32].fetch_and(~(1u << (blocks[i] % 32)));
+  }
+}
+
+// Notes that the resident bitmap changed. In a transaction the group
+// writer logs a fresh snapshot when it commits; otherwise the superblock
+// is brought up to date by the next commit, sync or unmount. Either way
+// allocating and freeing take no lock. The superblock on the disk may
+// lag the bitmap until then, which only leaks blocks if the system
+// crashes.
+void BasicFileSys::write_bitmap()
+{
+  txn_t *txn = current_txn();
+  if (txn != NULL) {
+    txn->bitmap_dirty = true;
+  } else if (!bitmap_pending.load()) {
+    bitmap_pending = true;
+  }
+}
+
+// Writes the resident bitmap back to the superblock if it changed since
+// the last write. The snapshot is taken under super_mutex, so the last
+// write carries every change made before it started.
+void BasicFileSys::flush_bitmap()
+{
+  if (!bitmap_pending.exchange(false)) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(super_mutex);
+  struct superblock_t super_block;
+  snapshot_bitmap(super_block);
+  cache.write(SUPER_BLOCK, (void *) &super_block);
+}
+
+// Copies the resident bitmap into a superblock
+void BasicFileSys::snapshot_bitmap(superblock_t &super_block)
+{
+  for (int w = 0; w < BITMAP_WORDS; w++) {
+    unsigned int word = bitmap[w];
+    for (int i = 0; i < 4; i++) {
+      super_block.bitmap[w * 4 + i] = (word >> (8 * i)) & 0xFF;
+    }
+  }
+}
+
+// Sets the clean flag of the volume block on the disk itself; the cache
+// is not running when it is called
+void BasicFileSys::set_clean(bool clean)
+{
+  struct volblock_t vol_block;
+  disk.read_block(VOLUME_BLOCK, (void *) &vol_block);
+  vol_block.clean = clean ? 1 : 0;
+  disk.write_block(VOLUME_BLOCK, (void *) &vol_block);
+}
+
+// Returns the calling thread's open transaction on this file system, or
+// NULL if there is none
+txn_t *BasicFileSys::current_txn()
+{
+  if (local_txn.depth > 0 && local_txn.owner == this) {
+    return &local_txn;
+  }
+  return NULL;
+}
+
+// Commits what a transaction has written, releases the locks it held
+// until then and frees the blocks it reclaimed. The transaction joins
+// the queue; the first thread to find no group being written writes
+// everything queued that fits in the journal as one group, so
+// concurrent commits share one journal write.
+void BasicFileSys::commit(txn_t &txn)
+{
+  if (!txn.blocks.empty() || txn.bitmap_dirty) {
+    std::unique_lock<std::mutex> lock(commit_mutex);
+    txn.committed = false;
+    commit_queue.push_back(&txn);
+    while (!txn.committed) {
+      if (committing) {
+        commit_cv.wait(lock);
+        continue;
+      }
+
+      // one block is kept for the bitmap
+      committing = true;
+      std::vector<txn_t *> group;
+      int count = 1;
+      while (!commit_queue.empty()) {
+        int n = commit_queue.front()->blocks.size();
+        if (!group.empty() &&
+            Journal::record_size(count + n) > JOURNAL_BLOCKS - 1) {
+          break;
+        }
+        group.push_back(commit_queue.front());
+        commit_queue.pop_front();
+        count += n;
+      }
+
+      lock.unlock();
+      write_group(group);
+      lock.lock();
+
+      for (size_t i = 0; i < group.size(); i++) {
+        group[i]->committed = true;
+      }
+      committing = false;
+      commit_cv.notify_all();
+    }
+  }
+
+  std::vector<std::function<void()> > after;
+  after.swap(txn.after);
+  for (size_t i = 0; i < after.size(); i++) {
+    after[i]();
+  }
+  for (size_t i = 0; i < txn.held.size(); i++) {
+    txn.held[i]->unlock();
+  }
+  txn.held.clear();
+
+  std::vector<short> freed;
+  freed.swap(txn.freed);
+  txn.blocks.clear();
+  txn.data_blocks.clear();
+  txn.bitmap_dirty = false;
+  discard_blocks(freed.data(), freed.size());
+  free_blocks(freed.data(), freed.size());
+}
+
+// Writes a group of transactions to the journal as one record and hands
+// their blocks to the cache, later transactions overriding earlier ones.
+// The group's data blocks are written back first. When the journal is
+// full, every dirty block is written home before it is emptied. A
+// transaction that did not keep to TXN_MAX_BLOCKS cannot be one record;
+// it is logged in parts, each handed to the cache before the next, and
+// a crash may leave only some of them applied.
+void BasicFileSys::write_group(const std::vector<txn_t *> &group)
+{
+  std::map<short, datablock_t> merged;
+  std::vector<short> data_blocks;
+  bool bitmap_dirty = false;
+  for (size_t i = 0; i < group.size(); i++) {
+    for (std::map<short, datablock_t>::iterator it = group[i]->blocks.begin();
+         it != group[i]->blocks.end(); ++it) {
+      merged[it->first] = it->second;
+    }
+    data_blocks.insert(data_blocks.end(), group[i]->data_blocks.begin(),
+                       group[i]->data_blocks.end());
+    bitmap_dirty = bitmap_dirty || group[i]->bitmap_dirty;
+  }
+  bitmap_dirty = bitmap_pending.exchange(false) || bitmap_dirty;
+  cache.sync_blocks(data_blocks.data(), data_blocks.size());
+
+  // Frees wait for the commit, so the snapshot frees nothing still in
+  // use. It may hold allocations of transactions not yet committed,
+  // which only leaks their blocks if the system crashes. super_mutex is
+  // held until the cache has the snapshot, so an older one never
+  // replaces a newer one there.
+  std::lock_guard<std::mutex> guard(super_mutex);
+  if (bitmap_dirty) {
+    struct superblock_t super_block;
+    snapshot_bitmap(super_block);
+    memcpy(&merged[SUPER_BLOCK], &super_block, BLOCK_SIZE);
+  }
+
+  std::vector<short> nums;
+  std::vector<datablock_t> images;
+  for (std::map<short, datablock_t>::iterator it = merged.begin();
+       it != merged.end(); ++it) {
+    nums.push_back(it->first);
+    images.push_back(it->second);
+  }
+
+  for (size_t done = 0; done < nums.size(); ) {
+    int n = std::min(nums.size() - done, (size_t) TXN_MAX_BLOCKS + 1);
+    if (!journal.has_room(n)) {
+      cache.sync();
+      journal.reset();
+    }
+    journal.append(&nums[done], n, &images[done]);
+    cache.write_batch(&nums[done], n, &images[done]);
+    done += n;
+  }
 }
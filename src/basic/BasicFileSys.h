@@ -5,33 +5,294 @@
 #ifndef BASIC_FILESYS_H
 #define BASIC_FILESYS_H
 
-#include "Disk.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "Blocks.h"
+#include "BlockCache.h"
+#include "IoStats.h"
+#include "Journal.h"
+#include "StripedDisk.h"
+
+// number of 32-bit words in the resident bitmap
+const int BITMAP_WORDS = NUM_BLOCKS / 32;
+
+// free blocks a thread reserves at a time, and the most it keeps
+const int ALLOC_BATCH = 8;
+const int ALLOC_CACHE_MAX = 16;
+
+// bitmap words between the words at which successive threads start
+// looking for free blocks; odd, so every word is used before one repeats
+const int ALLOC_SPREAD = 5;
+
+// most metadata blocks a transaction may write. With the bitmap and
+// their descriptors they fill the journal, so a transaction this size
+// commits as one record once the journal is emptied.
+const int TXN_MAX_BLOCKS = 60;
+
+// host file holding the disk image, or the first of DISK.0, DISK.1, ...
+// if it is striped (see StripedDisk.h)
+const char *const DISK_FILE = "DISK";
+
+// environment variable naming a file: if it is set, I/O is counted from
+// mount and the counters are written to the file on unmount
+const char *const IOSTAT_ENV = "FILESYS_IOSTAT";
+
+struct alloc_cache_t;
+struct txn_t;
+
+// Told about a block before write_block, write_blocks or the data block
+// writes overwrite it, so its old contents can be kept elsewhere first,
+// and asked before the contents of a freed block are discarded.
+class WriteHook {
+
+  public:
+    virtual ~WriteHook() {}
+
+    // Called before block_num is overwritten. May read blocks, allocate
+    // blocks and call commit_blocks, but not write blocks itself.
+    virtual void before_write(short block_num) = 0;
+
+    // Returns true if the old contents of block_num are still needed
+    // after the live tree frees it, so it must not be punched out.
+    virtual bool keeps_freed(short block_num) = 0;
+};
 
 // Basic File 
+// One BasicFileSys can be shared by several threads. The free-block
+// bitmap stays in memory while mounted and its words are claimed with
+// compare-and-swap. Each thread keeps a small cache of reserved free
+// blocks, so most allocations and frees touch no shared state; each
+// thread starts its search of the bitmap at a word of its own, so
+// threads refilling their caches at once claim different words. The
+// superblock copy of the bitmap is brought up to date when a
+// transaction commits and on sync, not on every change. Blocks are read
+// and written through a block cache.
+//
+// Metadata changes are made in transactions (see Transaction below). The
+// blocks a transaction writes stay private to its thread until it
+// commits; commits that arrive together are written to the journal as
+// one record, and only then handed to the cache. A transaction is never
+// split: operations that may write more than TXN_MAX_BLOCKS blocks ask
+// txn_has_room before they change anything. Data blocks are written
+// to the disk before the metadata that refers to them is committed, and
+// blocks freed in a transaction become free once it has committed.
+// Freed blocks are punched out of the host image (see discard_blocks).
 class BasicFileSys {
 
   public:
+    BasicFileSys();
+
     // Mounts the disk.  If the disk is new, it formats the disk by
-    // initializing special blocks 0 (superblock) and 1 (root directory). 
-    void mount();
+    // initializing special blocks 0 (superblock), 1 (root directory), 2
+    // (volume block) and the journal. Otherwise the journal is replayed.
+    // Returns false if an existing disk was formatted with a different
+    // layout.
+    bool mount();
 
-    // Unmounts the disk.
+    // Unmounts the disk. Blocks reserved by thread caches are returned
+    // first, so no thread may be allocating. The disk is then marked
+    // clean.
     void unmount();
 
+    // Returns true if the session before this mount unmounted the disk
+    // cleanly (or the disk is new), so its bitmap can be trusted.
+    bool mounted_clean();
+
     // Gets a free block from the disk.
     short get_free_block();
   
+    // Gets count free blocks with one superblock update. Returns false,
+    // allocating nothing, if there are not enough free blocks.
+    bool get_free_blocks(int count, short *blocks);
+  
+    // Allocates exactly the count blocks listed. Returns false,
+    // allocating nothing, if any of them is in use.
+    bool claim_blocks(const short *blocks, int count);
+
     // Reclaims block making it available for future use.
     void reclaim_block(short block_num);
 
+    // Reclaims count blocks with one superblock update.
+    void reclaim_blocks(const short *blocks, int count);
+
+    // Gives back count blocks that were allocated but never written or
+    // referenced. Unlike reclaim_blocks they are free at once, even in a
+    // transaction.
+    void return_blocks(const short *blocks, int count);
+
+    // Punches every free block out of the disk image, so it reads back as
+    // zeros and takes no space on the host. Returns the blocks punched
+    // and sets runs to the holes they made. No other thread may be
+    // allocating or freeing blocks.
+    int trim(int &runs);
+
+    // Returns the number of free blocks, counting blocks reserved but not
+    // yet handed out by thread caches.
+    int num_free_blocks();
+
     // Reads block from disk. Output parameter block points to new block.
     void read_block(short block_num, void *block);
   
-    // Writes block to disk. Input block points to block to write.
+    // Writes block to disk. Input block points to block to write. The
+    // block is written back to the disk later; see sync().
     void write_block(short block_num, void *block);
 
+    // Reads count blocks into the consecutive BLOCK_SIZE buffers at
+    // blocks, as one batch issued in ascending block order. A block named
+    // twice is read once.
+    void read_blocks(const short *block_nums, int count, void *blocks);
+
+    // Writes count blocks from the consecutive BLOCK_SIZE buffers at
+    // blocks. Like write_block they reach the disk later.
+    void write_blocks(const short *block_nums, int count, void *blocks);
+
+    // Writes a data file block. Unlike write_block it is not logged in
+    // the journal, but it reaches the disk before the transaction that
+    // wrote it commits.
+    void write_data_block(short block_num, void *block);
+
+    // Writes count data file blocks like write_data_block.
+    void write_data_blocks(const short *block_nums, int count, void *blocks);
+
+    // Starts a transaction on the calling thread. Transactions nest; only
+    // the outermost one commits.
+    void begin_transaction();
+
+    // Ends a transaction started by begin_transaction. The outermost one
+    // returns once its blocks are in the journal.
+    void commit_transaction();
+
+    // Returns true if the calling thread's transaction can write count
+    // more metadata blocks and still commit as one journal record. An
+    // operation that may write many blocks asks before it changes
+    // anything, and fails if the answer is no.
+    bool txn_has_room(int count);
+
+    // Locks m until the calling thread's transaction has committed, if
+    // the transaction does not hold it already. Blocks that transactions
+    // on several threads update (the name index) are guarded this way, so
+    // that no transaction works on a copy another one has changed but
+    // not committed. Outside a transaction it only waits for m to be free.
+    void lock_until_commit(std::mutex &m);
+
+    // Runs fn once the calling thread's transaction has committed, before
+    // the locks it holds until then are released; outside a transaction,
+    // at once. Caches of what the transaction changed are dropped this
+    // way, so no other thread can fill them again from the old blocks.
+    void after_commit(const std::function<void()> &fn);
+
+    // Writes every changed block back to the disk, the bitmap included.
+    // Returns once the host has stored them, not just cached them.
+    void sync();
+
+    // Writes the listed blocks back to the disk if they changed. Returns
+    // once the host has stored them.
+    void sync_blocks(const short *block_nums, int count);
+
+    // Returns true if the block is in the block cache.
+    bool is_cached(short block_num);
+
+    // Starts reading blocks into the block cache in the background.
+    void prefetch_blocks(const short *block_nums, int count);
+
+    // Copies the block cache counters into stats.
+    void cache_stats(cache_stats_t &stats);
+
+    // Block I/O counters and latency histograms of the calls above and
+    // of the disk transfers under the cache.
+    IoStats &io_stats();
+
+    // Sets the hook told about overwrites (NULL for none). Must be set
+    // before the file system is shared by several threads.
+    void set_write_hook(WriteHook *hook);
+
+    // Writes count metadata blocks as a transaction of their own,
+    // whatever transaction the calling thread has open, and returns once
+    // they are in the journal. The bitmap is logged with them.
+    void commit_blocks(const short *block_nums, int count, const void *blocks);
+
+    // Copies the bitmap into super_block. Blocks reserved by thread
+    // caches are given back first, so they show up as free.
+    void copy_bitmap(superblock_t &super_block);
+
+    // Replaces the bitmap with the one in super_block. No other thread
+    // may be allocating or freeing blocks.
+    void restore_bitmap(const superblock_t &super_block);
+
+  private:
+    StripedDisk disk;	// the image file or files
+    IoStats iostat;	// block I/O counters
+    BlockCache cache;	// every block transfer goes through the cache
+    std::atomic<unsigned int> bitmap[BITMAP_WORDS]; // bit set - block used
+    std::atomic<int> cached_blocks;	// blocks held in thread caches
+    std::atomic<bool> bitmap_pending;	// superblock lags the bitmap
+    std::atomic<int> next_first_word;	// where the next thread starts
+    std::mutex super_mutex;	// orders superblock write-backs
+    std::mutex caches_mutex;	// guards caches; taken before a cache's lock
+    std::set<alloc_cache_t *> caches;	// caches holding our blocks
+    Journal journal;		// log of committed metadata blocks
+    std::mutex commit_mutex;	// guards commit_queue and committing
+    std::condition_variable commit_cv;	// signalled when a group is done
+    std::deque<txn_t *> commit_queue;	// transactions waiting to commit
+    bool committing;		// a thread is writing a group
+    WriteHook *write_hook;	// told before blocks are overwritten
+    bool was_clean;		// last session unmounted cleanly
+
+    // Helper functions
+    void format();
+    void set_clean(bool clean);
+    alloc_cache_t &thread_cache();
+    void release_cache(alloc_cache_t &cache);
+    void drain_caches();
+    int claim_bits(short *blocks, int count, int first_word);
+    void clear_bits(const short *blocks, int count);
+    void write_bitmap();
+    void flush_bitmap();
+    void snapshot_bitmap(superblock_t &super_block);
+    void stage_block(short block_num, void *block);
+    void free_blocks(const short *blocks, int count);
+    void discard_blocks(const short *blocks, int count);
+    void discardable(const short *blocks, int count, std::vector<short> &nums);
+    txn_t *current_txn();
+    void commit(txn_t &txn);
+    void write_group(const std::vector<txn_t *> &group);
+
+    friend struct alloc_cache_t;
+};
+
+// Scope of a transaction: begins one on construction and commits it when
+// destroyed, or earlier with commit().
+class Transaction {
+
+  public:
+    Transaction(BasicFileSys &bfs) : bfs(bfs), open(true) {
+      bfs.begin_transaction();
+    }
+
+    ~Transaction() {
+      commit();
+    }
+
+    // Commits the transaction now.
+    void commit() {
+      if (open) {
+        open = false;
+        bfs.commit_transaction();
+      }
+    }
+
   private:
-    Disk disk;
+    BasicFileSys &bfs;
+    bool open;		// not committed yet
+
+    // not copyable
+    Transaction(const Transaction &);
+    Transaction &operator=(const Transaction &);
 };
 
 #endif
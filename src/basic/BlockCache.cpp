@@ -0,0 +1,504 @@
+// Computing Systems: Block Cache
+// Keeps recently used disk blocks in memory, reads blocks ahead of use
+// and writes changed blocks back on background threads.
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "BlockCache.h"
+
+BlockCache::BlockCache(StripedDisk &disk, IoStats &io_stats)
+  : disk(disk), io_stats(io_stats), stopping(false), writeback_gen(0)
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+BlockCache::~BlockCache()
+{
+  stop();
+}
+
+// Empties the cache and starts the prefetch and flusher threads
+void BlockCache::start()
+{
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  entries.clear();
+  lru.clear();
+  prefetch_queue.clear();
+  memset(&stats, 0, sizeof(stats));
+  stopping = false;
+  prefetcher = std::thread(&BlockCache::prefetch_loop, this);
+  flusher = std::thread(&BlockCache::flush_loop, this);
+}
+
+// Stops the background threads, writes back every dirty block and
+// empties the cache
+void BlockCache::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex);
+    stopping = true;
+  }
+  prefetch_cv.notify_all();
+  flush_cv.notify_all();
+  if (prefetcher.joinable()) {
+    prefetcher.join();
+  }
+  if (flusher.joinable()) {
+    flusher.join();
+  }
+  flush(FLUSH_ALL, NULL, 0);
+
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  entries.clear();
+  lru.clear();
+  prefetch_queue.clear();
+}
+
+// Reads a block, from the cache if it is there
+//
+// A miss caches what it read only if no dirty data reached the disk
+// meanwhile: otherwise a block written, written back and evicted while
+// the miss was reading could come back with its old contents.
+void BlockCache::read(short block_num, void *block)
+{
+  unsigned long gen;
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex);
+    if (lookup(block_num, block)) {
+      return;
+    }
+    stats.misses++;
+    gen = writeback_gen;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(disk_mutex);
+    disk_read(block_num, block);
+  }
+
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  if (gen == writeback_gen && entries.find(block_num) == entries.end()) {
+    insert(block_num, block, false);
+  }
+}
+
+// Writes a block to the cache and marks it dirty. The flusher writes it
+// to the disk later.
+void BlockCache::write(short block_num, void *block)
+{
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  mark_dirty(insert(block_num, block, false));
+}
+
+// Reads count blocks into consecutive BLOCK_SIZE buffers. Blocks not
+// cached are read from the disk as one batch; a block named twice is read
+// once.
+void BlockCache::read_batch(const short *block_nums, int count, void *blocks)
+{
+  if (count == 0) return;
+  char *bufs = (char *) blocks;
+
+  // take what the cache has
+  std::vector<short> missing;
+  std::vector<int> missing_pos;
+  unsigned long gen;
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex);
+    gen = writeback_gen;
+    for (int i = 0; i < count; i++) {
+      if (!lookup(block_nums[i], bufs + i * BLOCK_SIZE)) {
+        stats.misses++;
+        missing.push_back(block_nums[i]);
+        missing_pos.push_back(i);
+      }
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  // slot[i] is where missing[i] lands in the batch read
+  std::vector<int> order(missing.size());
+  sort_batch(&missing[0], missing.size(), &order[0]);
+  std::vector<short> nums;
+  std::vector<int> slot(missing.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    if (i == 0 || missing[order[i - 1]] != missing[order[i]]) {
+      nums.push_back(missing[order[i]]);
+    }
+    slot[order[i]] = nums.size() - 1;
+  }
+  std::vector<datablock_t> data(nums.size());
+  {
+    std::lock_guard<std::mutex> guard(disk_mutex);
+    disk_read_batch(nums.data(), nums.size(), data.data());
+  }
+  for (size_t i = 0; i < missing.size(); i++) {
+    memcpy(bufs + missing_pos[i] * BLOCK_SIZE, &data[slot[i]], BLOCK_SIZE);
+  }
+
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  if (gen != writeback_gen) {
+    return;
+  }
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (entries.find(missing[i]) == entries.end()) {
+      insert(missing[i], bufs + missing_pos[i] * BLOCK_SIZE, false);
+    }
+  }
+}
+
+// Writes count blocks from consecutive BLOCK_SIZE buffers to the cache
+// and marks them dirty
+void BlockCache::write_batch(const short *block_nums, int count, void *blocks)
+{
+  char *bufs = (char *) blocks;
+
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  for (int i = 0; i < count; i++) {
+    mark_dirty(insert(block_nums[i], bufs + i * BLOCK_SIZE, false));
+  }
+}
+
+// Writes back every dirty block as one batch
+void BlockCache::sync()
+{
+  flush(FLUSH_ALL, NULL, 0);
+}
+
+// Writes back the listed blocks if they are dirty
+void BlockCache::sync_blocks(const short *block_nums, int count)
+{
+  flush(FLUSH_LISTED, block_nums, count);
+}
+
+// Reads a block straight from the disk, ignoring the cache
+void BlockCache::read_through(short block_num, void *block)
+{
+  std::lock_guard<std::mutex> guard(disk_mutex);
+  disk_read(block_num, block);
+}
+
+// Writes count blocks straight to the disk as one batch. The blocks must
+// not be cached.
+void BlockCache::write_through(const short *block_nums, int count,
+                               const void *blocks)
+{
+  if (count == 0) return;
+  std::lock_guard<std::mutex> guard(disk_mutex);
+  disk_write_batch(block_nums, count, blocks);
+}
+
+// Drops the listed blocks and punches them out of the disk image. No
+// flush may be writing them back, and no read may be in flight: a read
+// that started before the hole was punched would cache the old contents,
+// so the write-back generation is bumped to make it drop what it read.
+void BlockCache::discard(const short *block_nums, int count)
+{
+  if (count == 0) return;
+  std::vector<short> nums(block_nums, block_nums + count);
+  std::sort(nums.begin(), nums.end());
+  nums.erase(std::unique(nums.begin(), nums.end()), nums.end());
+
+  std::lock_guard<std::mutex> flush_guard(flush_mutex);
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  for (size_t i = 0; i < nums.size(); i++) {
+    std::unordered_map<short, entry_t>::iterator it = entries.find(nums[i]);
+    if (it == entries.end()) {
+      continue;
+    }
+    if (it->second.dirty) {
+      stats.dirty--;
+    }
+    lru.erase(it->second.lru);
+    entries.erase(it);
+  }
+
+  std::lock_guard<std::mutex> disk_guard(disk_mutex);
+  disk.punch(nums.data(), nums.size());
+  writeback_gen++;
+}
+
+// Returns true if the block is in the cache
+bool BlockCache::contains(short block_num)
+{
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  return entries.find(block_num) != entries.end();
+}
+
+// Queues blocks to be read into the cache in the background
+void BlockCache::prefetch(const short *block_nums, int count)
+{
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex);
+    for (int i = 0; i < count; i++) {
+      if (entries.find(block_nums[i]) == entries.end()) {
+        prefetch_queue.push_back(block_nums[i]);
+      }
+    }
+  }
+  prefetch_cv.notify_one();
+}
+
+// Copies the counters into stats
+void BlockCache::get_stats(cache_stats_t &result)
+{
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  result = stats;
+  result.cached = entries.size();
+}
+
+// HELPER FUNCTIONS
+
+// Copies a cached block into block and marks it most recently used.
+// Returns false if it is not cached. cache_mutex must be held.
+bool BlockCache::lookup(short block_num, void *block)
+{
+  std::unordered_map<short, entry_t>::iterator it = entries.find(block_num);
+  if (it == entries.end()) {
+    return false;
+  }
+
+  memcpy(block, &it->second.data, BLOCK_SIZE);
+  lru.splice(lru.begin(), lru, it->second.lru);
+  stats.hits++;
+  if (it->second.prefetched) {
+    stats.prefetch_hits++;
+    it->second.prefetched = false;
+  }
+  return true;
+}
+
+// Stores a block as most recently used and returns its entry. If the
+// cache is full the least recently used block not being written back is
+// evicted, and written to the disk first if it is dirty. cache_mutex must
+// be held.
+BlockCache::entry_t &BlockCache::insert(short block_num, const void *block,
+                                        bool prefetched)
+{
+  std::unordered_map<short, entry_t>::iterator it = entries.find(block_num);
+  if (it == entries.end()) {
+    if ((int) entries.size() >= CACHE_BLOCKS) {
+      evict();
+    }
+    lru.push_front(block_num);
+    it = entries.insert(std::make_pair(block_num, entry_t())).first;
+    it->second.dirty = false;
+    it->second.flushing = false;
+    it->second.version = 0;
+    it->second.lru = lru.begin();
+  } else {
+    lru.splice(lru.begin(), lru, it->second.lru);
+  }
+
+  memcpy(&it->second.data, block, BLOCK_SIZE);
+  it->second.prefetched = prefetched;
+  return it->second;
+}
+
+// Drops the least recently used block that is not being written back,
+// writing it to the disk first if it is dirty. If every block is being
+// written back the cache grows past CACHE_BLOCKS until the flush ends.
+// cache_mutex must be held.
+void BlockCache::evict()
+{
+  for (std::list<short>::reverse_iterator r = lru.rbegin(); r != lru.rend();
+       ++r) {
+    entry_t &entry = entries[*r];
+    if (entry.flushing) {
+      continue;
+    }
+
+    if (entry.dirty) {
+      std::lock_guard<std::mutex> guard(disk_mutex);
+      disk_write(*r, &entry.data);
+      stats.dirty--;
+      stats.written_back++;
+      writeback_gen++;
+    }
+    entries.erase(*r);
+    lru.erase(std::next(r).base());
+    return;
+  }
+}
+
+// Marks an entry as changed since it was last written to the disk and
+// wakes the flusher if too many blocks are dirty. cache_mutex must be
+// held.
+void BlockCache::mark_dirty(entry_t &entry)
+{
+  entry.version++;
+  if (entry.dirty) {
+    return;
+  }
+
+  entry.dirty = true;
+  entry.dirtied = std::chrono::steady_clock::now();
+  stats.dirty++;
+  if (stats.dirty >= DIRTY_HIGH) {
+    flush_cv.notify_one();
+  }
+}
+
+// Body of the prefetch thread: reads queued blocks that are not cached
+// yet until the cache stops
+void BlockCache::prefetch_loop()
+{
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  while (true) {
+    prefetch_cv.wait(lock, [this] { return stopping || !prefetch_queue.empty(); });
+    if (stopping) {
+      return;
+    }
+
+    short block_num = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    if (entries.find(block_num) != entries.end()) {
+      continue;
+    }
+
+    unsigned long gen = writeback_gen;
+    lock.unlock();
+    datablock_t block;
+    {
+      std::lock_guard<std::mutex> guard(disk_mutex);
+      disk_read(block_num, &block);
+    }
+    lock.lock();
+
+    // a write or a demand read may have cached it meanwhile
+    if (gen == writeback_gen && entries.find(block_num) == entries.end()) {
+      insert(block_num, &block, true);
+      stats.prefetched++;
+    }
+  }
+}
+
+// Body of the flusher thread: every FLUSH_INTERVAL_MS writes back the
+// blocks dirty for longer than DIRTY_AGE_MS, and writes back all dirty
+// blocks as soon as DIRTY_HIGH are dirty
+void BlockCache::flush_loop()
+{
+  std::unique_lock<std::mutex> lock(cache_mutex);
+  while (!stopping) {
+    flush_cv.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS),
+                      [this] { return stopping || stats.dirty >= DIRTY_HIGH; });
+    if (stopping) {
+      return;
+    }
+
+    flush_mode_t mode = stats.dirty >= DIRTY_HIGH ? FLUSH_ALL : FLUSH_OLD;
+    lock.unlock();
+    flush(mode, NULL, 0);
+    lock.lock();
+  }
+}
+
+// Writes back the dirty blocks chosen by mode as one batch. The blocks
+// are copied and marked as being written back so they stay cached; a
+// block written again meanwhile stays dirty.
+void BlockCache::flush(flush_mode_t mode, const short *block_nums, int count)
+{
+  std::lock_guard<std::mutex> flush_guard(flush_mutex);
+
+  std::vector<short> nums;
+  std::vector<datablock_t> bufs;
+  std::vector<unsigned long> versions;
+  {
+    std::lock_guard<std::mutex> guard(cache_mutex);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::milliseconds age(DIRTY_AGE_MS);
+
+    std::unordered_map<short, entry_t>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+      entry_t &entry = it->second;
+      if (!entry.dirty) {
+        continue;
+      }
+      if (mode == FLUSH_OLD && now - entry.dirtied < age) {
+        continue;
+      }
+      if (mode == FLUSH_LISTED &&
+          std::find(block_nums, block_nums + count, it->first) ==
+          block_nums + count) {
+        continue;
+      }
+
+      entry.flushing = true;
+      nums.push_back(it->first);
+      bufs.push_back(entry.data);
+      versions.push_back(entry.version);
+    }
+  }
+  if (nums.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(disk_mutex);
+    disk_write_batch(nums.data(), nums.size(), bufs.data());
+  }
+
+  std::lock_guard<std::mutex> guard(cache_mutex);
+  for (size_t i = 0; i < nums.size(); i++) {
+    entry_t &entry = entries[nums[i]];
+    entry.flushing = false;
+    if (entry.version == versions[i]) {
+      entry.dirty = false;
+      stats.dirty--;
+    }
+  }
+  stats.written_back += nums.size();
+  writeback_gen++;
+}
+
+// Reads a block from the disk, counting the transfer. disk_mutex must be
+// held.
+void BlockCache::disk_read(short block_num, void *block)
+{
+  IoTimer timer(io_stats);
+  disk.read_block(block_num, block);
+  timer.done(IO_LEVEL_DISK, IO_OP_READ, &block_num, 1, block);
+}
+
+// Writes a block to the disk, counting the transfer. disk_mutex must be
+// held.
+void BlockCache::disk_write(short block_num, const void *block)
+{
+  IoTimer timer(io_stats);
+  disk.write_block(block_num, (void *) block);
+  timer.done(IO_LEVEL_DISK, IO_OP_WRITE, &block_num, 1, block);
+}
+
+// Reads count blocks from the disk as one batch, counting it as one
+// transfer. disk_mutex must be held.
+void BlockCache::disk_read_batch(const short *block_nums, int count,
+                                 void *blocks)
+{
+  IoTimer timer(io_stats);
+  disk.read_blocks(block_nums, count, blocks);
+  timer.done(IO_LEVEL_DISK, IO_OP_READ, block_nums, count, blocks);
+}
+
+// Writes count blocks to the disk as one batch, counting it as one
+// transfer. disk_mutex must be held.
+void BlockCache::disk_write_batch(const short *block_nums, int count,
+                                  const void *blocks)
+{
+  IoTimer timer(io_stats);
+  disk.write_blocks(block_nums, count, blocks);
+  timer.done(IO_LEVEL_DISK, IO_OP_WRITE, block_nums, count, blocks);
+}
+
+// Orders the positions of a batch by block number
+void BlockCache::sort_batch(const short *block_nums, int count, int *order)
+{
+  for (int i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  std::sort(order, order + count, [block_nums](int a, int b) {
+    return block_nums[a] < block_nums[b];
+  });
+}
@@ -0,0 +1,145 @@
+// Computing Systems: Block Cache
+// Keeps recently used disk blocks in memory, reads blocks ahead of use
+// and writes changed blocks back on background threads.
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "StripedDisk.h"
+#include "Blocks.h"
+#include "IoStats.h"
+
+// number of blocks the cache holds
+const int CACHE_BLOCKS = 256;
+
+// Writeback policy: dirty blocks older than DIRTY_AGE_MS are written back
+// by the flusher, which wakes every FLUSH_INTERVAL_MS, and all dirty
+// blocks are written back once DIRTY_HIGH blocks are dirty.
+const int DIRTY_AGE_MS = 3000;
+const int FLUSH_INTERVAL_MS = 500;
+const int DIRTY_HIGH = CACHE_BLOCKS / 2;
+
+// Block cache counters
+struct cache_stats_t {
+  int cached;			// blocks in the cache
+  unsigned long hits;		// reads served from the cache
+  unsigned long misses;		// reads that went to the disk
+  unsigned long prefetched;	// blocks read ahead of use
+  unsigned long prefetch_hits;	// reads served by a block read ahead
+  int dirty;			// cached blocks not yet on disk
+  unsigned long written_back;	// dirty blocks written to disk
+};
+
+class BlockCache {
+
+  public:
+    // Disk transfers are counted in io_stats.
+    BlockCache(StripedDisk &disk, IoStats &io_stats);
+    ~BlockCache();
+
+    // Empties the cache and starts the prefetch and flusher threads.
+    void start();
+
+    // Stops the background threads, writes back every dirty block and
+    // empties the cache.
+    void stop();
+
+    // Reads a block, from the cache if it is there.
+    void read(short block_num, void *block);
+
+    // Writes a block to the cache. It reaches the disk later.
+    void write(short block_num, void *block);
+
+    // Reads count blocks into consecutive BLOCK_SIZE buffers. Blocks not
+    // cached are read from the disk as one batch.
+    void read_batch(const short *block_nums, int count, void *blocks);
+
+    // Writes count blocks from consecutive BLOCK_SIZE buffers to the
+    // cache.
+    void write_batch(const short *block_nums, int count, void *blocks);
+
+    // Writes back every dirty block as one batch.
+    void sync();
+
+    // Writes back the listed blocks if they are dirty.
+    void sync_blocks(const short *block_nums, int count);
+
+    // Reads a block straight from the disk, ignoring the cache.
+    void read_through(short block_num, void *block);
+
+    // Writes count blocks straight to the disk as one batch. The blocks
+    // must not be cached.
+    void write_through(const short *block_nums, int count, const void *blocks);
+
+    // Drops the listed blocks from the cache, dirty or not, and punches
+    // them out of the disk image, so they read back as zeros and the host
+    // can reclaim their space. The blocks must be free.
+    void discard(const short *block_nums, int count);
+
+    // Returns true if the block is in the cache.
+    bool contains(short block_num);
+
+    // Queues blocks to be read into the cache in the background.
+    void prefetch(const short *block_nums, int count);
+
+    // Copies the counters into stats.
+    void get_stats(cache_stats_t &stats);
+
+  private:
+    // a cached block
+    struct entry_t {
+      datablock_t data;			// contents
+      bool prefetched;			// read ahead and not used yet
+      bool dirty;			// newer than the disk
+      bool flushing;			// being written back; not evicted
+      unsigned long version;		// bumped by every write
+      std::chrono::steady_clock::time_point dirtied; // first write since clean
+      std::list<short>::iterator lru;	// position in lru
+    };
+
+    // which dirty blocks a flush writes back
+    enum flush_mode_t { FLUSH_OLD, FLUSH_ALL, FLUSH_LISTED };
+
+    StripedDisk &disk;
+    IoStats &io_stats;			// counts the disk transfers
+    std::mutex disk_mutex;		// held across each disk transfer
+    std::mutex cache_mutex;		// guards everything below
+    std::unordered_map<short, entry_t> entries;	// by block number
+    std::list<short> lru;		// most recently used first
+    std::deque<short> prefetch_queue;	// blocks to read ahead
+    std::condition_variable prefetch_cv; // signalled when queue fills
+    std::thread prefetcher;		// reads queued blocks
+    std::condition_variable flush_cv;	// signalled when too many are dirty
+    std::thread flusher;		// writes back dirty blocks
+    std::mutex flush_mutex;		// one flush at a time
+    bool stopping;			// background threads must exit
+    unsigned long writeback_gen;	// bumped when dirty data reaches the disk
+    cache_stats_t stats;
+
+    // Helper functions
+    bool lookup(short block_num, void *block);
+    entry_t &insert(short block_num, const void *block, bool prefetched);
+    void evict();
+    void mark_dirty(entry_t &entry);
+    void prefetch_loop();
+    void flush_loop();
+    void flush(flush_mode_t mode, const short *block_nums, int count);
+    void disk_read(short block_num, void *block);
+    void disk_write(short block_num, const void *block);
+    void disk_read_batch(const short *block_nums, int count, void *blocks);
+    void disk_write_batch(const short *block_nums, int count, const void *blocks);
+    static void sort_batch(const short *block_nums, int count, int *order);
+
+    // not copyable
+    BlockCache(const BlockCache &);
+    BlockCache &operator=(const BlockCache &);
+};
+
+#endif
@@ -0,0 +1,237 @@
+// Computing Systems: I/O Statistics
+// Counts the blocks moved by BasicFileSys calls and disk transfers, by
+// block type and issuing command, with log-bucketed latency histograms.
+
+#include <cstdio>
+#include <cstring>
+
+#include "IoStats.h"
+
+static const char *TYPE_NAMES[IO_BLOCK_TYPES] = {
+  "super", "dir", "inode", "data", "journal", "other"
+};
+static const char *LEVEL_NAMES[IO_LEVELS] = { "call", "disk" };
+static const char *OP_NAMES[IO_OPS] = { "read", "write" };
+
+// Command names by slot. Slots are only added, under command_mutex, and
+// num_commands is published after the name is in place.
+static const char *command_names[IO_MAX_COMMANDS] = { "(none)" };
+static std::atomic<int> num_commands(1);
+static std::mutex command_mutex;
+
+// the command the calling thread runs (NULL - none)
+static thread_local const char *current_command = NULL;
+
+// HELPER FUNCTIONS
+
+// Returns the slot of the calling thread's command, adding it on first
+// use. Commands past IO_MAX_COMMANDS share slot 0.
+static int command_slot()
+{
+  const char *name = current_command;
+  if (name == NULL) return 0;
+
+  int count = num_commands.load(std::memory_order_acquire);
+  for (int i = 1; i < count; i++) {
+    if (strcmp(command_names[i], name) == 0) return i;
+  }
+
+  std::lock_guard<std::mutex> guard(command_mutex);
+  count = num_commands.load(std::memory_order_relaxed);
+  for (int i = 1; i < count; i++) {
+    if (strcmp(command_names[i], name) == 0) return i;
+  }
+  if (count == IO_MAX_COMMANDS) return 0;
+  command_names[count] = name;
+  num_commands.store(count + 1, std::memory_order_release);
+  return count;
+}
+
+// Index of the histogram bucket for nanos
+static int bucket(unsigned long nanos)
+{
+  int b = 0;
+  while (nanos > 1 && b < IO_HIST_BUCKETS - 1) {
+    nanos >>= 1;
+    b++;
+  }
+  return b;
+}
+
+// Lower bound of a bucket, rounded to a readable unit
+static void bucket_label(int b, char *label, size_t size)
+{
+  unsigned long nanos = 1UL << b;
+  if (nanos < 1000) {
+    snprintf(label, size, "%luns", nanos);
+  } else if (nanos < 1000000) {
+    snprintf(label, size, "%luus", (nanos + 500) / 1000);
+  } else {
+    snprintf(label, size, "%lums", (nanos + 500000) / 1000000);
+  }
+}
+
+// Returns the type of block block_num with contents block. Blocks past
+// the fixed area are told apart by their magic number; anything without
+// one is file data.
+io_block_type_t io_block_type(short block_num, const void *block)
+{
+  if (block_num == 0) return IO_BLOCK_SUPER;
+  if (block_num >= JOURNAL_START && block_num < FIRST_FREE_BLOCK) {
+    return IO_BLOCK_JOURNAL;
+  }
+
+  unsigned int magic;
+  memcpy(&magic, block, sizeof(magic));
+  switch (magic) {
+  case DIR_MAGIC_NUM:
+    return IO_BLOCK_DIR;
+  case INODE_MAGIC_NUM:
+    return IO_BLOCK_INODE;
+  case INDEX_MAGIC_NUM:
+  case VOLUME_MAGIC_NUM:
+  case SNAP_MAGIC_NUM:
+    return IO_BLOCK_OTHER;
+  default:
+    return block_num == VOLUME_BLOCK ? IO_BLOCK_OTHER : IO_BLOCK_DATA;
+  }
+}
+
+IoStats::IoStats() : on(false)
+{
+  reset();
+}
+
+// Turns counting on or off
+void IoStats::enable(bool counting)
+{
+  on.store(counting, std::memory_order_relaxed);
+}
+
+// Zeroes every counter
+void IoStats::reset()
+{
+  for (int l = 0; l < IO_LEVELS; l++) {
+    for (int o = 0; o < IO_OPS; o++) {
+      calls[l][o] = 0;
+      for (int t = 0; t < IO_BLOCK_TYPES; t++) {
+        blocks[l][o][t] = 0;
+      }
+      for (int c = 0; c < IO_MAX_COMMANDS; c++) {
+        command_blocks[l][c][o] = 0;
+      }
+      for (int b = 0; b < IO_HIST_BUCKETS; b++) {
+        histogram[l][o][b] = 0;
+      }
+    }
+  }
+  for (int c = 0; c < IO_MAX_COMMANDS; c++) {
+    command_nanos[c] = 0;
+  }
+}
+
+// Counts one call or transfer that moved count blocks and took nanos
+void IoStats::record(io_level_t level, io_op_t op, const short *block_nums,
+                     int count, const void *blocks_data, bool is_data,
+                     unsigned long nanos)
+{
+  const char *bufs = (const char *) blocks_data;
+  for (int i = 0; i < count; i++) {
+    io_block_type_t type = is_data ? IO_BLOCK_DATA :
+      io_block_type(block_nums[i], bufs + i * BLOCK_SIZE);
+    blocks[level][op][type].fetch_add(1, std::memory_order_relaxed);
+  }
+  calls[level][op].fetch_add(1, std::memory_order_relaxed);
+  histogram[level][op][bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+
+  int slot = command_slot();
+  command_blocks[level][slot][op].fetch_add(count, std::memory_order_relaxed);
+  if (level == IO_LEVEL_CALL) {
+    command_nanos[slot].fetch_add(nanos, std::memory_order_relaxed);
+  }
+}
+
+// Returns the blocks moved at level in direction op
+unsigned long IoStats::total(io_level_t level, io_op_t op)
+{
+  unsigned long sum = 0;
+  for (int t = 0; t < IO_BLOCK_TYPES; t++) {
+    sum += blocks[level][op][t];
+  }
+  return sum;
+}
+
+// Prints the block counts by type, then by command, then the latency
+// histograms that have samples
+void IoStats::print(std::ostream &out)
+{
+  char line[256];
+  out << "I/O statistics (counting " << (enabled() ? "on" : "off") << ")" << std::endl;
+
+  snprintf(line, sizeof(line), "%-11s %8s", "", "calls");
+  out << line;
+  for (int t = 0; t < IO_BLOCK_TYPES; t++) {
+    snprintf(line, sizeof(line), " %8s", TYPE_NAMES[t]);
+    out << line;
+  }
+  out << std::endl;
+  for (int l = 0; l < IO_LEVELS; l++) {
+    for (int o = 0; o < IO_OPS; o++) {
+      snprintf(line, sizeof(line), "%-4s %-6s %8lu", LEVEL_NAMES[l],
+               OP_NAMES[o], calls[l][o].load());
+      out << line;
+      for (int t = 0; t < IO_BLOCK_TYPES; t++) {
+        snprintf(line, sizeof(line), " %8lu", blocks[l][o][t].load());
+        out << line;
+      }
+      out << std::endl;
+    }
+  }
+
+  snprintf(line, sizeof(line), "%-11s %11s %11s %11s %11s %12s", "command",
+           "call reads", "call writes", "disk reads", "disk writes",
+           "call time us");
+  out << line << std::endl;
+  int count = num_commands.load(std::memory_order_acquire);
+  for (int c = 0; c < count; c++) {
+    unsigned long moved = 0;
+    for (int l = 0; l < IO_LEVELS; l++) {
+      moved += command_blocks[l][c][IO_OP_READ] + command_blocks[l][c][IO_OP_WRITE];
+    }
+    if (moved == 0) continue;
+    snprintf(line, sizeof(line), "%-11s %11lu %11lu %11lu %11lu %12.1f",
+             command_names[c],
+             command_blocks[IO_LEVEL_CALL][c][IO_OP_READ].load(),
+             command_blocks[IO_LEVEL_CALL][c][IO_OP_WRITE].load(),
+             command_blocks[IO_LEVEL_DISK][c][IO_OP_READ].load(),
+             command_blocks[IO_LEVEL_DISK][c][IO_OP_WRITE].load(),
+             command_nanos[c] / 1000.0);
+    out << line << std::endl;
+  }
+
+  for (int l = 0; l < IO_LEVELS; l++) {
+    for (int o = 0; o < IO_OPS; o++) {
+      if (calls[l][o] == 0) continue;
+      out << "latency " << LEVEL_NAMES[l] << " " << OP_NAMES[o] << ":";
+      for (int b = 0; b < IO_HIST_BUCKETS; b++) {
+        unsigned long n = histogram[l][o][b];
+        if (n == 0) continue;
+        char label[16];
+        bucket_label(b, label, sizeof(label));
+        out << " " << label << " " << n;
+      }
+      out << std::endl;
+    }
+  }
+}
+
+// Names the calling thread's command unless an outer scope has
+IoCommand::IoCommand(const char *name) : outer(current_command == NULL)
+{
+  if (outer) current_command = name;
+}
+
+IoCommand::~IoCommand()
+{
+  if (outer) current_command = NULL;
+}
@@ -0,0 +1,132 @@
+// Computing Systems: I/O Statistics
+// Counts the blocks moved at two levels: the calls made to BasicFileSys
+// and the transfers between the block cache and the disk. Blocks are
+// counted by type and by the FileSys command that issued them, and the
+// latency of each call or transfer goes into a histogram with one bucket
+// per power of two nanoseconds. Counting is off until enabled; while it
+// is off an instrumented call only loads one flag.
+
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include "Blocks.h"
+
+// what a block holds, going by its number and contents
+enum io_block_type_t {
+  IO_BLOCK_SUPER,	// free block bitmap
+  IO_BLOCK_DIR,		// directory
+  IO_BLOCK_INODE,	// inode
+  IO_BLOCK_DATA,	// file data
+  IO_BLOCK_JOURNAL,	// journal area
+  IO_BLOCK_OTHER,	// volume block, name index, snapshots
+  IO_BLOCK_TYPES
+};
+
+// where a block was counted
+enum io_level_t {
+  IO_LEVEL_CALL,	// read_block, write_block and their batch forms
+  IO_LEVEL_DISK,	// a transfer to or from the disk
+  IO_LEVELS
+};
+
+// which way it went
+enum io_op_t { IO_OP_READ, IO_OP_WRITE, IO_OPS };
+
+// commands counted apart; slot 0 is I/O issued outside any command (the
+// flusher and the prefetcher, for instance)
+const int IO_MAX_COMMANDS = 48;
+
+// latency buckets; bucket i holds latencies of 2^i to 2^(i+1) - 1 ns
+const int IO_HIST_BUCKETS = 32;
+
+// Returns the type of block block_num with contents block.
+io_block_type_t io_block_type(short block_num, const void *block);
+
+class IoStats {
+
+  public:
+    IoStats();
+
+    // Turns counting on or off. The counters are kept.
+    void enable(bool on);
+
+    // Returns true if counting is on.
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    // Zeroes every counter.
+    void reset();
+
+    // Counts one call or transfer at level that moved count blocks and
+    // took nanos. Every block is typed by its number and contents, or
+    // counted as data with is_data.
+    void record(io_level_t level, io_op_t op, const short *block_nums,
+                int count, const void *blocks, bool is_data,
+                unsigned long nanos);
+
+    // Returns the blocks moved at level in direction op.
+    unsigned long total(io_level_t level, io_op_t op);
+
+    // Prints the counters, the commands and the histograms.
+    void print(std::ostream &out);
+
+  private:
+    std::atomic<bool> on;
+    std::atomic<unsigned long> blocks[IO_LEVELS][IO_OPS][IO_BLOCK_TYPES];
+    std::atomic<unsigned long> calls[IO_LEVELS][IO_OPS];
+    std::atomic<unsigned long> command_blocks[IO_LEVELS][IO_MAX_COMMANDS][IO_OPS];
+    std::atomic<unsigned long> command_nanos[IO_MAX_COMMANDS];	// in calls
+    std::atomic<unsigned long> histogram[IO_LEVELS][IO_OPS][IO_HIST_BUCKETS];
+
+    // not copyable
+    IoStats(const IoStats &);
+    IoStats &operator=(const IoStats &);
+};
+
+// Names the FileSys command the calling thread runs for the lifetime of
+// the scope, so the I/O it issues is counted under that name. A nested
+// scope keeps the outer name. name must outlive the program (a literal).
+class IoCommand {
+
+  public:
+    explicit IoCommand(const char *name);
+    ~IoCommand();
+
+  private:
+    bool outer;		// this scope set the name
+
+    // not copyable
+    IoCommand(const IoCommand &);
+    IoCommand &operator=(const IoCommand &);
+};
+
+// Times one instrumented call or transfer when counting is on.
+class IoTimer {
+
+  public:
+    explicit IoTimer(IoStats &stats)
+      : stats(stats), active(stats.enabled())
+    {
+      if (active) start = std::chrono::steady_clock::now();
+    }
+
+    // Records the call as IoStats::record does
+    void done(io_level_t level, io_op_t op, const short *block_nums,
+              int count, const void *blocks, bool is_data = false)
+    {
+      if (!active) return;
+      unsigned long nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      stats.record(level, op, block_nums, count, blocks, is_data, nanos);
+    }
+
+  private:
+    IoStats &stats;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,173 @@
+// Computing Systems: Journal
+// Write-ahead log of metadata blocks in a fixed area of the disk. New
+// block contents are written to the journal as one record before they
+// may reach their home blocks, and complete records are copied home
+// again when the disk is mounted after a crash.
+
+#include <cstring>
+
+#include "Journal.h"
+
+// one past the last journal block
+static const int JOURNAL_END = JOURNAL_START + JOURNAL_BLOCKS;
+
+Journal::Journal(BlockCache &cache, StripedDisk &disk)
+  : cache(cache), disk(disk), next_seq(1), tail(JOURNAL_START + 1)
+{
+}
+
+// Writes an empty journal on a newly formatted disk.
+void Journal::format()
+{
+  next_seq = 1;
+  reset();
+}
+
+// Copies the blocks of every complete record to their home blocks and
+// empties the journal. The scan stops at the first descriptor that is
+// missing, out of sequence or fails its checksum, so it reads no more
+// than the journal area.
+int Journal::replay()
+{
+  journalhead_t head;
+  cache.read_through(JOURNAL_START, &head);
+  next_seq = head.magic == JOURNAL_MAGIC_NUM ? head.seq : 1;
+
+  int replayed = 0;
+  std::vector<short> nums;		// blocks of the record so far
+  std::vector<datablock_t> images;
+  int pos = JOURNAL_START + 1;
+  while (pos < JOURNAL_END) {
+    journaldesc_t desc;
+    cache.read_through(pos, &desc);
+    if (desc.magic != JOURNAL_MAGIC_NUM || desc.seq != next_seq ||
+        desc.count == 0 || desc.count > JOURNAL_DESC_BLOCKS ||
+        pos + 1 + desc.count > JOURNAL_END) {
+      break;
+    }
+
+    std::vector<datablock_t> chunk(desc.count);
+    for (int i = 0; i < desc.count; i++) {
+      cache.read_through(pos + 1 + i, &chunk[i]);
+    }
+    if (checksum(desc, chunk.data()) != desc.checksum) {
+      break;			// torn write
+    }
+    nums.insert(nums.end(), desc.blocks, desc.blocks + desc.count);
+    images.insert(images.end(), chunk.begin(), chunk.end());
+    pos += 1 + desc.count;
+
+    if (desc.last) {
+      cache.write_through(nums.data(), nums.size(), images.data());
+      nums.clear();
+      images.clear();
+      next_seq++;
+      replayed++;
+    }
+  }
+
+  reset();
+  return replayed;
+}
+
+// Returns true if a record of count blocks fits in the journal.
+bool Journal::has_room(int count)
+{
+  return tail + record_size(count) <= JOURNAL_END;
+}
+
+// Returns the number of journal blocks a record of count blocks takes:
+// the blocks and one descriptor for every JOURNAL_DESC_BLOCKS of them.
+int Journal::record_size(int count)
+{
+  return count + (count + JOURNAL_DESC_BLOCKS - 1) / JOURNAL_DESC_BLOCKS;
+}
+
+// Writes a record holding count blocks to the journal in one pass and
+// flushes it, along with the data blocks written before it, to the host.
+// Each descriptor carries a checksum of the blocks behind it, so the
+// record needs no separate commit block.
+void Journal::append(const short *block_nums, int count, const void *blocks)
+{
+  const datablock_t *images = (const datablock_t *) blocks;
+  int size = record_size(count);
+  std::vector<short> nums(size);
+  std::vector<datablock_t> bufs(size);
+
+  int out = 0;
+  for (int done = 0; done < count; ) {
+    int n = count - done;
+    if (n > JOURNAL_DESC_BLOCKS) {
+      n = JOURNAL_DESC_BLOCKS;
+    }
+
+    journaldesc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.magic = JOURNAL_MAGIC_NUM;
+    desc.seq = next_seq;
+    desc.count = n;
+    desc.last = (done + n == count);
+    memcpy(desc.blocks, block_nums + done, n * sizeof(short));
+    desc.checksum = checksum(desc, images + done);
+
+    nums[out] = tail + out;
+    memcpy(&bufs[out], &desc, BLOCK_SIZE);
+    out++;
+    for (int i = 0; i < n; i++) {
+      nums[out] = tail + out;
+      bufs[out] = images[done + i];
+      out++;
+    }
+    done += n;
+  }
+
+  cache.write_through(nums.data(), size, bufs.data());
+  disk.flush();
+  tail += size;
+  next_seq++;
+}
+
+// Empties the journal. The home blocks are flushed to the host before the
+// header is, so no record is dropped before its blocks are stored. The
+// header moves past every sequence number used so far, so old records
+// are never mistaken for new ones.
+void Journal::reset()
+{
+  disk.flush();
+  next_seq++;
+  journalhead_t head;
+  memset(&head, 0, sizeof(head));
+  head.magic = JOURNAL_MAGIC_NUM;
+  head.seq = next_seq;
+
+  short block_num = JOURNAL_START;
+  cache.write_through(&block_num, 1, &head);
+  tail = JOURNAL_START + 1;
+}
+
+// HELPER FUNCTIONS
+
+// FNV-1a hash of a descriptor's sequence number, block numbers and the
+// blocks that follow it
+unsigned int Journal::checksum(const journaldesc_t &desc,
+                               const datablock_t *blocks)
+{
+  unsigned int h = 2166136261u;
+  const unsigned char *parts[3] = {
+    (const unsigned char *) &desc.seq,
+    (const unsigned char *) desc.blocks,
+    (const unsigned char *) blocks
+  };
+  size_t sizes[3] = {
+    sizeof(desc.seq),
+    desc.count * sizeof(short),
+    desc.count * sizeof(datablock_t)
+  };
+  for (int p = 0; p < 3; p++) {
+    for (size_t i = 0; i < sizes[p]; i++) {
+      h ^= parts[p][i];
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
@@ -0,0 +1,54 @@
+// Computing Systems: Journal
+// Write-ahead log of metadata blocks in a fixed area of the disk. New
+// block contents are written to the journal as one record before they
+// may reach their home blocks, and complete records are copied home
+// again when the disk is mounted after a crash.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <vector>
+#include "Blocks.h"
+#include "BlockCache.h"
+
+class Journal {
+
+  public:
+    Journal(BlockCache &cache, StripedDisk &disk);
+
+    // Writes an empty journal on a newly formatted disk.
+    void format();
+
+    // Copies the blocks of every complete record to their home blocks and
+    // empties the journal. Reads only the journal area. Returns the number
+    // of records replayed.
+    int replay();
+
+    // Returns true if a record of count blocks fits in the journal.
+    bool has_room(int count);
+
+    // Returns the number of journal blocks a record of count blocks takes.
+    static int record_size(int count);
+
+    // Writes a record holding count blocks to the journal, straight to
+    // the disk, and returns once the host has stored it, so its blocks
+    // may then be written home. The record must fit.
+    void append(const short *block_nums, int count, const void *blocks);
+
+    // Empties the journal. Every block it holds must have been written
+    // home already; they are flushed to the host first.
+    void reset();
+
+  private:
+    BlockCache &cache;		// journal blocks bypass the cache
+    StripedDisk &disk;		// flushed to order the journal and home
+				// writes on the host
+    unsigned int next_seq;	// sequence number of the next record
+    int tail;			// next free journal block
+
+    // Helper functions
+    static unsigned int checksum(const journaldesc_t &desc,
+                                 const datablock_t *blocks);
+};
+
+#endif
@@ -0,0 +1,431 @@
+// Computing Systems: Striped Disk
+// Spreads the blocks of the volume over one or more disk image files.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <random>
+#include <unistd.h>
+
+#include "StripedDisk.h"
+
+StripedDisk::StripedDisk()
+  : stripe_unit(DEFAULT_STRIPE_UNIT), job_write(false), job_nums(NULL),
+    job_bufs(NULL), pending(0), stopping(false)
+{
+}
+
+StripedDisk::~StripedDisk()
+{
+  unmount();
+}
+
+// Mounts the image file name, or the striped disk name.0, name.1, ... A
+// new disk is striped as FILESYS_STRIPE asks.
+bool StripedDisk::mount(const char *name, bool &created)
+{
+  std::string base(name);
+  created = false;
+  if (access(name, F_OK) == 0) {
+    return open_member(base, true);
+  }
+  if (access((base + ".0").c_str(), F_OK) == 0) {
+    if (!open_member(base + ".0", true)) {
+      return false;
+    }
+    stripelabel_t label;
+    if (!read_label(*member_list[0], label)) {
+      std::cerr << member_list[0]->path << ": no stripe label" << std::endl;
+      unmount();
+      return false;
+    }
+    for (int i = 1; i < label.members; i++) {
+      if (!open_member(base + "." + std::to_string(i), true)) {
+        unmount();
+        return false;
+      }
+    }
+    stripe_unit = label.unit;
+    if (!check_members()) {
+      unmount();
+      return false;
+    }
+  } else {
+    int count = 1;
+    stripe_unit = DEFAULT_STRIPE_UNIT;
+    const char *spec = getenv(STRIPE_ENV);
+    if (spec != NULL && !parse_layout(spec, count, stripe_unit)) {
+      std::cerr << "Invalid " << STRIPE_ENV << " '" << spec << "': "
+                << "expected <members>[:<unit>], at most "
+                << MAX_STRIPE_MEMBERS << " members" << std::endl;
+      return false;
+    }
+    created = true;
+    if (count == 1) {
+      if (!open_member(base, false)) {
+        return false;
+      }
+    } else {
+      for (int i = 0; i < count; i++) {
+        if (!open_member(base + "." + std::to_string(i), false)) {
+          remove_members();
+          return false;
+        }
+      }
+      create_members(count);
+    }
+  }
+
+  // member 0 needs no thread: the calling thread transfers the first
+  // share of each batch itself
+  stopping = false;
+  for (size_t m = 1; m < member_list.size(); m++) {
+    member_list[m]->worker = std::thread(&StripedDisk::worker_loop, this,
+                                         member_list[m]);
+  }
+  return true;
+}
+
+// Stops the member threads and unmounts the members
+void StripedDisk::unmount()
+{
+  {
+    std::lock_guard<std::mutex> guard(job_mutex);
+    stopping = true;
+  }
+  job_cv.notify_all();
+  for (size_t m = 0; m < member_list.size(); m++) {
+    member_t *member = member_list[m];
+    if (member->worker.joinable()) {
+      member->worker.join();
+    }
+    member->disk.unmount();
+    if (member->host_fd >= 0) {
+      close(member->host_fd);
+    }
+    delete member;
+  }
+  member_list.clear();
+}
+
+// Reads one block from its member
+void StripedDisk::read_block(short block_num, void *block)
+{
+  int m, member_block;
+  locate(block_num, m, member_block);
+  member_list[m]->disk.read_block(member_block, block);
+}
+
+// Writes one block to its member
+void StripedDisk::write_block(short block_num, const void *block)
+{
+  int m, member_block;
+  locate(block_num, m, member_block);
+  member_list[m]->disk.write_block(member_block, (void *) block);
+}
+
+// Reads count blocks into consecutive BLOCK_SIZE buffers, the members in
+// parallel
+void StripedDisk::read_blocks(const short *block_nums, int count, void *blocks)
+{
+  transfer(false, block_nums, count, (char *) blocks);
+}
+
+// Writes count blocks from consecutive BLOCK_SIZE buffers, the members in
+// parallel
+void StripedDisk::write_blocks(const short *block_nums, int count,
+                               const void *blocks)
+{
+  transfer(true, block_nums, count, (char *) blocks);
+}
+
+// Waits until the host has stored what was written to every member
+void StripedDisk::flush()
+{
+  for (size_t m = 0; m < member_list.size(); m++) {
+    if (member_list[m]->host_fd >= 0) {
+      fdatasync(member_list[m]->host_fd);
+    }
+  }
+}
+
+// Punches the listed blocks out of the member files, one hole per run of
+// blocks consecutive in a member
+void StripedDisk::punch(const short *block_nums, int count)
+{
+  std::vector<std::vector<int> > runs(member_list.size());
+  for (int i = 0; i < count; i++) {
+    int m, member_block;
+    locate(block_nums[i], m, member_block);
+    runs[m].push_back(member_block);
+  }
+
+  datablock_t zeros;
+  memset(&zeros, 0, sizeof(zeros));
+  for (size_t m = 0; m < runs.size(); m++) {
+    member_t &member = *member_list[m];
+    std::vector<int> &blocks = runs[m];
+    std::sort(blocks.begin(), blocks.end());
+    size_t start = 0;
+    for (size_t i = 1; i <= blocks.size(); i++) {
+      if (i < blocks.size() && blocks[i] == blocks[i - 1] + 1) {
+        continue;
+      }
+      int first = blocks[start];
+      int n = i - start;
+      start = i;
+      if (member.host_fd >= 0 &&
+          fallocate(member.host_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t) first * BLOCK_SIZE, (off_t) n * BLOCK_SIZE) == 0) {
+        continue;
+      }
+      for (int b = first; b < first + n; b++) {
+        member.disk.write_block(b, &zeros);
+      }
+    }
+  }
+}
+
+// Sets blocks to the volume blocks in the same host page as block_num.
+// The page's blocks of the member are mapped back to the volume; the
+// stripe label and blocks past the end of the volume are left out.
+void StripedDisk::page_blocks(short block_num, std::vector<short> &blocks)
+{
+  int m, member_block;
+  locate(block_num, m, member_block);
+  int first = member_block / HOST_PAGE_BLOCKS * HOST_PAGE_BLOCKS;
+  int count = member_list.size();
+
+  blocks.clear();
+  for (int b = first; b < first + HOST_PAGE_BLOCKS; b++) {
+    int volume_block = b;
+    if (count > 1) {
+      if (b == 0) continue;
+      int row = (b - 1) / stripe_unit;
+      volume_block = (row * count + m) * stripe_unit + (b - 1) % stripe_unit;
+    }
+    if (volume_block < NUM_BLOCKS) {
+      blocks.push_back(volume_block);
+    }
+  }
+}
+
+// HELPER FUNCTIONS
+
+// Finds the member holding a volume block and the block's place in it
+void StripedDisk::locate(short block_num, int &member, int &member_block)
+{
+  int count = member_list.size();
+  if (count == 1) {
+    member = 0;
+    member_block = block_num;
+    return;
+  }
+  int unit_num = block_num / stripe_unit;
+  member = unit_num % count;
+  member_block = 1 + (unit_num / count) * stripe_unit + block_num % stripe_unit;
+}
+
+// Splits a batch by member, each share in ascending order, and hands the
+// shares to the member threads. The calling thread transfers the first
+// share itself and returns once every member is done.
+void StripedDisk::transfer(bool write, const short *block_nums, int count,
+                           char *bufs)
+{
+  if (count == 0) return;
+
+  std::vector<int> order(count);
+  for (int i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [block_nums](int a, int b) {
+    return block_nums[a] < block_nums[b];
+  });
+
+  job_write = write;
+  job_nums = block_nums;
+  job_bufs = bufs;
+  for (size_t m = 0; m < member_list.size(); m++) {
+    member_list[m]->job.clear();
+  }
+  for (int i = 0; i < count; i++) {
+    int m, member_block;
+    locate(block_nums[order[i]], m, member_block);
+    member_list[m]->job.push_back(order[i]);
+  }
+
+  member_t *own = NULL;
+  {
+    std::lock_guard<std::mutex> guard(job_mutex);
+    for (size_t m = 0; m < member_list.size(); m++) {
+      member_t *member = member_list[m];
+      if (member->job.empty()) {
+        continue;
+      }
+      if (own == NULL) {
+        own = member;
+        continue;
+      }
+      member->busy = true;
+      pending++;
+    }
+  }
+  job_cv.notify_all();
+
+  if (own != NULL) {
+    run_job(*own);
+  }
+  std::unique_lock<std::mutex> lock(job_mutex);
+  done_cv.wait(lock, [this] { return pending == 0; });
+}
+
+// Transfers a member's share of the batch
+void StripedDisk::run_job(member_t &member)
+{
+  for (size_t i = 0; i < member.job.size(); i++) {
+    int pos = member.job[i];
+    int m, member_block;
+    locate(job_nums[pos], m, member_block);
+    char *buf = job_bufs + pos * BLOCK_SIZE;
+    if (job_write) {
+      member.disk.write_block(member_block, buf);
+    } else {
+      member.disk.read_block(member_block, buf);
+    }
+  }
+}
+
+// Body of a member thread: transfers the member's shares of batches until
+// the disk is unmounted
+void StripedDisk::worker_loop(member_t *member)
+{
+  std::unique_lock<std::mutex> lock(job_mutex);
+  while (true) {
+    job_cv.wait(lock, [this, member] { return stopping || member->busy; });
+    if (stopping) {
+      return;
+    }
+
+    lock.unlock();
+    run_job(*member);
+    lock.lock();
+
+    member->busy = false;
+    if (--pending == 0) {
+      done_cv.notify_one();
+    }
+  }
+}
+
+// Mounts a member file and adds it to the disk. A member that must exist
+// and does not is an error, and so is one that is to be made new but
+// exists already, or one the host will not open. The member is not
+// added if it fails.
+bool StripedDisk::open_member(const std::string &path, bool must_exist)
+{
+  if (must_exist && access(path.c_str(), F_OK) != 0) {
+    std::cerr << path << ": missing from the striped disk" << std::endl;
+    return false;
+  }
+  member_t *member = new member_t;
+  member->path = path;
+  member->busy = false;
+  bool made = member->disk.mount(path.c_str());
+  if (made == must_exist) {
+    std::cerr << path << (must_exist ? ": disappeared while mounting"
+                                     : ": exists already, not part of a disk")
+              << std::endl;
+    if (made) {
+      unlink(path.c_str());
+    }
+    member->disk.unmount();
+    delete member;
+    return false;
+  }
+  member->host_fd = open(path.c_str(), O_RDWR);
+  if (member->host_fd < 0) {
+    std::cerr << path << ": " << strerror(errno) << std::endl;
+    member->disk.unmount();
+    delete member;
+    return false;
+  }
+  member_list.push_back(member);
+  return true;
+}
+
+// Unmounts a disk that was being made and deletes the member files made
+// for it, so that no partial set is left behind
+void StripedDisk::remove_members()
+{
+  std::vector<std::string> paths;
+  for (size_t m = 0; m < member_list.size(); m++) {
+    paths.push_back(member_list[m]->path);
+  }
+  unmount();
+  for (size_t i = 0; i < paths.size(); i++) {
+    unlink(paths[i].c_str());
+  }
+}
+
+// Reads a member's stripe label. Returns false if it has none.
+bool StripedDisk::read_label(member_t &member, stripelabel_t &label)
+{
+  member.disk.read_block(0, &label);
+  return label.magic == STRIPE_MAGIC_NUM && label.members > 1 &&
+         label.members <= MAX_STRIPE_MEMBERS && label.unit > 0;
+}
+
+// Checks that the labels of the members make up one disk, each member in
+// its place. Returns false, after saying why, if they do not.
+bool StripedDisk::check_members()
+{
+  stripelabel_t first;
+  read_label(*member_list[0], first);
+  for (size_t m = 0; m < member_list.size(); m++) {
+    stripelabel_t label;
+    if (!read_label(*member_list[m], label) || label.set_id != first.set_id ||
+        label.members != first.members || label.unit != first.unit ||
+        label.member != (int) m) {
+      std::cerr << member_list[m]->path << ": not member " << m << " of "
+                << first.members << " of the striped disk" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the stripe labels of a new striped disk of count members
+void StripedDisk::create_members(int count)
+{
+  stripelabel_t label;
+  memset(&label, 0, sizeof(label));
+  label.magic = STRIPE_MAGIC_NUM;
+  label.set_id = std::random_device()();
+  label.members = count;
+  label.unit = stripe_unit;
+  for (int m = 0; m < count; m++) {
+    label.member = m;
+    member_list[m]->disk.write_block(0, &label);
+  }
+}
+
+// Parses "<members>[:<unit>]". Every block of the volume must fit in a
+// member, label included.
+bool StripedDisk::parse_layout(const char *spec, int &count, int &unit)
+{
+  char *end;
+  count = strtol(spec, &end, 10);
+  unit = DEFAULT_STRIPE_UNIT;
+  if (end != spec && *end == ':') {
+    unit = strtol(end + 1, &end, 10);
+  }
+  if (end == spec || *end != '\0' || count < 1 ||
+      count > MAX_STRIPE_MEMBERS || unit < 1 || unit > NUM_BLOCKS) {
+    return false;
+  }
+  int rows = (NUM_BLOCKS + count * unit - 1) / (count * unit);
+  return count == 1 || 1 + rows * unit <= NUM_BLOCKS;
+}
@@ -0,0 +1,135 @@
+// Computing Systems: Striped Disk
+// Spreads the blocks of the volume over one or more disk image files, so
+// that the transfers of a batch go to several host files, and possibly
+// several host file systems, at once.
+//
+// A disk of one member is the plain image file, block n at block n. A
+// striped disk of N members is the image files <name>.0 to <name>.N-1.
+// Block 0 of each member is its stripe label (see stripelabel_t), which
+// records the layout, so the set mounts as one disk with no options.
+// The volume's blocks are dealt out to the members round robin, unit
+// blocks at a time, from block 1 of each member on:
+//
+//   stripe unit u = block / unit
+//   member        = u % N
+//   member block  = 1 + (u / N) * unit + block % unit
+//
+// A batch is split by member, and each member's share is transferred in
+// ascending order on a thread of its own, all members at the same time.
+
+#ifndef STRIPED_DISK_H
+#define STRIPED_DISK_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Disk.h"
+#include "Blocks.h"
+
+// environment variable asking for a new disk to be striped, as
+// "<members>[:<unit>]": the disk is made of that many member files with
+// unit blocks per stripe unit. An existing disk mounts with the layout
+// it was made with, whether it is set or not.
+const char *const STRIPE_ENV = "FILESYS_STRIPE";
+
+// blocks per stripe unit when FILESYS_STRIPE gives none
+const int DEFAULT_STRIPE_UNIT = 8;
+
+// most member files of a striped disk
+const int MAX_STRIPE_MEMBERS = 16;
+
+// blocks in one page of a host file, the unit in which it gives space
+// back when holes are punched
+const int HOST_PAGE_BLOCKS = 4096 / BLOCK_SIZE;
+
+class StripedDisk {
+
+  public:
+    StripedDisk();
+    ~StripedDisk();
+
+    // Mounts the image file name, or the striped disk name.0, name.1, ...
+    // if that is what exists. If neither does, a new disk is made, striped
+    // as FILESYS_STRIPE asks, and created is set; its blocks are left for
+    // the caller to format. Returns false, after saying why on cerr, if a
+    // member is missing or cannot be opened, the labels do not make up
+    // one disk, a member of a new disk exists already or FILESYS_STRIPE
+    // is invalid. Member files of a new disk are removed if it fails.
+    bool mount(const char *name, bool &created);
+
+    // Stops the member threads and unmounts the members
+    void unmount();
+
+    // Transfers one block. Only one transfer, of a block or a batch, may
+    // be in progress at a time.
+    void read_block(short block_num, void *block);
+    void write_block(short block_num, const void *block);
+
+    // Transfers count blocks from or to consecutive BLOCK_SIZE buffers.
+    // The members work on their shares in parallel, each in ascending
+    // order. A batch read may not name a block twice.
+    void read_blocks(const short *block_nums, int count, void *blocks);
+    void write_blocks(const short *block_nums, int count, const void *blocks);
+
+    // Waits until the host has stored every block written to the
+    // members so far (fdatasync of each member file)
+    void flush();
+
+    // Punches the listed blocks out of the member files, one hole per run
+    // of blocks that are consecutive in a member, so they read back as
+    // zeros and the host can reclaim their space. If the host cannot punch
+    // holes they are written with zeros instead.
+    void punch(const short *block_nums, int count);
+
+    // Sets blocks to the volume blocks stored in the same host page as
+    // block_num, block_num included
+    void page_blocks(short block_num, std::vector<short> &blocks);
+
+    int members() const { return member_list.size(); }
+    int unit() const { return stripe_unit; }
+
+  private:
+    // a member file
+    struct member_t {
+      std::string path;
+      Disk disk;
+      int host_fd;			// the file again, for punching holes
+					// and flushing (-1 - not open)
+      std::vector<int> job;		// positions of the batch it transfers
+      bool busy;			// job handed to its thread, not done
+      std::thread worker;		// transfers its jobs
+    };
+
+    std::vector<member_t *> member_list;
+    int stripe_unit;			// blocks per stripe unit
+
+    // the batch being transferred
+    std::mutex job_mutex;		// guards busy, pending and stopping
+    std::condition_variable job_cv;	// signalled when jobs are handed out
+    std::condition_variable done_cv;	// signalled when a member is done
+    bool job_write;
+    const short *job_nums;
+    char *job_bufs;
+    int pending;			// members still transferring
+    bool stopping;			// member threads must exit
+
+    // Helper functions
+    void locate(short block_num, int &member, int &member_block);
+    void transfer(bool write, const short *block_nums, int count, char *bufs);
+    void run_job(member_t &member);
+    void worker_loop(member_t *member);
+    bool open_member(const std::string &path, bool must_exist);
+    bool read_label(member_t &member, stripelabel_t &label);
+    bool check_members();
+    void create_members(int count);
+    void remove_members();
+    static bool parse_layout(const char *spec, int &count, int &unit);
+
+    // not copyable
+    StripedDisk(const StripedDisk &);
+    StripedDisk &operator=(const StripedDisk &);
+};
+
+#endif
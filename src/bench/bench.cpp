@@ -0,0 +1,535 @@
+// Computing Systems: bench
+// Micro and macro benchmarks of the file system. Each microbenchmark runs
+// on a fresh disk filled to a given level and times every operation; the
+// macro benchmarks replay shell scripts end to end. The results are
+// written as JSON so that runs on two commits can be compared.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "FileSys.h"
+#include "Shell.h"
+#include "Volume.h"
+
+using namespace std;
+
+const int MICRO_OPS = 1000;		// timed operations per microbenchmark
+const int REPLAY_RUNS = 5;		// replays of each script
+const double FILL_LEVELS[] = {0.0, 0.5, 0.9};	// fractions of the data blocks in use
+const int FILL_FILE_SIZE = 1024;	// bytes in each file that fills the disk
+const int ALLOC_ROUND = 64;		// blocks taken before giving them back
+const int ALLOC_THREADS[] = {1, 2, 4, 8};	// threads allocating at once
+const int ALLOC_THREAD_OPS = 20000;	// allocations timed per thread
+const int LOOKUP_FILES = 8;		// files find_file looks up
+const int APPEND_SIZE = 64;		// bytes per append
+const int CAT_SIZE = 4096;		// bytes in the file cat reads
+const int CP_SIZE = 1024;		// bytes in the file cp copies
+
+typedef chrono::steady_clock bench_clock;
+
+// What one benchmark measured
+struct bench_result_t {
+  string name;
+  double fill;			// fill level (-1 for script replays)
+  int ops;			// operations timed
+  double seconds;		// time spent in them
+  vector<double> latencies;	// seconds per operation (per run for replays)
+  unsigned long block_reads;	// blocks read from the disk
+  unsigned long block_writes;	// blocks written to the disk
+};
+
+// Swallows whatever the shell prints during a replay
+class NullOutput : public streambuf {
+  protected:
+    int overflow(int c) { return c == EOF ? 0 : c; }
+    streamsize xsputn(const char *, streamsize n) { return n; }
+};
+
+// HELPER FUNCTIONS
+
+// Seconds since start
+static double elapsed(bench_clock::time_point start)
+{
+  return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Blocks transferred to and from the disk so far, the journal included
+static void block_io(BasicFileSys &bfs, unsigned long &reads,
+                     unsigned long &writes)
+{
+  reads = bfs.io_stats().total(IO_LEVEL_DISK, IO_OP_READ);
+  writes = bfs.io_stats().total(IO_LEVEL_DISK, IO_OP_WRITE);
+}
+
+// Starts a result, noting the block counters before the run
+static void begin_result(bench_result_t &result, const string &name,
+                         double fill, BasicFileSys &bfs)
+{
+  result.name = name;
+  result.fill = fill;
+  result.ops = 0;
+  result.seconds = 0;
+  result.latencies.clear();
+  block_io(bfs, result.block_reads, result.block_writes);
+}
+
+// Finishes a result: dirty blocks are written back so the counters
+// include them
+static void end_result(bench_result_t &result, BasicFileSys &bfs)
+{
+  bfs.sync();
+  unsigned long reads, writes;
+  block_io(bfs, reads, writes);
+  result.block_reads = reads - result.block_reads;
+  result.block_writes = writes - result.block_writes;
+}
+
+// Records the time of one operation
+static void add_op(bench_result_t &result, double seconds)
+{
+  result.ops++;
+  result.seconds += seconds;
+  result.latencies.push_back(seconds);
+}
+
+// Nearest-rank percentile of the latencies, in seconds
+static double percentile(vector<double> latencies, double p)
+{
+  if (latencies.empty()) return 0;
+  sort(latencies.begin(), latencies.end());
+  size_t rank = (size_t) (p * latencies.size() + 0.999999);
+  if (rank < 1) rank = 1;
+  return latencies[min(rank, latencies.size()) - 1];
+}
+
+// Fraction of the data blocks in use
+static double fill_level(BasicFileSys &bfs)
+{
+  double data_blocks = NUM_BLOCKS - FIRST_FREE_BLOCK;
+  return 1 - bfs.num_free_blocks() / data_blocks;
+}
+
+// Creates a file holding size bytes
+static io_status_t make_file(FileSys &fs, const char *name, int size)
+{
+  io_status_t status = fs.create(name);
+  if (status != IO_OK) return status;
+  vector<char> data(size, 'x');
+  return fs.append(name, data.data(), size);
+}
+
+// Fills the disk to level with files in directories under /fill, then
+// returns to the root
+static void fill_disk(FileSys &fs, BasicFileSys &bfs, double level)
+{
+  int dirs = 0;
+  int files = 0;
+  bool have_dir = false;
+  while (fill_level(bfs) < level) {
+    if (!have_dir) {
+      string dir = "fill" + to_string(dirs++);
+      fs.home();
+      if (fs.mkdir(dir.c_str()) != IO_OK || fs.cd(dir.c_str()) != IO_OK) {
+        break;
+      }
+      have_dir = true;
+    }
+    string name = "f" + to_string(files++);
+    io_status_t status = make_file(fs, name.c_str(), FILL_FILE_SIZE);
+    if (status == IO_DIR_FULL) {
+      have_dir = false;
+    } else if (status != IO_OK) {
+      break;
+    }
+  }
+  fs.home();
+}
+
+// Takes blocks ALLOC_ROUND at a time, timing each get_free_block, and
+// gives every round back
+static void bench_get_free_block(BasicFileSys &bfs, double fill,
+                                 bench_result_t &result)
+{
+  begin_result(result, "get_free_block", fill, bfs);
+  short blocks[ALLOC_ROUND];
+  while (result.ops < MICRO_OPS) {
+    int count = 0;
+    while (count < ALLOC_ROUND && result.ops < MICRO_OPS) {
+      bench_clock::time_point start = bench_clock::now();
+      short block_num = bfs.get_free_block();
+      double seconds = elapsed(start);
+      if (block_num == 0) break;
+      add_op(result, seconds);
+      blocks[count++] = block_num;
+    }
+    bfs.reclaim_blocks(blocks, count);
+    if (count == 0) break;
+  }
+  end_result(result, bfs);
+}
+
+// Body of an allocating thread: takes blocks ALLOC_ROUND at a time,
+// timing each get_free_block, and returns every round unused so no
+// block is punched
+static void alloc_loop(BasicFileSys &bfs, vector<double> &latencies)
+{
+  short blocks[ALLOC_ROUND];
+  int ops = 0;
+  while (ops < ALLOC_THREAD_OPS) {
+    int count = 0;
+    while (count < ALLOC_ROUND && ops < ALLOC_THREAD_OPS) {
+      bench_clock::time_point start = bench_clock::now();
+      short block_num = bfs.get_free_block();
+      double seconds = elapsed(start);
+      if (block_num == 0) break;
+      latencies.push_back(seconds);
+      blocks[count++] = block_num;
+      ops++;
+    }
+    bfs.return_blocks(blocks, count);
+    if (count == 0) break;
+  }
+}
+
+// Runs alloc_loop on threads threads at once on one file system. The
+// result's time is the wall time of the whole run, so ops_per_sec is
+// the combined throughput and shows how allocation scales.
+static void bench_alloc_threads(BasicFileSys &bfs, int threads,
+                                bench_result_t &result)
+{
+  begin_result(result, "get_free_block_x" + to_string(threads), 0, bfs);
+  vector<vector<double> > latencies(threads);
+  vector<thread> workers;
+  bench_clock::time_point start = bench_clock::now();
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(thread(alloc_loop, ref(bfs), ref(latencies[t])));
+  }
+  for (int t = 0; t < threads; t++) {
+    workers[t].join();
+  }
+  result.seconds = elapsed(start);
+  for (int t = 0; t < threads; t++) {
+    result.latencies.insert(result.latencies.end(), latencies[t].begin(),
+                            latencies[t].end());
+  }
+  result.ops = result.latencies.size();
+  end_result(result, bfs);
+}
+
+// Looks up the names of a directory in turn (stat goes through find_file)
+static void bench_find_file(FileSys &fs, BasicFileSys &bfs, double fill,
+                            bench_result_t &result)
+{
+  fs.mkdir("lookup");
+  fs.cd("lookup");
+  vector<string> names;
+  for (int i = 0; i < LOOKUP_FILES; i++) {
+    names.push_back("name" + to_string(i));
+    fs.create(names.back().c_str());
+  }
+
+  begin_result(result, "find_file", fill, bfs);
+  file_info_t info;
+  for (int i = 0; i < MICRO_OPS; i++) {
+    bench_clock::time_point start = bench_clock::now();
+    io_status_t status = fs.stat(names[i % names.size()].c_str(), info);
+    double seconds = elapsed(start);
+    if (status != IO_OK) break;
+    add_op(result, seconds);
+  }
+  end_result(result, bfs);
+
+  for (size_t i = 0; i < names.size(); i++) {
+    fs.rm(names[i].c_str());
+  }
+  fs.home();
+  fs.rmdir("lookup");
+}
+
+// Appends APPEND_SIZE bytes at a time, starting the file over when it
+// is full
+static void bench_append(FileSys &fs, BasicFileSys &bfs, double fill,
+                         bench_result_t &result)
+{
+  char data[APPEND_SIZE];
+  memset(data, 'a', sizeof(data));
+  fs.create("append");
+
+  begin_result(result, "append", fill, bfs);
+  unsigned int size = 0;
+  while (result.ops < MICRO_OPS) {
+    if (size + APPEND_SIZE > MAX_FILE_SIZE) {
+      fs.rm("append");
+      fs.create("append");
+      size = 0;
+    }
+    bench_clock::time_point start = bench_clock::now();
+    io_status_t status = fs.append("append", data, APPEND_SIZE);
+    double seconds = elapsed(start);
+    if (status != IO_OK) break;
+    add_op(result, seconds);
+    size += APPEND_SIZE;
+  }
+  end_result(result, bfs);
+  fs.rm("append");
+}
+
+// Reads a CAT_SIZE file into a pipe
+static void bench_cat(FileSys &fs, BasicFileSys &bfs, double fill,
+                      bench_result_t &result)
+{
+  make_file(fs, "cat", CAT_SIZE);
+  Pipe out;
+
+  begin_result(result, "cat", fill, bfs);
+  for (int i = 0; i < MICRO_OPS; i++) {
+    out.clear();
+    bench_clock::time_point start = bench_clock::now();
+    io_status_t status = fs.cat("cat", out);
+    double seconds = elapsed(start);
+    if (status != IO_OK) break;
+    add_op(result, seconds);
+  }
+  end_result(result, bfs);
+  fs.rm("cat");
+}
+
+// Copies a CP_SIZE file, removing the copy before the next one
+static void bench_cp(FileSys &fs, BasicFileSys &bfs, double fill,
+                     bench_result_t &result)
+{
+  make_file(fs, "cp", CP_SIZE);
+
+  begin_result(result, "cp", fill, bfs);
+  for (int i = 0; i < MICRO_OPS; i++) {
+    bench_clock::time_point start = bench_clock::now();
+    io_status_t status = fs.cp("cp", "cp.copy");
+    double seconds = elapsed(start);
+    if (status != IO_OK) break;
+    add_op(result, seconds);
+    fs.rm("cp.copy");
+  }
+  end_result(result, bfs);
+  fs.rm("cp");
+}
+
+// Runs every microbenchmark on a new disk filled to fill
+static bool run_micro(double fill, vector<bench_result_t> &results)
+{
+  unlink("DISK");
+  Volume vol;
+  if (!vol.mount()) {
+    cerr << "Could not mount DISK" << endl;
+    return false;
+  }
+  vol.bfs.io_stats().enable(true);
+  FileSys fs(vol);
+  fs.mount();
+  fill_disk(fs, vol.bfs, fill);
+
+  bench_result_t result;
+  bench_get_free_block(vol.bfs, fill, result);
+  results.push_back(result);
+  bench_find_file(fs, vol.bfs, fill, result);
+  results.push_back(result);
+  bench_append(fs, vol.bfs, fill, result);
+  results.push_back(result);
+  bench_cat(fs, vol.bfs, fill, result);
+  results.push_back(result);
+  bench_cp(fs, vol.bfs, fill, result);
+  results.push_back(result);
+
+  fs.unmount();
+  vol.unmount();
+  return true;
+}
+
+// Runs the allocation scaling benchmark for each thread count, each on a
+// new empty disk
+static bool run_alloc_scaling(vector<bench_result_t> &results)
+{
+  for (size_t i = 0; i < sizeof(ALLOC_THREADS) / sizeof(ALLOC_THREADS[0]); i++) {
+    unlink("DISK");
+    Volume vol;
+    if (!vol.mount()) {
+      cerr << "Could not mount DISK" << endl;
+      return false;
+    }
+    vol.bfs.io_stats().enable(true);
+    bench_result_t result;
+    bench_alloc_threads(vol.bfs, ALLOC_THREADS[i], result);
+    results.push_back(result);
+    vol.unmount();
+  }
+  return true;
+}
+
+// Commands in a script (its newline-terminated lines)
+static int count_commands(const char *file_name)
+{
+  ifstream in(file_name, ios::binary);
+  int lines = 0;
+  char c;
+  while (in.get(c)) {
+    if (c == '\n') lines++;
+  }
+  return lines;
+}
+
+// Replays a script REPLAY_RUNS times, each on a new disk, with the
+// shell's output thrown away
+static bool run_replay(char *file_name, vector<bench_result_t> &results)
+{
+  const char *base = strrchr(file_name, '/');
+  int commands = count_commands(file_name);
+  bench_result_t result;
+  result.name = base != NULL ? base + 1 : file_name;
+  result.fill = -1;
+  result.ops = 0;
+  result.seconds = 0;
+  result.block_reads = 0;
+  result.block_writes = 0;
+
+  NullOutput null_output;
+  for (int run = 0; run < REPLAY_RUNS; run++) {
+    unlink("DISK");
+    Volume vol;
+    if (!vol.mount()) {
+      cerr << "Could not mount DISK" << endl;
+      return false;
+    }
+    vol.bfs.io_stats().enable(true);
+    unsigned long reads, writes;
+    block_io(vol.bfs, reads, writes);
+
+    streambuf *old_out = cout.rdbuf(&null_output);
+    streambuf *old_err = cerr.rdbuf(&null_output);
+    bench_clock::time_point start = bench_clock::now();
+    {
+      Shell shell(vol);
+      shell.run_script(file_name, true);
+    }
+    vol.bfs.sync();
+    double seconds = elapsed(start);
+    cout.rdbuf(old_out);
+    cerr.rdbuf(old_err);
+
+    unsigned long end_reads, end_writes;
+    block_io(vol.bfs, end_reads, end_writes);
+    result.block_reads += end_reads - reads;
+    result.block_writes += end_writes - writes;
+    result.ops += commands;
+    result.seconds += seconds;
+    result.latencies.push_back(seconds);
+    vol.unmount();
+  }
+  results.push_back(result);
+  return true;
+}
+
+// Writes one result as a JSON object. Microbenchmark latencies are in
+// microseconds, replay latencies (one per run) in milliseconds.
+static void write_result(ostream &out, const bench_result_t &result,
+                         bool last)
+{
+  bool replay = result.fill < 0;
+  double scale = replay ? 1e3 : 1e6;
+  const char *unit = replay ? "ms" : "us";
+  char line[512];
+  snprintf(line, sizeof(line),
+           "    {\"name\": \"%s\", %s\"ops\": %d, \"ops_per_sec\": %.1f, "
+           "\"p50_%s\": %.3f, \"p99_%s\": %.3f, "
+           "\"block_reads\": %lu, \"block_writes\": %lu}%s",
+           result.name.c_str(),
+           replay ? "" : ("\"fill\": " + to_string(result.fill).substr(0, 4) +
+                          ", ").c_str(),
+           result.ops,
+           result.seconds > 0 ? result.ops / result.seconds : 0.0,
+           unit, percentile(result.latencies, 0.50) * scale,
+           unit, percentile(result.latencies, 0.99) * scale,
+           result.block_reads, result.block_writes, last ? "" : ",");
+  out << line << endl;
+}
+
+// Writes every result as JSON
+static void write_results(ostream &out, const vector<bench_result_t> &micro,
+                          const vector<bench_result_t> &replays)
+{
+  out << "{" << endl;
+  out << "  \"micro\": [" << endl;
+  for (size_t i = 0; i < micro.size(); i++) {
+    write_result(out, micro[i], i + 1 == micro.size());
+  }
+  out << "  ]," << endl;
+  out << "  \"replay\": [" << endl;
+  for (size_t i = 0; i < replays.size(); i++) {
+    write_result(out, replays[i], i + 1 == replays.size());
+  }
+  out << "  ]" << endl;
+  out << "}" << endl;
+}
+
+// Prints a line per result
+static void print_summary(const vector<bench_result_t> &results)
+{
+  for (size_t i = 0; i < results.size(); i++) {
+    const bench_result_t &r = results[i];
+    bool replay = r.fill < 0;
+    char line[256];
+    snprintf(line, sizeof(line), "%-22s %5s %10.0f ops/s  p50 %9.3f %s  p99 %9.3f %s  io %lu/%lu",
+             r.name.c_str(),
+             replay ? "" : (to_string((int) (r.fill * 100 + 0.5)) + "%").c_str(),
+             r.seconds > 0 ? r.ops / r.seconds : 0.0,
+             percentile(r.latencies, 0.50) * (replay ? 1e3 : 1e6),
+             replay ? "ms" : "us",
+             percentile(r.latencies, 0.99) * (replay ? 1e3 : 1e6),
+             replay ? "ms" : "us",
+             r.block_reads, r.block_writes);
+    cout << line << endl;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    cerr << "Usage: ./filesys_bench <results.json> [<script-name> ...]" << endl;
+    return 1;
+  }
+
+  vector<bench_result_t> micro;
+  for (size_t i = 0; i < sizeof(FILL_LEVELS) / sizeof(FILL_LEVELS[0]); i++) {
+    if (!run_micro(FILL_LEVELS[i], micro)) {
+      return 1;
+    }
+  }
+  if (!run_alloc_scaling(micro)) {
+    return 1;
+  }
+  print_summary(micro);
+
+  vector<bench_result_t> replays;
+  for (int i = 2; i < argc; i++) {
+    if (!run_replay(argv[i], replays)) {
+      return 1;
+    }
+  }
+  print_summary(replays);
+  unlink("DISK");
+
+  ofstream out(argv[1]);
+  if (out.fail()) {
+    cerr << "Could not write " << argv[1] << endl;
+    return 1;
+  }
+  write_results(out, micro, replays);
+  cout << "Results written to " << argv[1] << endl;
+  return 0;
+}
@@ -0,0 +1,366 @@
+// Computing Systems: workload
+// Generates a shell script of a synthetic workload. The commands are drawn
+// from a seeded mix of create, append, cat and rm over a directory tree of
+// a given fan-out and depth, with file sizes spread log-uniformly between
+// two bounds. The generator tracks the directory entries and blocks the
+// files use, so the script never fills a directory or the disk, and the
+// same options and seed always give the same script.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Blocks.h"
+
+using namespace std;
+
+// operations in the mix
+enum { GEN_CREATE, GEN_APPEND, GEN_CAT, GEN_RM, GEN_OPS };
+
+const int APPEND_CHUNK = 64;	// most bytes one append line writes
+const double DISK_BUDGET = 0.75;	// fraction of the data blocks files may use
+
+// What the script is made of
+struct gen_options_t {
+  int ops;			// operations (create, append, cat, rm)
+  unsigned int seed;
+  int weights[GEN_OPS];		// relative frequency of each operation
+  int min_size;			// bytes in a new file, log-uniform
+  int max_size;
+  int fanout;			// subdirectories of each directory
+  int depth;			// levels of subdirectories below the root
+};
+
+// a directory of the generated tree
+struct gen_dir_t {
+  vector<string> path;		// names from the root
+  int entry_bytes;		// directory block space its entries take
+};
+
+// a file of the generated tree
+struct gen_file_t {
+  int dir;			// directory it is in
+  string name;
+  int size;			// bytes in it
+  bool live;
+};
+
+class Workload {
+
+  public:
+    Workload(const gen_options_t &options)
+      : options(options), rng(options.seed), current_dir(0), blocks_used(0),
+        live_files(0)
+    {
+      budget = (int) ((NUM_BLOCKS - FIRST_FREE_BLOCK) * DISK_BUDGET);
+    }
+
+    // writes the whole script
+    void generate()
+    {
+      make_tree();
+      // an operation that cannot run (nothing to read, no room) falls
+      // back to one that can
+      for (int i = 0; i < options.ops; i++) {
+        switch (pick_op()) {
+        case GEN_CREATE:
+          create_file() || rm_file();
+          break;
+        case GEN_APPEND:
+          append_file() || cat_file() || create_file();
+          break;
+        case GEN_CAT:
+          cat_file() || create_file();
+          break;
+        default:
+          rm_file() || create_file();
+          break;
+        }
+      }
+      go_to(0);
+      cout << "quit\n";
+    }
+
+  private:
+    gen_options_t options;
+    mt19937 rng;
+    vector<gen_dir_t> dirs;	// dirs[0] is the root
+    vector<gen_file_t> files;
+    int current_dir;		// where the script is
+    int blocks_used;		// by the directories and live files
+    int budget;			// blocks the files may use
+    int live_files;
+
+    // a number in [0, n)
+    int below(int n)
+    {
+      return (int) (rng() % (unsigned int) n);
+    }
+
+    // blocks a file of size bytes takes, its inode included
+    static int file_blocks(int size)
+    {
+      return 1 + (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    // directory block space an entry called name takes
+    static int entry_bytes(const string &name)
+    {
+      return DIR_ENTRY_SIZE + name.size();
+    }
+
+    // makes the directories level by level, breadth first. They may take
+    // a quarter of the budget.
+    void make_tree()
+    {
+      gen_dir_t root;
+      root.entry_bytes = 0;
+      dirs.push_back(root);
+      size_t level_start = 0;
+      for (int level = 0; level < options.depth; level++) {
+        size_t level_end = dirs.size();
+        for (size_t d = level_start; d < level_end; d++) {
+          for (int i = 0; i < options.fanout; i++) {
+            string name = "d" + to_string(i);
+            if (dirs[d].entry_bytes + entry_bytes(name) > DIR_DATA_SIZE ||
+                blocks_used >= budget / 4) {
+              break;
+            }
+            go_to(d);
+            cout << "mkdir " << name << "\n";
+            dirs[d].entry_bytes += entry_bytes(name);
+            gen_dir_t sub;
+            sub.path = dirs[d].path;
+            sub.path.push_back(name);
+            sub.entry_bytes = 0;
+            dirs.push_back(sub);
+            blocks_used++;
+          }
+        }
+        level_start = level_end;
+      }
+    }
+
+    // the operation to run next, by weight
+    int pick_op()
+    {
+      int total = 0;
+      for (int op = 0; op < GEN_OPS; op++) total += options.weights[op];
+      int r = below(total);
+      for (int op = 0; op < GEN_OPS; op++) {
+        if (r < options.weights[op]) return op;
+        r -= options.weights[op];
+      }
+      return GEN_CAT;
+    }
+
+    // a size drawn log-uniformly from [min_size, max_size]
+    int pick_size()
+    {
+      double lo = log((double) options.min_size);
+      double hi = log((double) options.max_size + 1);
+      double u = (rng() & 0xFFFFFF) / (double) 0x1000000;
+      int size = (int) exp(lo + u * (hi - lo));
+      return min(max(size, options.min_size), options.max_size);
+    }
+
+    // a live file picked at random, or -1 if there is none
+    int pick_file()
+    {
+      if (live_files == 0) return -1;
+      int n = below(live_files);
+      for (size_t f = 0; f < files.size(); f++) {
+        if (files[f].live && n-- == 0) return f;
+      }
+      return -1;
+    }
+
+    // writes the commands that move the script to directory d
+    void go_to(int d)
+    {
+      if (d == current_dir) return;
+      cout << "home\n";
+      for (size_t i = 0; i < dirs[d].path.size(); i++) {
+        cout << "cd " << dirs[d].path[i] << "\n";
+      }
+      current_dir = d;
+    }
+
+    // writes appends that add size random letters to the file
+    void write_data(const gen_file_t &file, int size)
+    {
+      char chunk[APPEND_CHUNK + 1];
+      while (size > 0) {
+        int n = min(size, APPEND_CHUNK);
+        for (int i = 0; i < n; i++) chunk[i] = 'a' + below(26);
+        chunk[n] = '\0';
+        cout << "append " << file.name << " " << chunk << "\n";
+        size -= n;
+      }
+    }
+
+    // creates a file of a random size in a random directory with room
+    bool create_file()
+    {
+      gen_file_t file;
+      file.name = "f" + to_string(files.size());
+      file.size = pick_size();
+      file.live = true;
+      if (blocks_used + file_blocks(file.size) > budget) return false;
+
+      // try a few directories for one with room
+      for (int tries = 0; tries < 8; tries++) {
+        int d = below(dirs.size());
+        if (dirs[d].entry_bytes + entry_bytes(file.name) > DIR_DATA_SIZE) continue;
+
+        file.dir = d;
+        go_to(d);
+        cout << "create " << file.name << "\n";
+        write_data(file, file.size);
+        dirs[d].entry_bytes += entry_bytes(file.name);
+        blocks_used += file_blocks(file.size);
+        files.push_back(file);
+        live_files++;
+        return true;
+      }
+      return false;
+    }
+
+    // appends up to APPEND_CHUNK bytes to a random file
+    bool append_file()
+    {
+      int f = pick_file();
+      if (f < 0) return false;
+      gen_file_t &file = files[f];
+      int n = 1 + below(APPEND_CHUNK);
+      int grown = file_blocks(file.size + n) - file_blocks(file.size);
+      if (file.size + n > MAX_FILE_SIZE || blocks_used + grown > budget) {
+        return false;
+      }
+      go_to(file.dir);
+      write_data(file, n);
+      file.size += n;
+      blocks_used += grown;
+      return true;
+    }
+
+    // reads a random file
+    bool cat_file()
+    {
+      int f = pick_file();
+      if (f < 0) return false;
+      go_to(files[f].dir);
+      cout << "cat " << files[f].name << "\n";
+      return true;
+    }
+
+    // removes a random file
+    bool rm_file()
+    {
+      int f = pick_file();
+      if (f < 0) return false;
+      gen_file_t &file = files[f];
+      go_to(file.dir);
+      cout << "rm " << file.name << "\n";
+      file.live = false;
+      live_files--;
+      blocks_used -= file_blocks(file.size);
+      dirs[file.dir].entry_bytes -= entry_bytes(file.name);
+      return true;
+    }
+};
+
+// HELPER FUNCTIONS
+
+// Parses "a:b" into two numbers. Returns false if it is not that.
+static bool parse_pair(const char *arg, int &a, int &b)
+{
+  char extra;
+  return sscanf(arg, "%d:%d%c", &a, &b, &extra) == 2;
+}
+
+// Parses the mix "create:append:cat:rm"
+static bool parse_mix(const char *arg, int *weights)
+{
+  char extra;
+  if (sscanf(arg, "%d:%d:%d:%d%c", &weights[GEN_CREATE], &weights[GEN_APPEND],
+             &weights[GEN_CAT], &weights[GEN_RM], &extra) != 4) {
+    return false;
+  }
+  int total = 0;
+  for (int op = 0; op < GEN_OPS; op++) {
+    if (weights[op] < 0) return false;
+    total += weights[op];
+  }
+  return total > 0;
+}
+
+static void usage()
+{
+  cerr << "Usage: ./filesys_workload [options] > script.txt" << endl;
+  cerr << "  -n <ops>       operations to generate (default 1000)" << endl;
+  cerr << "  -s <seed>      random seed (default 1)" << endl;
+  cerr << "  -m <c:a:t:r>   create:append:cat:rm weights (default 20:40:30:10)" << endl;
+  cerr << "  -z <min:max>   file size in bytes, log-uniform (default 16:2048)" << endl;
+  cerr << "  -f <fanout>    subdirectories per directory (default 4)" << endl;
+  cerr << "  -d <depth>     levels of subdirectories (default 2)" << endl;
+}
+
+int main(int argc, char **argv)
+{
+  gen_options_t options;
+  options.ops = 1000;
+  options.seed = 1;
+  options.weights[GEN_CREATE] = 20;
+  options.weights[GEN_APPEND] = 40;
+  options.weights[GEN_CAT] = 30;
+  options.weights[GEN_RM] = 10;
+  options.min_size = 16;
+  options.max_size = 2048;
+  options.fanout = 4;
+  options.depth = 2;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 == argc) {
+      usage();
+      return 1;
+    }
+    const char *flag = argv[i];
+    const char *arg = argv[++i];
+    bool ok = true;
+    if (strcmp(flag, "-n") == 0) {
+      options.ops = atoi(arg);
+      ok = options.ops > 0;
+    } else if (strcmp(flag, "-s") == 0) {
+      options.seed = strtoul(arg, NULL, 10);
+    } else if (strcmp(flag, "-m") == 0) {
+      ok = parse_mix(arg, options.weights);
+    } else if (strcmp(flag, "-z") == 0) {
+      ok = parse_pair(arg, options.min_size, options.max_size) &&
+           options.min_size > 0 && options.min_size <= options.max_size &&
+           options.max_size <= MAX_FILE_SIZE;
+    } else if (strcmp(flag, "-f") == 0) {
+      options.fanout = atoi(arg);
+      ok = options.fanout >= 0;
+    } else if (strcmp(flag, "-d") == 0) {
+      options.depth = atoi(arg);
+      ok = options.depth >= 0;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      cerr << "Invalid option: " << flag << " " << arg << endl;
+      usage();
+      return 1;
+    }
+  }
+
+  Workload workload(options);
+  workload.generate();
+  return 0;
+}
@@ -0,0 +1,287 @@
+// Computing Systems: Daemon
+// Mounts the disk once and serves many clients over a UNIX domain
+// socket. Each client gets its own shell session (working directory,
+// cursors) on the shared volume.
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+#include "Daemon.h"
+
+static const string MOUNT_ERROR = "Could not mount disk";
+
+// events fetched per epoll_wait and bytes per read
+static const int MAX_EVENTS = 64;
+static const int READ_CHUNK = 4096;
+
+// set by SIGINT and SIGTERM
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+  stop_requested = 1;
+}
+
+// Switches a socket to non-blocking mode
+static bool set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+Daemon::Daemon() : listen_fd(-1), epoll_fd(-1)
+{
+}
+
+Daemon::~Daemon()
+{
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+  }
+  if (listen_fd != -1) {
+    close(listen_fd);
+  }
+}
+
+// Mounts the disk, listens on socket_path and serves clients until
+// SIGINT or SIGTERM. Returns false if it could not start.
+bool Daemon::run(const char *socket_path)
+{
+  if (!volume.mount()) {
+    cerr << MOUNT_ERROR << endl;
+    return false;
+  }
+  if (!listen_on(socket_path)) {
+    volume.unmount();
+    return false;
+  }
+
+  // stop cleanly on SIGINT/SIGTERM; epoll_wait is interrupted, not
+  // restarted. Writes to a vanished client must not kill the daemon.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  cerr << "Serving DISK on " << socket_path << endl;
+
+  while (!stop_requested) {
+    struct epoll_event events[MAX_EVENTS];
+    int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        accept_clients();
+        continue;
+      }
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+          clients.count(fd) != 0) {
+        read_client(fd);
+      }
+      if ((events[i].events & EPOLLOUT) && clients.count(fd) != 0) {
+        write_client(fd);
+      }
+    }
+  }
+
+  // shut down: end every session, then unmount once
+  while (!clients.empty()) {
+    close_client(clients.begin()->first);
+  }
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path);
+  volume.unmount();
+  return true;
+}
+
+// HELPER FUNCTIONS
+
+// Creates the listening socket and the event loop
+bool Daemon::listen_on(const char *socket_path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    cerr << "Socket path is too long" << endl;
+    return false;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1) {
+    perror("socket");
+    return false;
+  }
+
+  // a socket file left by a daemon that died is replaced
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, SOMAXCONN) == -1 || !set_nonblocking(listen_fd)) {
+    perror(socket_path);
+    return false;
+  }
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
+    perror("epoll_create1");
+    return false;
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  return true;
+}
+
+// Accepts every pending connection and starts a session for each
+void Daemon::accept_clients()
+{
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      return;		// EAGAIN: no more pending connections
+    }
+    set_nonblocking(fd);
+
+    client_t client;
+    client.shell = new Shell(volume);
+    client.shell->open_session();
+    client.closing = false;
+    clients[fd] = client;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+// Reads what a client sent and runs every complete request in it
+void Daemon::read_client(int fd)
+{
+  client_t &client = clients[fd];
+
+  bool eof = false;
+  char buf[READ_CHUNK];
+  while (true) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      client.in.append(buf, n);
+    } else if (n == 0) {
+      eof = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      eof = (errno != EAGAIN && errno != EWOULDBLOCK);
+      break;
+    }
+  }
+
+  string payload;
+  int taken;
+  while (!client.closing && (taken = take_frame(client.in, payload)) != 0) {
+    request_t request;
+    if (taken < 0 || !decode_request(payload, request)) {
+      close_client(fd);		// not speaking the protocol
+      return;
+    }
+    response_t response = execute(client, request);
+    client.out += encode_response(response);
+    client.closing = (response.status == STATUS_QUIT);
+  }
+
+  if (eof) {
+    close_client(fd);
+    return;
+  }
+  write_client(fd);
+}
+
+// Sends as much pending output as the socket takes, and waits for the
+// socket to drain if some is left
+void Daemon::write_client(int fd)
+{
+  client_t &client = clients[fd];
+
+  while (!client.out.empty()) {
+    ssize_t n = send(fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+    if (n > 0) {
+      client.out.erase(0, n);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      close_client(fd);
+      return;
+    }
+  }
+
+  if (client.out.empty() && client.closing) {
+    close_client(fd);
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = client.out.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+  event.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+// Ends a client's session and drops the connection
+void Daemon::close_client(int fd)
+{
+  map<int, client_t>::iterator it = clients.find(fd);
+  if (it == clients.end()) {
+    return;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  it->second.shell->close_session();
+  delete it->second.shell;
+  clients.erase(it);
+}
+
+// Runs a request in the client's session and captures what it prints.
+// Requests run one at a time on the event loop, so redirecting the
+// standard streams is safe.
+response_t Daemon::execute(client_t &client, const request_t &request)
+{
+  ostringstream out, err;
+  streambuf *old_out = cout.rdbuf(out.rdbuf());
+  streambuf *old_err = cerr.rdbuf(err.rdbuf());
+
+  bool quit = client.shell->execute_request(request);
+
+  cout.rdbuf(old_out);
+  cerr.rdbuf(old_err);
+
+  response_t response;
+  response.status = quit ? STATUS_QUIT : STATUS_OK;
+  response.out = out.str();
+  response.err = err.str();
+  return response;
+}
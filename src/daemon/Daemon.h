@@ -0,0 +1,50 @@
+// Computing Systems: Daemon
+// Mounts the disk once and serves many clients over a UNIX domain
+// socket. Each client gets its own shell session (working directory,
+// cursors) on the shared volume.
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <map>
+#include <string>
+#include "Protocol.h"
+#include "Shell.h"
+#include "Volume.h"
+
+using namespace std;
+
+class Daemon {
+
+  public:
+    Daemon();
+    ~Daemon();
+
+    // Mounts the disk, listens on socket_path and serves clients until
+    // SIGINT or SIGTERM. Returns false if it could not start.
+    bool run(const char *socket_path);
+
+  private:
+    // state of a connected client
+    struct client_t {
+      Shell *shell;		// the client's session
+      string in;		// bytes received, not yet a whole request
+      string out;		// responses not yet sent
+      bool closing;		// close once out is sent
+    };
+
+    Volume volume;			// the mounted disk
+    int listen_fd;			// listening socket
+    int epoll_fd;			// event loop
+    map<int, client_t> clients;		// by socket
+
+    // Helper functions
+    bool listen_on(const char *socket_path);
+    void accept_clients();
+    void read_client(int fd);
+    void write_client(int fd);
+    void close_client(int fd);
+    response_t execute(client_t &client, const request_t &request);
+};
+
+#endif
@@ -0,0 +1,168 @@
+// Computing Systems: Daemon protocol
+// Binary messages exchanged between the file system daemon and its
+// clients over a UNIX domain socket.
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Protocol.h"
+
+// Appends an integer of type T in host byte order
+template <typename T>
+static void put(string &buffer, T value)
+{
+  buffer.append((const char *) &value, sizeof(value));
+}
+
+// Reads an integer of type T at pos and moves pos past it. Returns false
+// if the payload is too short.
+template <typename T>
+static bool get(const string &payload, size_t &pos, T &value)
+{
+  if (payload.size() - pos < sizeof(value)) {
+    return false;
+  }
+  memcpy(&value, payload.data() + pos, sizeof(value));
+  pos += sizeof(value);
+  return true;
+}
+
+// Reads len bytes at pos into value and moves pos past them
+static bool get_bytes(const string &payload, size_t &pos, size_t len,
+                      string &value)
+{
+  if (payload.size() - pos < len) {
+    return false;
+  }
+  value = payload.substr(pos, len);
+  pos += len;
+  return true;
+}
+
+// Prefixes a payload with its length
+static string frame(const string &payload)
+{
+  string result;
+  put<unsigned int>(result, payload.size());
+  return result + payload;
+}
+
+// Encodes a request into a frame.
+string encode_request(const request_t &request)
+{
+  string payload;
+  put<unsigned char>(payload, request.op);
+  put<unsigned char>(payload, request.flags);
+  put<unsigned short>(payload, request.file_name.size());
+  payload += request.file_name;
+  put<unsigned short>(payload, request.data.size());
+  payload += request.data;
+  return frame(payload);
+}
+
+// Encodes a response into a frame.
+string encode_response(const response_t &response)
+{
+  string payload;
+  put<unsigned char>(payload, response.status);
+  put<unsigned int>(payload, response.out.size());
+  payload += response.out;
+  put<unsigned int>(payload, response.err.size());
+  payload += response.err;
+  return frame(payload);
+}
+
+// Decodes a request payload. Returns false if it is malformed.
+bool decode_request(const string &payload, request_t &request)
+{
+  size_t pos = 0;
+  unsigned short len;
+  return get(payload, pos, request.op) &&
+         get(payload, pos, request.flags) &&
+         get(payload, pos, len) &&
+         get_bytes(payload, pos, len, request.file_name) &&
+         get(payload, pos, len) &&
+         get_bytes(payload, pos, len, request.data) &&
+         pos == payload.size();
+}
+
+// Decodes a response payload. Returns false if it is malformed.
+bool decode_response(const string &payload, response_t &response)
+{
+  size_t pos = 0;
+  unsigned int len;
+  return get(payload, pos, response.status) &&
+         get(payload, pos, len) &&
+         get_bytes(payload, pos, len, response.out) &&
+         get(payload, pos, len) &&
+         get_bytes(payload, pos, len, response.err) &&
+         pos == payload.size();
+}
+
+// Removes the first complete frame from buffer and stores its payload.
+// Returns 1 if a frame was taken, 0 if more bytes are needed and -1 if
+// the frame is too large.
+int take_frame(string &buffer, string &payload)
+{
+  size_t pos = 0;
+  unsigned int len;
+  if (!get(buffer, pos, len)) {
+    return 0;
+  }
+  if (len > MAX_FRAME_SIZE) {
+    return -1;
+  }
+  if (buffer.size() - pos < len) {
+    return 0;
+  }
+  payload = buffer.substr(pos, len);
+  buffer.erase(0, pos + len);
+  return 1;
+}
+
+// Sends a whole frame on a blocking socket
+bool send_frame(int fd, const string &frame)
+{
+  size_t sent = 0;
+  while (sent < frame.size()) {
+    ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Reads exactly len bytes from a blocking socket
+static bool recv_all(int fd, char *buf, size_t len)
+{
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = recv(fd, buf + got, len - got, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    got += n;
+  }
+  return true;
+}
+
+// Receives one frame from a blocking socket and stores its payload
+bool recv_frame(int fd, string &payload)
+{
+  unsigned int len;
+  if (!recv_all(fd, (char *) &len, sizeof(len)) || len > MAX_FRAME_SIZE) {
+    return false;
+  }
+  payload.resize(len);
+  return len == 0 || recv_all(fd, &payload[0], len);
+}
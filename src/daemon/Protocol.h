@@ -0,0 +1,75 @@
+// Computing Systems: Daemon protocol
+// Binary messages exchanged between the file system daemon and its
+// clients over a UNIX domain socket. Every message is a frame: a 32-bit
+// payload length followed by the payload.
+//
+// Request payload:  op (1 byte), flags (1 byte),
+//                   file name length (2 bytes), file name,
+//                   data length (2 bytes), data
+// Response payload: status (1 byte),
+//                   output length (4 bytes), output,
+//                   error length (4 bytes), error output
+//
+// Integers are in host byte order; both ends run on the same machine.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+
+using namespace std;
+
+// Request operations, one per shell command, and OP_PIPELINE for a line
+// of commands joined by | (sent as the data of the request)
+enum {
+  OP_MKDIR = 1, OP_CD, OP_HOME, OP_RMDIR, OP_LS, OP_CREATE, OP_APPEND,
+  OP_CAT, OP_TAIL, OP_RM, OP_STAT, OP_PWD, OP_DF, OP_HEAD, OP_WC, OP_CP,
+  OP_MV, OP_FIND, OP_TREE, OP_INDEX, OP_HELP, OP_QUIT, OP_CACHE, OP_SYNC,
+  OP_FSYNC, OP_SNAPSHOT, OP_FSCK, OP_IMPORT, OP_EXPORT, OP_PIPELINE, OP_IOSTAT,
+  OP_FRAG, OP_DEFRAG, OP_TRIM
+};
+
+// Request flags
+const unsigned char FLAG_RECURSIVE = 0x1;	// -r (rm and cp)
+
+// Response status
+const unsigned char STATUS_OK = 0;	// session continues
+const unsigned char STATUS_QUIT = 1;	// session ended by quit
+
+// largest payload either side accepts
+const unsigned int MAX_FRAME_SIZE = 1 << 20;
+
+// A command sent by a client
+struct request_t {
+  unsigned char op;		// OP_...
+  unsigned char flags;		// FLAG_...
+  string file_name;		// first argument
+  string data;			// second argument
+};
+
+// The result of a request: the text the command printed
+struct response_t {
+  unsigned char status;		// STATUS_...
+  string out;			// standard output
+  string err;			// error output
+};
+
+// Encodes a message into a frame.
+string encode_request(const request_t &request);
+string encode_response(const response_t &response);
+
+// Decodes the payload of a frame. Returns false if it is malformed.
+bool decode_request(const string &payload, request_t &request);
+bool decode_response(const string &payload, response_t &response);
+
+// Removes the first complete frame from buffer and stores its payload.
+// Returns 1 if a frame was taken, 0 if more bytes are needed and -1 if
+// the frame is too large.
+int take_frame(string &buffer, string &payload);
+
+// Blocking frame transfer on a connected socket. Return false on error
+// or end of stream.
+bool send_frame(int fd, const string &frame);
+bool recv_frame(int fd, string &payload);
+
+#endif
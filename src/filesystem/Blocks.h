@@ -11,11 +11,23 @@ const int BLOCK_SIZE = 128;
 // Number of blocks - set so a bitmap can fit in one block
 const int NUM_BLOCKS = (BLOCK_SIZE * 8);
 
-// Maximum filename size
-const int MAX_FNAME_SIZE = 9;
+// Size of the header of a directory block
+const int DIR_HEADER_SIZE = 8;
 
-// Maximum number of files in a directory
-const int MAX_DIR_ENTRIES = ((BLOCK_SIZE - 8) / 12);
+// Size of the fixed part of a packed directory entry
+const int DIR_ENTRY_SIZE = 3;
+
+// Number of bytes available for packed directory entries
+const int DIR_DATA_SIZE = (BLOCK_SIZE - DIR_HEADER_SIZE);
+
+// Maximum filename size - the name length is one byte, and an entry
+// must fit in a directory block
+const int MAX_FNAME_SIZE = ((DIR_DATA_SIZE - DIR_ENTRY_SIZE < 255) ?
+                            (DIR_DATA_SIZE - DIR_ENTRY_SIZE) : 255);
+
+// Directory entry types
+const unsigned char DIR_ENTRY_FILE = 1;
+const unsigned char DIR_ENTRY_DIR = 2;
 
 // Maximum number of blocks in a data file
 const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 8) / 2);
@@ -23,9 +35,45 @@ const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 8) / 2);
 // Maximum file size for a data file
 const int MAX_FILE_SIZE	= (MAX_DATA_BLOCKS * BLOCK_SIZE);
 
+// Number of hash buckets in the name index
+const int INDEX_BUCKETS = ((BLOCK_SIZE - 8) / 2);
+
+// Maximum number of records in a name index block
+const int INDEX_RECORDS = ((BLOCK_SIZE - 8) / 6);
+
+// Fixed block numbers
+const short SUPER_BLOCK = 0;	// bitmap of free blocks
+const short ROOT_BLOCK = 1;	// root directory
+const short VOLUME_BLOCK = 2;	// volume description
+const short JOURNAL_START = 3;	// journal header, followed by the log
+
+// Number of blocks in the journal area, header included
+const int JOURNAL_BLOCKS = 64;
+
+// First block that is not reserved by the layout
+const short FIRST_FREE_BLOCK = JOURNAL_START + JOURNAL_BLOCKS;
+
+// Number of block numbers in a journal descriptor
+const int JOURNAL_DESC_BLOCKS = ((BLOCK_SIZE - 16) / 2);
+
+// Maximum snapshot name size and number of snapshots
+const int SNAP_NAME_SIZE = 15;
+const int MAX_SNAPSHOTS = ((BLOCK_SIZE - 8) / 24);
+
+// Number of records in a snapshot remap block
+const int SNAP_REMAP_RECORDS = ((BLOCK_SIZE - 8) / 4);
+
+// On-disk format version written to the volume block
+const unsigned int VOLUME_VERSION = 4;
+
 // Magic numbers - used to distinguish between directory blocks and inodes
 const unsigned int DIR_MAGIC_NUM = 0xFFFFFFFF;
 const unsigned int INODE_MAGIC_NUM = 0xFFFFFFFE;
+const unsigned int INDEX_MAGIC_NUM = 0xFFFFFFFD;
+const unsigned int VOLUME_MAGIC_NUM = 0xFFFFFFFC;
+const unsigned int JOURNAL_MAGIC_NUM = 0xFFFFFFFB;
+const unsigned int SNAP_MAGIC_NUM = 0xFFFFFFFA;
+const unsigned int STRIPE_MAGIC_NUM = 0xFFFFFFF9;
 
 // BLOCK TYPES
 
@@ -35,14 +83,41 @@ struct superblock_t {
   unsigned char bitmap[BLOCK_SIZE]; // bitmap of free blocks
 };
 
-// Directory block - represents a directory
+// Volume block - describes the on-disk format and the optional on-disk
+// structures. Block 2 is the only volume block.
+struct volblock_t {
+  unsigned int magic;		// magic number, must be VOLUME_MAGIC_NUM
+  unsigned int version;		// on-disk format version
+  short index_block;		// name index header (0 - no index)
+  short snap_table;		// snapshot table (0 - no snapshots)
+  unsigned short clean;		// 1 - last session unmounted cleanly
+  char reserved[BLOCK_SIZE - 14];
+};
+
+// Stripe label - block 0 of each member file of a striped disk; the
+// volume's blocks follow it. It records the layout, so the member files
+// mount as one disk. See StripedDisk.h.
+struct stripelabel_t {
+  unsigned int magic;		// magic number, must be STRIPE_MAGIC_NUM
+  unsigned int set_id;		// the same in every member of the disk
+  unsigned short members;	// member files of the disk
+  unsigned short member;	// place of this file among them
+  unsigned short unit;		// blocks per stripe unit
+  char reserved[BLOCK_SIZE - 14];
+};
+
+// Directory block - represents a directory. Entries are packed back to
+// back from the start of the entry area: a name length (1 byte) and a
+// word holding the entry type (top 2 bits) and the block number (the
+// rest), followed by the name bytes without a null. An entry is as long
+// as its name needs, so the record length follows from the name length.
+// All free space is after the last entry; a zero word ends the entries.
+// See Directory.h.
 struct dirblock_t {
   unsigned int magic;		// magic number, must be DIR_MAGIC_NUM
-  unsigned int num_entries;	// number of files in directory
-  struct {
-    char name[MAX_FNAME_SIZE + 1]; // file name (extra space for null)
-    short block_num;		   // block number of file (0 - unused)
-  } dir_entries[MAX_DIR_ENTRIES];  // list of directory entries
+  unsigned short num_entries;	// number of files in directory
+  short parent;			// block of parent directory
+  unsigned char entries[DIR_DATA_SIZE]; // packed directory entries
 };
 
 // Inode - index node for a data file
@@ -52,6 +127,75 @@ struct inode_t {
   short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
 };
 
+// Name index header - hash table from file name to the chains of index
+// blocks holding the (parent directory, block) pairs for that name.
+struct indexhead_t {
+  unsigned int magic;		// magic number, must be INDEX_MAGIC_NUM
+  unsigned int num_buckets;	// number of buckets, must be INDEX_BUCKETS
+  short buckets[INDEX_BUCKETS];	// first index block of bucket (0 - empty)
+};
+
+// Name index block - one link in the chain of a hash bucket
+struct indexblock_t {
+  unsigned int magic;		// magic number, must be INDEX_MAGIC_NUM
+  unsigned short num_records;	// number of records in use
+  short next;			// next block in bucket chain (0 - last)
+  struct {
+    unsigned short hash;	// upper bits of the name hash
+    short parent;		// block of directory holding the entry
+    short block_num;		// block number of file (0 - unused)
+  } records[INDEX_RECORDS];	// list of index records
+};
+
+// Journal header - the first block of the journal area. Records follow
+// it back to back, starting with sequence number seq.
+struct journalhead_t {
+  unsigned int magic;		// magic number, must be JOURNAL_MAGIC_NUM
+  unsigned int seq;		// sequence number of the first record
+  char reserved[BLOCK_SIZE - 8];
+};
+
+// Journal descriptor - names the blocks whose new contents follow it in
+// the journal. A record is one or more descriptors with the same seq;
+// the last one has last set. A record whose descriptors are not all
+// present with matching checksums was torn by a crash and is ignored.
+struct journaldesc_t {
+  unsigned int magic;		// magic number, must be JOURNAL_MAGIC_NUM
+  unsigned int seq;		// sequence number of the record
+  unsigned short count;		// number of blocks that follow
+  unsigned short last;		// 1 on the last descriptor of a record
+  unsigned int checksum;	// over seq, the block numbers and contents
+  short blocks[JOURNAL_DESC_BLOCKS]; // home block of each logged block
+};
+
+// Snapshot table - the snapshots of the volume. A snapshot keeps a copy
+// of the bitmap taken when it was created; every block marked there is
+// part of it. When such a block is first overwritten, its old contents
+// are copied to a new block first and the pair is added to the
+// snapshot's remap chain.
+struct snaptable_t {
+  unsigned int magic;		// magic number, must be SNAP_MAGIC_NUM
+  unsigned int num_snapshots;	// number of entries in use
+  struct {
+    char name[SNAP_NAME_SIZE + 1]; // snapshot name (null terminated)
+    short bitmap_block;		// bitmap when the snapshot was taken
+    short remap_head;		// first remap block (0 - none)
+    short index_block;		// name index header when taken
+    unsigned short invalid;	// 1 if a copy could not be made
+  } snapshots[MAX_SNAPSHOTS];
+};
+
+// Snapshot remap block - one link in the chain of a snapshot's copies
+struct snapremap_t {
+  unsigned int magic;		// magic number, must be SNAP_MAGIC_NUM
+  unsigned short num_records;	// number of records in use
+  short next;			// next block in the chain (0 - last)
+  struct {
+    short orig;			// block as seen by the snapshot
+    short copy;			// block holding its old contents
+  } records[SNAP_REMAP_RECORDS];
+};
+
 // Data block - stores data for a data file
 struct datablock_t {
   char data[BLOCK_SIZE];	// data (BLOCK_SIZE bytes)
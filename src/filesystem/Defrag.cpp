@@ -0,0 +1,222 @@
+// Computing Systems: Defrag
+// Reports how fragmented the data files and the free space are, and
+// moves fragmented files into free runs a bounded step at a time.
+
+#include <algorithm>
+
+#include "Defrag.h"
+#include "Directory.h"
+
+// true if block b is marked used in bits
+static bool block_used(const superblock_t &bits, int b)
+{
+    return (bits.bitmap[b / 8] >> (b % 8)) & 1;
+}
+
+// orders fragmented files by path
+static bool by_path(const frag_file_t &a, const frag_file_t &b)
+{
+    return a.path < b.path;
+}
+
+// Returns the extents of a file and sets blocks to its data blocks. A
+// block that follows the one before it on the disk continues its extent.
+int file_extents(const inode_t &inode, int &blocks)
+{
+    int extents = 0;
+    short prev = 0;
+    blocks = 0;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        short b = inode.blocks[i];
+        if (b == 0) {
+            continue;
+        }
+        if (prev == 0 || b != prev + 1) {
+            extents++;
+        }
+        prev = b;
+        blocks++;
+    }
+    return extents;
+}
+
+Defrag::Defrag(BasicFileSys &bfs) : bfs(bfs)
+{
+}
+
+// walks the tree and the bitmap and fills report
+void Defrag::report(frag_report_t &report)
+{
+    vector<file_item_t> files;
+    walk(ROOT_BLOCK, "", files);
+
+    report.files = files.size();
+    report.data_blocks = 0;
+    report.extents = 0;
+    report.fragmented.clear();
+    for (size_t i = 0; i < files.size(); i++) {
+        frag_file_t frag;
+        frag.path = files[i].path;
+        frag.extents = file_extents(files[i].inode, frag.blocks);
+        report.data_blocks += frag.blocks;
+        report.extents += frag.extents;
+        if (frag.extents > 1) {
+            report.fragmented.push_back(frag);
+        }
+    }
+    sort(report.fragmented.begin(), report.fragmented.end(), by_path);
+
+    superblock_t bits;
+    bfs.copy_bitmap(bits);
+    report.free_blocks = 0;
+    report.free_runs = 0;
+    report.largest_free_run = 0;
+    int run = 0;
+    for (int b = FIRST_FREE_BLOCK; b <= NUM_BLOCKS; b++) {
+        if (b < NUM_BLOCKS && !block_used(bits, b)) {
+            run++;
+            report.free_blocks++;
+            continue;
+        }
+        if (run > 0) {
+            report.free_runs++;
+            report.largest_free_run = max(report.largest_free_run, run);
+        }
+        run = 0;
+    }
+}
+
+// Moves fragmented files, in tree order, until the next one would take
+// the step past DEFRAG_STEP_BLOCKS. The tree is walked afresh each step,
+// since other commands may have changed it in between.
+bool Defrag::step(defrag_step_t &result)
+{
+    result.files_moved = 0;
+    result.blocks_moved = 0;
+    result.no_room = 0;
+
+    vector<file_item_t> files;
+    walk(ROOT_BLOCK, "", files);
+    for (size_t i = 0; i < files.size(); i++) {
+        int count;
+        if (file_extents(files[i].inode, count) <= 1) {
+            continue;
+        }
+        if (result.blocks_moved + count > DEFRAG_STEP_BLOCKS) {
+            return true;
+        }
+        if (move(files[i], count)) {
+            result.files_moved++;
+            result.blocks_moved += count;
+        } else {
+            result.no_room++;
+        }
+    }
+    return false;
+}
+
+// HELPER FUNCTIONS
+
+// Adds the data files below dir_block to files. The inodes of each
+// directory are read as one batch.
+void Defrag::walk(short dir_block, const string &path, vector<file_item_t> &files)
+{
+    dirblock_t dir;
+    bfs.read_block(dir_block, &dir);
+    if (dir.magic != DIR_MAGIC_NUM) {
+        return;
+    }
+
+    vector<short> inode_blocks;
+    vector<string> inode_paths;
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        if (entry.block_num < FIRST_FREE_BLOCK || entry.block_num >= NUM_BLOCKS) {
+            continue;
+        }
+        string entry_path = path + "/" + entry.name;
+        if (entry.type == DIR_ENTRY_DIR) {
+            walk(entry.block_num, entry_path, files);
+        } else {
+            inode_blocks.push_back(entry.block_num);
+            inode_paths.push_back(entry_path);
+        }
+    }
+    if (inode_blocks.empty()) {
+        return;
+    }
+
+    vector<inode_t> inodes(inode_blocks.size());
+    bfs.read_blocks(inode_blocks.data(), inode_blocks.size(), inodes.data());
+    for (size_t i = 0; i < inodes.size(); i++) {
+        if (inodes[i].magic != INODE_MAGIC_NUM) {
+            continue;
+        }
+        file_item_t file;
+        file.path = inode_paths[i];
+        file.inode_block = inode_blocks[i];
+        file.inode = inodes[i];
+        files.push_back(file);
+    }
+}
+
+// Finds the lowest run of count free blocks and sets start to its first
+// block. Returns false if there is none.
+bool Defrag::find_run(int count, short &start)
+{
+    superblock_t bits;
+    bfs.copy_bitmap(bits);
+    int run = 0;
+    for (int b = FIRST_FREE_BLOCK; b < NUM_BLOCKS; b++) {
+        if (block_used(bits, b)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            start = b - count + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the count data blocks of a file into a free run: the blocks are
+// read as one batch and written to the run as another, then the inode is
+// rewritten and the old blocks are freed when it commits. Returns false
+// if no free run holds the file.
+bool Defrag::move(file_item_t &file, int count)
+{
+    short start;
+    if (!find_run(count, start)) {
+        return false;
+    }
+    vector<short> new_blocks(count);
+    for (int i = 0; i < count; i++) {
+        new_blocks[i] = start + i;
+    }
+    if (!bfs.claim_blocks(new_blocks.data(), count)) {
+        return false;
+    }
+
+    vector<short> old_blocks;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (file.inode.blocks[i] != 0) {
+            old_blocks.push_back(file.inode.blocks[i]);
+        }
+    }
+    vector<datablock_t> data(count);
+    bfs.read_blocks(old_blocks.data(), count, data.data());
+
+    Transaction tx(bfs);
+    bfs.write_data_blocks(new_blocks.data(), count, data.data());
+    int next = 0;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (file.inode.blocks[i] != 0) {
+            file.inode.blocks[i] = new_blocks[next++];
+        }
+    }
+    bfs.write_block(file.inode_block, &file.inode);
+    bfs.reclaim_blocks(old_blocks.data(), count);
+    return true;
+}
@@ -0,0 +1,94 @@
+// Computing Systems: Defrag
+// Measures and reduces the fragmentation of data files. get_free_block
+// hands out the lowest free block, so files that grow side by side end
+// up with their data blocks interleaved. The extents of a file are the
+// runs of its block map that are consecutive on the disk; a file with
+// more than one is fragmented.
+//
+// The defragmenter moves the data blocks of a fragmented file into the
+// lowest free run that holds them all. The blocks are copied first, then
+// the inode is pointed at the copies and the old blocks are freed in one
+// transaction, so a crash leaves the file either where it was or where
+// it went. Directories and inodes stay where they are, so neither the
+// tree nor the name index changes. The work is done in steps that each
+// move a bounded number of blocks.
+
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <string>
+#include <vector>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+
+using namespace std;
+
+// most data blocks one step moves; a file is never split across steps,
+// so this must hold the largest file
+const int DEFRAG_STEP_BLOCKS = 64;
+
+// A fragmented file
+struct frag_file_t {
+  string path;
+  int blocks;		// data blocks
+  int extents;		// runs of consecutive blocks
+};
+
+// What frag reports about the volume
+struct frag_report_t {
+  int files;		// data files found
+  int data_blocks;	// their data blocks
+  int extents;		// their extents
+  int free_blocks;	// free blocks past the fixed area
+  int free_runs;	// runs of consecutive free blocks
+  int largest_free_run;	// blocks in the longest of them
+  vector<frag_file_t> fragmented;	// files with more than one extent,
+					// by path
+};
+
+// What one defragmentation step did
+struct defrag_step_t {
+  int files_moved;	// fragmented files made contiguous
+  int blocks_moved;	// data blocks they moved
+  int no_room;		// fragmented files no free run could hold
+};
+
+class Defrag {
+
+  public:
+    Defrag(BasicFileSys &bfs);
+
+    // walks the tree and the bitmap and fills report. Commands that
+    // change the tree may not run at the same time.
+    void report(frag_report_t &report);
+
+    // moves fragmented files until the next one would take the step past
+    // DEFRAG_STEP_BLOCKS. Returns true if fragmented files are left that
+    // the step did not get to. No other command may run at the same time.
+    bool step(defrag_step_t &result);
+
+  private:
+    // a data file found by the walk
+    struct file_item_t {
+      string path;
+      short inode_block;
+      inode_t inode;
+    };
+
+    BasicFileSys &bfs;		// basic file system
+
+    // Helper functions
+    void walk(short dir_block, const string &path, vector<file_item_t> &files);
+    bool find_run(int count, short &start);
+    bool move(file_item_t &file, int count);
+
+    // not copyable
+    Defrag(const Defrag &);
+    Defrag &operator=(const Defrag &);
+};
+
+// Returns the extents of a file and sets blocks to its data blocks. Holes
+// (0 in the block map) are skipped.
+int file_extents(const inode_t &inode, int &blocks);
+
+#endif
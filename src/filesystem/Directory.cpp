@@ -0,0 +1,159 @@
+// Computing Systems: Directory entries
+// Reads and updates the packed, variable-length entries of a directory
+// block.
+
+#include <cstring>
+
+#include "Directory.h"
+
+// Field offsets within a packed entry
+static const int NAME_LEN_OFF = 0;
+static const int WORD_OFF = 1;
+
+// The entry word holds the type in its top two bits and the block number
+// in the rest (0 - no entry: the entries end here)
+static const int TYPE_SHIFT = 14;
+static const unsigned short BLOCK_MASK = (1 << TYPE_SHIFT) - 1;
+static_assert(NUM_BLOCKS <= BLOCK_MASK + 1, "block numbers must fit the entry word");
+
+// The word is not aligned, so it is copied byte by byte
+static unsigned short get_word(const dirblock_t &dir, int offset)
+{
+  unsigned short word;
+  memcpy(&word, &dir.entries[offset + WORD_OFF], sizeof(word));
+  return word;
+}
+
+// Writes a whole entry at offset
+static void put_entry(dirblock_t &dir, int offset, const char *name,
+                      int name_len, unsigned char type, short block_num)
+{
+  unsigned short word = (type << TYPE_SHIFT) | (block_num & BLOCK_MASK);
+  dir.entries[offset + NAME_LEN_OFF] = name_len;
+  memcpy(&dir.entries[offset + WORD_OFF], &word, sizeof(word));
+  memcpy(&dir.entries[offset + DIR_ENTRY_SIZE], name, name_len);
+}
+
+// Returns the size of the entry at offset, or 0 if the entries end there
+// (or the entry runs past the entry area)
+static int entry_size(const dirblock_t &dir, int offset)
+{
+  if (offset + DIR_ENTRY_SIZE > DIR_DATA_SIZE || get_word(dir, offset) == 0) {
+    return 0;
+  }
+  int size = DIR_ENTRY_SIZE + dir.entries[offset + NAME_LEN_OFF];
+  return offset + size <= DIR_DATA_SIZE ? size : 0;
+}
+
+// Returns the offset just past the last entry
+static int entries_end(const dirblock_t &dir)
+{
+  int offset = 0;
+  int size;
+  while ((size = entry_size(dir, offset)) != 0) {
+    offset += size;
+  }
+  return offset;
+}
+
+// Initializes an empty directory block whose parent is parent.
+void dir_init(dirblock_t &dir, short parent)
+{
+  dir.magic = DIR_MAGIC_NUM;
+  dir.num_entries = 0;
+  dir.parent = parent;
+  memset(dir.entries, 0, DIR_DATA_SIZE);
+}
+
+// Unpacks the first used entry at or after offset into entry and moves
+// offset past it. Start with offset 0. Returns false when no entries are
+// left.
+bool dir_next(const dirblock_t &dir, int &offset, dir_entry_t &entry)
+{
+  int size = entry_size(dir, offset);
+  if (size == 0) {
+    return false;
+  }
+
+  unsigned short word = get_word(dir, offset);
+  entry.offset = offset;
+  entry.block_num = word & BLOCK_MASK;
+  entry.type = word >> TYPE_SHIFT;
+  entry.name_len = dir.entries[offset + NAME_LEN_OFF];
+  memcpy(entry.name, &dir.entries[offset + DIR_ENTRY_SIZE], entry.name_len);
+  entry.name[entry.name_len] = '\0';
+  offset += size;
+  return true;
+}
+
+// Looks up name. Returns the entry offset if found, -1 if not found, and
+// sets block_num and type of the entry.
+int dir_find(const dirblock_t &dir, const char *name, short &block_num,
+             unsigned char &type)
+{
+  size_t name_len = strlen(name);
+
+  int offset = 0;
+  int size;
+  while ((size = entry_size(dir, offset)) != 0) {
+    // compare lengths first so most entries are rejected without
+    // touching the name bytes
+    if (dir.entries[offset + NAME_LEN_OFF] == name_len &&
+        memcmp(&dir.entries[offset + DIR_ENTRY_SIZE], name, name_len) == 0) {
+      unsigned short word = get_word(dir, offset);
+      block_num = word & BLOCK_MASK;
+      type = word >> TYPE_SHIFT;
+      return offset;
+    }
+    offset += size;
+  }
+
+  block_num = 0;
+  type = 0;
+  return -1;
+}
+
+// Looks up the entry that refers to block_num. Returns its offset or -1.
+int dir_find_block(const dirblock_t &dir, short block_num, dir_entry_t &entry)
+{
+  int offset = 0;
+  while (dir_next(dir, offset, entry)) {
+    if (entry.block_num == block_num) {
+      return entry.offset;
+    }
+  }
+  return -1;
+}
+
+// Returns true if an entry called name fits in the directory block.
+bool dir_has_room(const dirblock_t &dir, const char *name)
+{
+  return entries_end(dir) + DIR_ENTRY_SIZE + (int) strlen(name) <= DIR_DATA_SIZE;
+}
+
+// Adds an entry after the last one. Returns false if the directory block
+// has no room.
+bool dir_insert(dirblock_t &dir, const char *name, unsigned char type,
+                short block_num)
+{
+  int name_len = strlen(name);
+  int end = entries_end(dir);
+  if (end + DIR_ENTRY_SIZE + name_len > DIR_DATA_SIZE) {
+    return false;
+  }
+
+  put_entry(dir, end, name, name_len, type, block_num);
+  dir.num_entries++;
+  return true;
+}
+
+// Removes the entry at offset. The entries after it move down over it,
+// and the bytes they leave are zeroed so the entries end there.
+void dir_remove(dirblock_t &dir, int offset)
+{
+  int size = entry_size(dir, offset);
+  int end = entries_end(dir);
+  memmove(&dir.entries[offset], &dir.entries[offset + size], end - offset - size);
+  memset(&dir.entries[end - size], 0, size);
+  dir.num_entries--;
+}
@@ -0,0 +1,47 @@
+// Computing Systems: Directory entries
+// Reads and updates the packed, variable-length entries of a directory
+// block.
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "Blocks.h"
+
+// Unpacked copy of a directory entry
+struct dir_entry_t {
+  int offset;			// offset of the entry in the entry area
+  short block_num;		// block number of file
+  unsigned char type;		// DIR_ENTRY_FILE or DIR_ENTRY_DIR
+  unsigned char name_len;	// length of name
+  char name[MAX_FNAME_SIZE + 1]; // file name (extra space for null)
+};
+
+// Initializes an empty directory block whose parent is parent.
+void dir_init(dirblock_t &dir, short parent);
+
+// Unpacks the first used entry at or after offset into entry and moves
+// offset past it. Start with offset 0. Returns false when no entries are
+// left.
+bool dir_next(const dirblock_t &dir, int &offset, dir_entry_t &entry);
+
+// Looks up name. Returns the entry offset if found, -1 if not found, and
+// sets block_num and type of the entry.
+int dir_find(const dirblock_t &dir, const char *name, short &block_num,
+             unsigned char &type);
+
+// Looks up the entry that refers to block_num. Returns its offset or -1.
+int dir_find_block(const dirblock_t &dir, short block_num, dir_entry_t &entry);
+
+// Returns true if an entry called name fits in the directory block.
+bool dir_has_room(const dirblock_t &dir, const char *name);
+
+// Adds an entry after the last one. Returns false if the directory block
+// has no room.
+bool dir_insert(dirblock_t &dir, const char *name, unsigned char type,
+                short block_num);
+
+// Removes the entry at offset; the entries after it move down. Offsets
+// found before the removal are no longer valid.
+void dir_remove(dirblock_t &dir, int offset);
+
+#endif
@@ -1,205 +1,394 @@
 // Computing Systems: File System
 // Implements the file system commands that are available to the shell.
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <map>
+#include <set>
+#include <unistd.h>
 using namespace std;
 
 #include "FileSys.h"
 #include "BasicFileSys.h"
 #include "Blocks.h"
+#include "Directory.h"
+#include "Volume.h"
 
-// mounts the file system
-void FileSys::mount() {
-  bfs.mount();
+// Returns the message the shell prints for a status
+const char *io_message(io_status_t status)
+{
+    switch (status) {
+    case IO_OK:
+        return "";
+    case IO_NOT_FOUND:
+        return "File does not exist";
+    case IO_IS_DIR:
+        return "File is a directory";
+    case IO_TOO_LARGE:
+        return "Append exceeds maximum file size";
+    case IO_DISK_FULL:
+        return "Disk is full";
+    case IO_EXISTS:
+        return "File exists";
+    case IO_NOT_DIR:
+        return "File is not a directory";
+    case IO_NOT_EMPTY:
+        return "Directory is not empty";
+    case IO_NAME_TOO_LONG:
+        return "File name is too long";
+    case IO_DIR_FULL:
+        return "Directory is full";
+    case IO_INTO_ITSELF:
+        return "Cannot move a directory into itself";
+    case IO_FILE_TOO_LARGE:
+        return "File exceeds maximum file size";
+    case IO_HOST_OPEN:
+        return "Could not open";
+    case IO_HOST_READ:
+        return "Could not read";
+    case IO_HOST_WRITE:
+        return "Could not write";
+    case IO_BAD_OP:
+        return "Unknown operation";
+    case IO_INDEX_ON:
+        return "Name index is already on";
+    case IO_SNAP_EXISTS:
+        return "Snapshot exists";
+    case IO_SNAP_NOT_FOUND:
+        return "Snapshot does not exist";
+    case IO_SNAP_TOO_MANY:
+        return "Too many snapshots";
+    case IO_SNAP_NAME_TOO_LONG:
+        return "Snapshot name is too long";
+    case IO_SNAP_INVALID:
+        return "Snapshot is invalid";
+    case IO_TXN_TOO_LARGE:
+        return "Too many blocks to change at once";
+    }
+    return "Unknown error";
+}
+
+// number of entries ls and tree fetch from a cursor at a time
+static const int LISTING_BATCH = 16;
+
+// Counts the lines and the words ended in len bytes of data. in_word
+// says whether a word runs on from the bytes before them, and after.
+static void count_words(const char *data, unsigned int len, unsigned int &lines,
+                        unsigned int &words, bool &in_word)
+{
+    for (unsigned int i = 0; i < len; i++) {
+        char c = data[i];
+        
+        if (c == '\n') {
+            lines++;
+        }
+        
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (in_word) {
+                words++;
+                in_word = false;
+            }
+        } else {
+            in_word = true;
+        }
+    }
+}
+
+// Fills in what an import or export moved since start
+static void set_transfer(transfer_info_t &info, unsigned int bytes,
+                         chrono::steady_clock::time_point start)
+{
+    info.bytes = bytes;
+    info.seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+FileSys::FileSys()
+  : own_volume(new Volume()), vol(*own_volume), bfs(vol.bfs),
+    name_index(vol.name_index), next_cursor(0) {
+}
+
+// opens a session on a volume that other sessions may share
+FileSys::FileSys(Volume &volume)
+  : own_volume(NULL), vol(volume), bfs(vol.bfs),
+    name_index(vol.name_index), next_cursor(0) {
+}
+
+FileSys::~FileSys() {
+  wait_batches();
+  delete own_volume;
+}
+
+// mounts the file system. A session on a shared volume only starts at
+// the root; the volume is mounted by its owner.
+bool FileSys::mount() {
+  if (own_volume != NULL && !vol.mount()) {
+    return false;
+  }
+  if (own_volume != NULL && vol.checked_at_mount) {
+    cout << "Disk was not unmounted cleanly; checked it" << endl;
+    print_fsck(vol.mount_report);
+  }
   curr_dir = 1;
-  current_path = "/";  // initialize current path to root
+  return true;
 }
 
 // unmounts the file system
 void FileSys::unmount() {
-  bfs.unmount();
+  wait_batches();
+  cursors.clear();
+  if (own_volume != NULL) {
+    vol.unmount();
+  }
 }
 
 // make a directory
-void FileSys::mkdir(const char *name)
+io_status_t FileSys::mkdir(const char *name)
 {
+    IoCommand io_command("mkdir");
     // Check if name is too long
     if (strlen(name) > MAX_FNAME_SIZE) {
-        cout << "File name is too long" << endl;
-        return;
+        return IO_NAME_TOO_LONG;
     }
     
-    // Check if file already exists
-    short existing_block;
-    if (find_file(name, existing_block) != -1) {
-        cout << "File exists" << endl;
-        return;
-    }
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    // every block written below is committed as one unit when tx goes
+    // out of scope, before the locks are released
+    Transaction tx(bfs);
     
     // Read current directory
     dirblock_t dir_block;
     bfs.read_block(curr_dir, &dir_block);
     
+    // Check if file already exists
+    short existing_block;
+    unsigned char existing_type;
+    if (dir_find(dir_block, name, existing_block, existing_type) != -1) {
+        return IO_EXISTS;
+    }
+    
     // Check if directory is full
-    if (dir_block.num_entries >= MAX_DIR_ENTRIES) {
-        cout << "Directory is full" << endl;
-        return;
+    if (!dir_has_room(dir_block, name)) {
+        return IO_DIR_FULL;
     }
     
     // Get a free block for the new directory
     short new_block = bfs.get_free_block();
     if (new_block == 0) {
-        cout << "Disk is full" << endl;
-        return;
+        return IO_DISK_FULL;
     }
     
     // Initialize new directory block
     dirblock_t new_dir;
-    new_dir.magic = DIR_MAGIC_NUM;
-    new_dir.num_entries = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        new_dir.dir_entries[i].block_num = 0;
-        new_dir.dir_entries[i].name[0] = '\0';
-    }
+    dir_init(new_dir, curr_dir);
     
     // Write new directory block to disk
-    bfs.write_block(new_block, &new_dir);
+    write_dir(new_block, new_dir);
     
     // Add entry to current directory
-    int free_entry = -1;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_block.dir_entries[i].block_num == 0) {
-            free_entry = i;
-            break;
-        }
-    }
-    
-    strcpy(dir_block.dir_entries[free_entry].name, name);
-    dir_block.dir_entries[free_entry].block_num = new_block;
-    dir_block.num_entries++;
+    dir_insert(dir_block, name, DIR_ENTRY_DIR, new_block);
     
     // Write updated current directory
-    bfs.write_block(curr_dir, &dir_block);
+    write_dir(curr_dir, dir_block);
+
+    index_add(name, curr_dir, new_block);
+    return IO_OK;
 }
 
 // switch to a directory
-void FileSys::cd(const char *name)
+io_status_t FileSys::cd(const char *name)
 {
+    IoCommand io_command("cd");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_directory(block_num)) {
-        cout << "File is not a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_DIR) {
+        return IO_NOT_DIR;
     }
     
     curr_dir = block_num;
-    
-    // Update current path
-    if (current_path == "/") {
-        current_path = "/" + string(name);
-    } else {
-        current_path = current_path + "/" + string(name);
-    }
+    return IO_OK;
 }
 
 // switch to home directory
 void FileSys::home() {
     curr_dir = 1; // root directory is block 1
-    current_path = "/";  // reset path to root
 }
 
 // remove a directory
-void FileSys::rmdir(const char *name)
+io_status_t FileSys::rmdir(const char *name)
 {
+    IoCommand io_command("rmdir");
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    Transaction tx(bfs);
+    
     short block_num;
-    int entry_index = find_file(name, block_num);
-    if (entry_index == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    int entry_offset = find_file(name, block_num, type);
+    if (entry_offset == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_directory(block_num)) {
-        cout << "File is not a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_DIR) {
+        return IO_NOT_DIR;
     }
     
     // Check if directory is empty
+    WriteLock target_lock(vol.block_lock(block_num));
     dirblock_t target_dir;
     bfs.read_block(block_num, &target_dir);
     
     if (target_dir.num_entries > 0) {
-        cout << "Directory is not empty" << endl;
-        return;
+        return IO_NOT_EMPTY;
     }
     
     // Reclaim directory block
     bfs.reclaim_block(block_num);
+    vol.forget_listing(block_num);
     
     // Remove entry from parent directory
     dirblock_t parent_dir;
     bfs.read_block(curr_dir, &parent_dir);
     
-    parent_dir.dir_entries[entry_index].block_num = 0;
-    parent_dir.dir_entries[entry_index].name[0] = '\0';
-    parent_dir.num_entries--;
+    dir_remove(parent_dir, entry_offset);
     
     // Write updated parent directory
-    bfs.write_block(curr_dir, &parent_dir);
+    write_dir(curr_dir, parent_dir);
+
+    index_remove(name, curr_dir, block_num);
+    return IO_OK;
 }
 
 // list the contents of current directory
 void FileSys::ls()
 {
-    dirblock_t dir_block;
-    bfs.read_block(curr_dir, &dir_block);
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_block.dir_entries[i].block_num != 0) {
-            cout << dir_block.dir_entries[i].name;
-            if (is_directory(dir_block.dir_entries[i].block_num)) {
+    ls(false);
+}
+
+// list the contents of current directory, optionally sorted by name
+void FileSys::ls(bool sorted)
+{
+    IoCommand io_command("ls");
+    ReadLock tree_lock(vol.namespace_lock);
+    int cursor = open_cursor(curr_dir, sorted);
+    
+    dir_entry_t entries[LISTING_BATCH];
+    int count;
+    while ((count = readdir(cursor, entries, LISTING_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            cout << entries[i].name;
+            if (entries[i].type == DIR_ENTRY_DIR) {
                 cout << "/";
             }
             cout << endl;
         }
     }
+    
+    closedir(cursor);
+}
+
+// open a cursor over the entries of directory name ("." for the current
+// directory), in slot order or sorted by name. Returns the cursor or -1
+// on error.
+int FileSys::opendir(const char *name, bool sorted)
+{
+    IoCommand io_command("opendir");
+    ReadLock tree_lock(vol.namespace_lock);
+    if (strcmp(name, ".") == 0) {
+        return open_cursor(curr_dir, sorted);
+    }
+    
+    short block_num;
+    unsigned char type;
+    {
+        ReadLock dir_lock(vol.block_lock(curr_dir));
+        if (find_file(name, block_num, type) == -1) {
+            return -1;
+        }
+    }
+    
+    if (type != DIR_ENTRY_DIR) {
+        return -1;
+    }
+    
+    return open_cursor(block_num, sorted);
+}
+
+// copy up to max entries from the cursor into entries. Returns the number
+// of entries copied, 0 once the directory is exhausted, or -1 for an
+// unknown cursor.
+int FileSys::readdir(int cursor, dir_entry_t *entries, int max)
+{
+    IoCommand io_command("readdir");
+    map<int, dir_cursor_t>::iterator it = cursors.find(cursor);
+    if (it == cursors.end()) {
+        return -1;
+    }
+    dir_cursor_t &c = it->second;
+    
+    int count = 0;
+    if (c.sorted_order) {
+        while (count < max && c.pos < c.sorted->size()) {
+            entries[count++] = (*c.sorted)[c.pos++];
+        }
+    } else {
+        while (count < max && dir_next(c.dir, c.offset, entries[count])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// release a cursor
+void FileSys::closedir(int cursor)
+{
+    cursors.erase(cursor);
 }
 
 // create an empty data file
-void FileSys::create(const char *name)
+io_status_t FileSys::create(const char *name)
 {
+    IoCommand io_command("create");
     // Check if name is too long
     if (strlen(name) > MAX_FNAME_SIZE) {
-        cout << "File name is too long" << endl;
-        return;
+        return IO_NAME_TOO_LONG;
     }
     
-    // Check if file already exists
-    short existing_block;
-    if (find_file(name, existing_block) != -1) {
-        cout << "File exists" << endl;
-        return;
-    }
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    Transaction tx(bfs);
     
     // Read current directory
     dirblock_t dir_block;
     bfs.read_block(curr_dir, &dir_block);
     
+    // Check if file already exists
+    short existing_block;
+    unsigned char existing_type;
+    if (dir_find(dir_block, name, existing_block, existing_type) != -1) {
+        return IO_EXISTS;
+    }
+    
     // Check if directory is full
-    if (dir_block.num_entries >= MAX_DIR_ENTRIES) {
-        cout << "Directory is full" << endl;
-        return;
+    if (!dir_has_room(dir_block, name)) {
+        return IO_DIR_FULL;
     }
     
     // Get a free block for the inode
     short inode_block = bfs.get_free_block();
     if (inode_block == 0) {
-        cout << "Disk is full" << endl;
-        return;
+        return IO_DISK_FULL;
     }
     
     // Initialize inode
@@ -214,176 +403,265 @@ void FileSys::create(const char *name)
     bfs.write_block(inode_block, &inode);
     
     // Add entry to current directory
-    int free_entry = -1;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_block.dir_entries[i].block_num == 0) {
-            free_entry = i;
-            break;
-        }
-    }
-    
-    strcpy(dir_block.dir_entries[free_entry].name, name);
-    dir_block.dir_entries[free_entry].block_num = inode_block;
-    dir_block.num_entries++;
+    dir_insert(dir_block, name, DIR_ENTRY_FILE, inode_block);
     
     // Write updated current directory
-    bfs.write_block(curr_dir, &dir_block);
+    write_dir(curr_dir, dir_block);
+
+    index_add(name, curr_dir, inode_block);
+    return IO_OK;
 }
 
 // append data to a data file
-void FileSys::append(const char *name, const char *data)
+io_status_t FileSys::append(const char *name, const char *data)
+{
+    IoCommand io_command("append");
+    future<io_result_t> result = append_async(name, data);
+    run_pending();
+    return result.get().status;
+}
+
+// append size bytes of data to a data file
+io_status_t FileSys::append(const char *name, const char *data, unsigned int size)
+{
+    IoCommand io_command("append");
+    future<io_result_t> result = queue_op(true, name, "", data, size);
+    run_pending();
+    return result.get().status;
+}
+
+// append the bytes in a pipe to a data file. They are copied into the
+// file's blocks from the pipe itself.
+io_status_t FileSys::append(const char *name, const Pipe &input)
+{
+    IoCommand io_command("append");
+    return append(name, input.data(), input.size());
+}
+
+// display the contents of a data file
+io_status_t FileSys::cat(const char *name)
+{
+    IoCommand io_command("cat");
+    future<io_result_t> result = read_async(name);
+    run_pending();
+    
+    io_result_t r = result.get();
+    if (r.status != IO_OK) {
+        return r.status;
+    }
+    cout << r.data << endl;
+    return IO_OK;
+}
+
+// read a data file into a pipe. The data blocks are read as one batch
+// straight into the pipe's buffers.
+io_status_t FileSys::cat(const char *name, Pipe &out)
 {
+    IoCommand io_command("cat");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
+    ReadLock inode_lock(vol.block_lock(block_num));
     inode_t inode;
     bfs.read_block(block_num, &inode);
     
-    unsigned int data_len = strlen(data);
+    vector<short> data_nums;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (inode.blocks[i] != 0) {
+            data_nums.push_back(inode.blocks[i]);
+        }
+    }
+    bfs.read_blocks(data_nums.data(), data_nums.size(),
+                    out.fill(data_nums.size(), inode.size));
+    return IO_OK;
+}
+
+// copy a file of the host into a new data file. The host file is read
+// straight into the data block buffers, whose blocks are then allocated
+// together with the inode and written as one batch.
+io_status_t FileSys::import_file(const char *host_path, const char *name,
+                                 transfer_info_t &info)
+{
+    IoCommand io_command("import");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
     
-    // Check if append would exceed maximum file size
-    if (inode.size + data_len > MAX_FILE_SIZE) {
-        cout << "Append exceeds maximum file size" << endl;
-        return;
+    // Check if name is too long
+    if (strlen(name) > MAX_FNAME_SIZE) {
+        return IO_NAME_TOO_LONG;
     }
     
-    unsigned int data_pos = 0;
+    int fd = open(host_path, O_RDONLY);
+    if (fd == -1) {
+        return IO_HOST_OPEN;
+    }
     
-    // Find last block with data
-    int last_block_index = -1;
-    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-        if (inode.blocks[i] != 0) {
-            last_block_index = i;
-        }
+    // read one byte more than a file can hold to tell if it is too large
+    vector<datablock_t> data(MAX_DATA_BLOCKS + 1);
+    char *buffer = data[0].data;
+    unsigned int size = 0;
+    ssize_t bytes = 0;
+    while (size <= (unsigned int) MAX_FILE_SIZE &&
+           (bytes = ::read(fd, buffer + size, MAX_FILE_SIZE + 1 - size)) > 0) {
+        size += bytes;
+    }
+    close(fd);
+    if (bytes < 0) {
+        return IO_HOST_READ;
+    }
+    if (size > (unsigned int) MAX_FILE_SIZE) {
+        return IO_FILE_TOO_LARGE;
     }
     
-    // If file has data, try to fill the last block first
-    if (last_block_index >= 0) {
-        datablock_t last_block;
-        bfs.read_block(inode.blocks[last_block_index], &last_block);
-        
-        unsigned int bytes_in_last_block = inode.size % BLOCK_SIZE;
-        if (bytes_in_last_block == 0) {
-            bytes_in_last_block = BLOCK_SIZE;
-        }
-        
-        unsigned int space_left = BLOCK_SIZE - bytes_in_last_block;
-        if (space_left > 0) {
-            unsigned int bytes_to_copy = (data_len < space_left) ? data_len : space_left;
-            memcpy(&last_block.data[bytes_in_last_block], data, bytes_to_copy);
-            bfs.write_block(inode.blocks[last_block_index], &last_block);
-            
-            data_pos += bytes_to_copy;
-            inode.size += bytes_to_copy;
-        }
+    // clear the rest of the last block
+    int num_data = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(buffer + size, 0, num_data * BLOCK_SIZE - size);
+    
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    Transaction tx(bfs);
+    
+    dirblock_t dir_block;
+    bfs.read_block(curr_dir, &dir_block);
+    
+    // Check if file already exists
+    short existing_block;
+    unsigned char existing_type;
+    if (dir_find(dir_block, name, existing_block, existing_type) != -1) {
+        return IO_EXISTS;
     }
     
-    // Append remaining data in new blocks
-    while (data_pos < data_len) {
-        // Find next free slot in inode
-        int free_slot = -1;
-        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-            if (inode.blocks[i] == 0) {
-                free_slot = i;
-                break;
-            }
-        }
-        
-        if (free_slot == -1) {
-            cout << "Append exceeds maximum file size" << endl;
-            return;
-        }
-        
-        // Get new data block
-        short new_block = bfs.get_free_block();
-        if (new_block == 0) {
-            cout << "Disk is full" << endl;
-            return;
-        }
-        
-        // Fill the new block
-        datablock_t new_data_block;
-        unsigned int bytes_left = data_len - data_pos;
-        unsigned int bytes_to_copy = (bytes_left < BLOCK_SIZE) ? bytes_left : BLOCK_SIZE;
-        
-        memcpy(new_data_block.data, &data[data_pos], bytes_to_copy);
-        
-        // Clear remaining bytes in block if not full
-        for (unsigned int i = bytes_to_copy; i < BLOCK_SIZE; i++) {
-            new_data_block.data[i] = 0;
-        }
-        
-        bfs.write_block(new_block, &new_data_block);
-        inode.blocks[free_slot] = new_block;
-        
-        data_pos += bytes_to_copy;
-        inode.size += bytes_to_copy;
+    if (!dir_has_room(dir_block, name)) {
+        return IO_DIR_FULL;
+    }
+    
+    // the inode and its data blocks
+    vector<short> blocks(num_data + 1);
+    if (!bfs.get_free_blocks(num_data + 1, &blocks[0])) {
+        return IO_DISK_FULL;
+    }
+    
+    inode_t inode;
+    inode.magic = INODE_MAGIC_NUM;
+    inode.size = size;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        inode.blocks[i] = (i < num_data) ? blocks[i + 1] : 0;
     }
     
-    // Write updated inode
-    bfs.write_block(block_num, &inode);
+    bfs.write_data_blocks(blocks.data() + 1, num_data, data.data());
+    bfs.write_block(blocks[0], &inode);
+    dir_insert(dir_block, name, DIR_ENTRY_FILE, blocks[0]);
+    write_dir(curr_dir, dir_block);
+    index_add(name, curr_dir, blocks[0]);
+    tx.commit();
+    
+    set_transfer(info, size, start);
+    return IO_OK;
 }
 
-// display the contents of a data file
-void FileSys::cat(const char *name)
+// copy a data file to a file of the host. The file is read into a pipe,
+// which is written to the host file from where it lies.
+io_status_t FileSys::export_file(const char *name, const char *host_path,
+                                 transfer_info_t &info)
 {
-    short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    IoCommand io_command("export");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    
+    Pipe data;
+    io_status_t status = cat(name, data);
+    if (status != IO_OK) {
+        return status;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return IO_HOST_OPEN;
     }
     
-    inode_t inode;
-    bfs.read_block(block_num, &inode);
+    unsigned int written = 0;
+    while (written < data.size()) {
+        ssize_t bytes = write(fd, data.data() + written, data.size() - written);
+        if (bytes <= 0) {
+            break;
+        }
+        written += bytes;
+    }
+    if (close(fd) != 0 || written < data.size()) {
+        return IO_HOST_WRITE;
+    }
     
-    unsigned int bytes_left = inode.size;
-    for (int i = 0; i < MAX_DATA_BLOCKS && bytes_left > 0; i++) {
-        if (inode.blocks[i] != 0) {
-            datablock_t data_block;
-            bfs.read_block(inode.blocks[i], &data_block);
-            
-            unsigned int bytes_to_print = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
-            for (unsigned int j = 0; j < bytes_to_print; j++) {
-                cout << data_block.data[j];
-            }
-            bytes_left -= bytes_to_print;
+    set_transfer(info, data.size(), start);
+    return IO_OK;
+}
+
+// queue a read of a whole data file
+future<io_result_t> FileSys::read_async(const char *name)
+{
+    return queue_op(false, name, "", NULL, 0);
+}
+
+// queue an append to a data file
+future<io_result_t> FileSys::append_async(const char *name, const char *data)
+{
+    return queue_op(true, name, data, NULL, 0);
+}
+
+// run the operations queued since the last submit as one batch on a
+// background thread
+void FileSys::submit()
+{
+    if (pending.empty()) {
+        return;
+    }
+    
+    // forget batches that have finished
+    for (size_t i = 0; i < batches.size(); ) {
+        if (batches[i].wait_for(chrono::seconds(0)) == future_status::ready) {
+            batches.erase(batches.begin() + i);
+        } else {
+            i++;
         }
     }
-    cout << endl;
+    
+    shared_ptr<vector<async_op_t> > batch(new vector<async_op_t>());
+    batch->swap(pending);
+    batches.push_back(async(launch::async, [this, batch]() {
+        run_batch(*batch);
+    }));
 }
 
 // display the last N bytes of the file
-void FileSys::tail(const char *name, unsigned int n)
+io_status_t FileSys::tail(const char *name, unsigned int n)
 {
+    IoCommand io_command("tail");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
+    ReadLock inode_lock(vol.block_lock(block_num));
     inode_t inode;
     bfs.read_block(block_num, &inode);
     
     if (inode.size == 0) {
-        return; // Empty file, nothing to print
+        return IO_OK; // Empty file, nothing to print
     }
     
     unsigned int bytes_to_print = (n > inode.size) ? inode.size : n;
@@ -396,6 +674,7 @@ void FileSys::tail(const char *name, unsigned int n)
             unsigned int block_end = current_pos + BLOCK_SIZE;
             if (start_pos < block_end) {
                 // This block contains part of what we need to print
+                vol.read_ahead.access(block_num, inode, i);
                 datablock_t data_block;
                 bfs.read_block(inode.blocks[i], &data_block);
                 
@@ -424,24 +703,30 @@ void FileSys::tail(const char *name, unsigned int n)
         }
     }
     cout << endl;
+    return IO_OK;
 }
 
 // delete a data file
-void FileSys::rm(const char *name)
+io_status_t FileSys::rm(const char *name)
 {
+    IoCommand io_command("rm");
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    Transaction tx(bfs);
+    
     short block_num;
-    int entry_index = find_file(name, block_num);
-    if (entry_index == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    int entry_offset = find_file(name, block_num, type);
+    if (entry_offset == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
     // Read inode and reclaim all data blocks
+    WriteLock inode_lock(vol.block_lock(block_num));
     inode_t inode;
     bfs.read_block(block_num, &inode);
     
@@ -458,102 +743,245 @@ void FileSys::rm(const char *name)
     dirblock_t dir_block;
     bfs.read_block(curr_dir, &dir_block);
     
-    dir_block.dir_entries[entry_index].block_num = 0;
-    dir_block.dir_entries[entry_index].name[0] = '\0';
-    dir_block.num_entries--;
+    dir_remove(dir_block, entry_offset);
     
     // Write updated directory
-    bfs.write_block(curr_dir, &dir_block);
+    write_dir(curr_dir, dir_block);
+
+    index_remove(name, curr_dir, block_num);
+    return IO_OK;
 }
 
-// display stats about file or directory
-void FileSys::stat(const char *name)
+// delete a data file, or with recursive a file or a whole directory tree.
+// The blocks of the tree are collected in one walk and freed with a
+// single bitmap update.
+io_status_t FileSys::rm(const char *name, bool recursive)
 {
+    IoCommand io_command("rm");
+    if (!recursive) {
+        return rm(name);
+    }
+    
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+    
+    dirblock_t dir_block;
+    bfs.read_block(curr_dir, &dir_block);
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    int entry_offset = dir_find(dir_block, name, block_num, type);
+    if (entry_offset == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (is_directory(block_num)) {
-        cout << "Directory name: " << name << "/" << endl;
-        cout << "Directory block: " << block_num << endl;
-    } else if (is_file(block_num)) {
-        inode_t inode;
-        bfs.read_block(block_num, &inode);
-        
-        cout << "Inode block: " << block_num << endl;
-        cout << "Bytes in file: " << inode.size << endl;
-        
-        // Count number of data blocks
-        int num_blocks = 0;
-        short first_block = 0;
-        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
-            if (inode.blocks[i] != 0) {
-                if (first_block == 0) {
-                    first_block = inode.blocks[i];
-                }
-                num_blocks++;
-            }
+    // the directory and a name index update for every entry of the tree
+    // must commit together
+    if (name_index.enabled()) {
+        vector<string> names(1, name);
+        tree_names(block_num, type, names);
+        if (!bfs.txn_has_room(1 + name_index.update_blocks(names, false))) {
+            return IO_TXN_TOO_LARGE;
         }
-        
-        cout << "Number of blocks: " << num_blocks << endl;
-        cout << "First block: " << first_block << endl;
     }
+    
+    vector<short> blocks;
+    collect_blocks(block_num, type, blocks);
+    bfs.reclaim_blocks(&blocks[0], blocks.size());
+    
+    // Remove entry from directory
+    dir_remove(dir_block, entry_offset);
+    write_dir(curr_dir, dir_block);
+    
+    index_remove(name, curr_dir, block_num);
+    return IO_OK;
 }
 
-// HELPER FUNCTIONS
-
-// Find a file/directory by name in current directory
-// Returns entry index if found, -1 if not found
-// Sets block_num to the block number of the file/directory
-int FileSys::find_file(const char *name, short &block_num) {
-    dirblock_t dir_block;
-    bfs.read_block(curr_dir, &dir_block);
+// describe a file or directory
+io_status_t FileSys::stat(const char *name, file_info_t &info)
+{
+    IoCommand io_command("stat");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
     
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_block.dir_entries[i].block_num != 0 && 
-            strcmp(dir_block.dir_entries[i].name, name) == 0) {
-            block_num = dir_block.dir_entries[i].block_num;
-            return i;
+    short block_num;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
+    }
+    
+    info.is_dir = (type == DIR_ENTRY_DIR);
+    info.block_num = block_num;
+    info.size = 0;
+    info.num_blocks = 0;
+    info.first_block = 0;
+    if (!info.is_dir) {
+        ReadLock inode_lock(vol.block_lock(block_num));
+        inode_t inode;
+        bfs.read_block(block_num, &inode);
+        
+        info.size = inode.size;
+        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] != 0) {
+                if (info.first_block == 0) {
+                    info.first_block = inode.blocks[i];
+                }
+                info.num_blocks++;
+            }
         }
     }
-    block_num = 0;
-    return -1;
+    return IO_OK;
 }
 
-// Check if a block is a directory
-bool FileSys::is_directory(short block_num) {
-    dirblock_t block;
-    bfs.read_block(block_num, &block);
-    return block.magic == DIR_MAGIC_NUM;
+// copy up to size bytes of a data file, starting at offset, into buffer.
+// bytes_read is set to the number copied (0 at or past the end).
+io_status_t FileSys::read(const char *name, unsigned int offset, char *buffer,
+                          unsigned int size, unsigned int &bytes_read)
+{
+    IoCommand io_command("read");
+    bytes_read = 0;
+    
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
+    short block_num;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
+    }
+    
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
+    }
+    
+    ReadLock inode_lock(vol.block_lock(block_num));
+    inode_t inode;
+    bfs.read_block(block_num, &inode);
+    
+    if (offset >= inode.size || size == 0) {
+        return IO_OK;
+    }
+    if (size > inode.size - offset) {
+        size = inode.size - offset;
+    }
+    
+    // the data blocks holding the range, read as one batch
+    vector<short> data_nums;
+    unsigned int pos = 0;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (inode.blocks[i] != 0) {
+            if (pos + BLOCK_SIZE > offset && pos < offset + size) {
+                data_nums.push_back(inode.blocks[i]);
+            }
+            pos += BLOCK_SIZE;
+        }
+    }
+    vector<datablock_t> data(data_nums.size());
+    bfs.read_blocks(data_nums.data(), data_nums.size(), data.data());
+    
+    memcpy(buffer, (const char *) data.data() + offset % BLOCK_SIZE, size);
+    bytes_read = size;
+    return IO_OK;
 }
 
-// Check if a block is a file (inode)
-bool FileSys::is_file(short block_num) {
-    inode_t block;
-    bfs.read_block(block_num, &block);
-    return block.magic == INODE_MAGIC_NUM;
+// HELPER FUNCTIONS
+
+// Find a file/directory by name in current directory
+// Returns entry offset if found, -1 if not found
+// Sets block_num to the block number of the file/directory and type to
+// its entry type
+int FileSys::find_file(const char *name, short &block_num, unsigned char &type) {
+    dirblock_t dir_block;
+    bfs.read_block(curr_dir, &dir_block);
+    
+    return dir_find(dir_block, name, block_num, type);
 }
 
 // NEW COMMANDS IMPLEMENTATION
 
 // print working directory
 void FileSys::pwd() {
-    cout << current_path << endl;
+    ReadLock tree_lock(vol.namespace_lock);
+    cout << current_path() << endl;
 }
 
-// show disk free space
-void FileSys::df() {
-    superblock_t superblock;
-    bfs.read_block(0, &superblock);
+// show block cache, read-ahead and writeback counters
+void FileSys::cache() {
+    cache_stats_t stats;
+    bfs.cache_stats(stats);
+    unsigned long ra_hits, ra_misses;
+    vol.read_ahead.get_counters(ra_hits, ra_misses);
+    
+    cout << "Block cache: " << stats.cached << "/" << CACHE_BLOCKS << " blocks, "
+         << stats.hits << " hits, " << stats.misses << " misses" << endl;
+    cout << "Read-ahead: " << stats.prefetched << " blocks prefetched, "
+         << stats.prefetch_hits << " used, " << ra_hits << " hits, "
+         << ra_misses << " misses" << endl;
+    cout << "Writeback: " << stats.dirty << " dirty blocks, "
+         << stats.written_back << " written back" << endl;
+}
+
+// show the block I/O counters, or turn counting on or off or zero them
+io_status_t FileSys::iostat(const char *op) {
+    IoStats &stats = bfs.io_stats();
+    string cmd(op);
+
+    if (cmd == "") {
+        stats.print(cout);
+    } else if (cmd == "on" || cmd == "off") {
+        stats.enable(cmd == "on");
+    } else if (cmd == "reset") {
+        stats.reset();
+    } else {
+        return IO_BAD_OP;
+    }
+    return IO_OK;
+}
+
+// write every changed block back to the disk
+void FileSys::sync() {
+    IoCommand io_command("sync");
+    bfs.sync();
+}
+
+// write a data file's changed blocks back to the disk: its data blocks,
+// its inode, the directory entry naming it and the free block bitmap
+io_status_t FileSys::fsync(const char *name) {
+    IoCommand io_command("fsync");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
+    short block_num;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
+    }
     
-    int free_blocks = 0;
-    for (int i = 0; i < NUM_BLOCKS; i++) {
-        if (!(superblock.bitmap[i/8] & (1 << (i%8)))) {
-            free_blocks++;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
+    }
+    
+    ReadLock inode_lock(vol.block_lock(block_num));
+    inode_t inode;
+    bfs.read_block(block_num, &inode);
+    
+    vector<short> blocks;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (inode.blocks[i] != 0) {
+            blocks.push_back(inode.blocks[i]);
         }
     }
+    blocks.push_back(block_num);
+    blocks.push_back(curr_dir);
+    blocks.push_back(0);
+    bfs.sync_blocks(blocks.data(), blocks.size());
+    return IO_OK;
+}
+
+// show disk free space
+void FileSys::df() {
+    IoCommand io_command("df");
+    int free_blocks = bfs.num_free_blocks();
     
     int used_blocks = NUM_BLOCKS - free_blocks;
     int use_percent = (used_blocks * 100) / NUM_BLOCKS;
@@ -565,23 +993,27 @@ void FileSys::df() {
 }
 
 // show first N bytes of file
-void FileSys::head(const char *name, unsigned int n) {
+io_status_t FileSys::head(const char *name, unsigned int n) {
+    IoCommand io_command("head");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
+    ReadLock inode_lock(vol.block_lock(block_num));
     inode_t inode;
     bfs.read_block(block_num, &inode);
     
     if (inode.size == 0 || n == 0) {
-        return; // Empty file or nothing to print
+        return IO_OK; // Empty file or nothing to print
     }
     
     unsigned int bytes_to_print = (n > inode.size) ? inode.size : n;
@@ -590,6 +1022,7 @@ void FileSys::head(const char *name, unsigned int n) {
     // Read data blocks sequentially until N bytes printed
     for (int i = 0; i < MAX_DATA_BLOCKS && bytes_printed < bytes_to_print; i++) {
         if (inode.blocks[i] != 0) {
+            vol.read_ahead.access(block_num, inode, i);
             datablock_t data_block;
             bfs.read_block(inode.blocks[i], &data_block);
             
@@ -603,21 +1036,26 @@ void FileSys::head(const char *name, unsigned int n) {
         }
     }
     cout << endl;
+    return IO_OK;
 }
 
 // show word count (lines, words, bytes)
-void FileSys::wc(const char *name) {
+io_status_t FileSys::wc(const char *name) {
+    IoCommand io_command("wc");
+    ReadLock tree_lock(vol.namespace_lock);
+    ReadLock dir_lock(vol.block_lock(curr_dir));
+    
     short block_num;
-    if (find_file(name, block_num) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char type;
+    if (find_file(name, block_num, type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(block_num)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
+    ReadLock inode_lock(vol.block_lock(block_num));
     inode_t inode;
     bfs.read_block(block_num, &inode);
     
@@ -630,30 +1068,15 @@ void FileSys::wc(const char *name) {
     unsigned int bytes_read = 0;
     for (int i = 0; i < MAX_DATA_BLOCKS && bytes_read < inode.size; i++) {
         if (inode.blocks[i] != 0) {
+            vol.read_ahead.access(block_num, inode, i);
             datablock_t data_block;
             bfs.read_block(inode.blocks[i], &data_block);
             
             unsigned int bytes_in_this_block = (inode.size - bytes_read > BLOCK_SIZE) ? 
                                                BLOCK_SIZE : inode.size - bytes_read;
             
-            for (unsigned int j = 0; j < bytes_in_this_block; j++) {
-                char c = data_block.data[j];
-                
-                if (c == '\n') {
-                    lines++;
-                }
-                
-                if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
-                    if (in_word) {
-                        words++;
-                        in_word = false;
-                    }
-                } else {
-                    in_word = true;
-                }
-                
-                bytes_read++;
-            }
+            count_words(data_block.data, bytes_in_this_block, lines, words, in_word);
+            bytes_read += bytes_in_this_block;
         }
     }
     
@@ -663,44 +1086,62 @@ void FileSys::wc(const char *name) {
     }
     
     cout << lines << " " << words << " " << bytes << " " << name << endl;
+    return IO_OK;
+}
+
+// show word count of the bytes in a pipe
+void FileSys::wc(const Pipe &input) {
+    unsigned int lines = 0;
+    unsigned int words = 0;
+    bool in_word = false;
+    
+    count_words(input.data(), input.size(), lines, words, in_word);
+    if (in_word) {
+        words++;
+    }
+    
+    cout << lines << " " << words << " " << input.size() << endl;
 }
 
 // copy file
-void FileSys::cp(const char *src, const char *dest) {
+io_status_t FileSys::cp(const char *src, const char *dest) {
+    IoCommand io_command("cp");
+    ReadLock tree_lock(vol.namespace_lock);
+    WriteLock dir_lock(vol.block_lock(curr_dir));
+    Transaction tx(bfs);
+    
     // Check if source exists
     short src_block;
-    if (find_file(src, src_block) == -1) {
-        cout << "File does not exist" << endl;
-        return;
+    unsigned char src_type;
+    if (find_file(src, src_block, src_type) == -1) {
+        return IO_NOT_FOUND;
     }
     
-    if (!is_file(src_block)) {
-        cout << "File is a directory" << endl;
-        return;
+    if (src_type != DIR_ENTRY_FILE) {
+        return IO_IS_DIR;
     }
     
     // Check if destination already exists
     short dest_block;
-    if (find_file(dest, dest_block) != -1) {
-        cout << "File exists" << endl;
-        return;
+    unsigned char dest_type;
+    if (find_file(dest, dest_block, dest_type) != -1) {
+        return IO_EXISTS;
     }
     
     // Check if destination name is too long
     if (strlen(dest) > MAX_FNAME_SIZE) {
-        cout << "File name is too long" << endl;
-        return;
+        return IO_NAME_TOO_LONG;
     }
     
     // Read source inode
+    ReadLock inode_lock(vol.block_lock(src_block));
     inode_t src_inode;
     bfs.read_block(src_block, &src_inode);
     
     // Create new inode for destination
     short dest_inode_block = bfs.get_free_block();
     if (dest_inode_block == 0) {
-        cout << "Disk is full" << endl;
-        return;
+        return IO_DISK_FULL;
     }
     
     inode_t dest_inode;
@@ -713,7 +1154,6 @@ void FileSys::cp(const char *src, const char *dest) {
             // Get new block for destination
             short new_data_block = bfs.get_free_block();
             if (new_data_block == 0) {
-                cout << "Disk is full" << endl;
                 // Clean up already allocated blocks
                 for (int j = 0; j < i; j++) {
                     if (dest_inode.blocks[j] != 0) {
@@ -721,13 +1161,13 @@ void FileSys::cp(const char *src, const char *dest) {
                     }
                 }
                 bfs.reclaim_block(dest_inode_block);
-                return;
+                return IO_DISK_FULL;
             }
             
             // Copy data
             datablock_t data_block;
             bfs.read_block(src_inode.blocks[i], &data_block);
-            bfs.write_block(new_data_block, &data_block);
+            bfs.write_data_block(new_data_block, &data_block);
             
             dest_inode.blocks[i] = new_data_block;
         } else {
@@ -742,8 +1182,7 @@ void FileSys::cp(const char *src, const char *dest) {
     dirblock_t dir_block;
     bfs.read_block(curr_dir, &dir_block);
     
-    if (dir_block.num_entries >= MAX_DIR_ENTRIES) {
-        cout << "Directory is full" << endl;
+    if (!dir_has_room(dir_block, dest)) {
         // Clean up
         for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
             if (dest_inode.blocks[i] != 0) {
@@ -751,126 +1190,1107 @@ void FileSys::cp(const char *src, const char *dest) {
             }
         }
         bfs.reclaim_block(dest_inode_block);
-        return;
+        return IO_DIR_FULL;
     }
     
-    // Find free entry
-    int free_entry = -1;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_block.dir_entries[i].block_num == 0) {
-            free_entry = i;
-            break;
+    dir_insert(dir_block, dest, DIR_ENTRY_FILE, dest_inode_block);
+    
+    write_dir(curr_dir, dir_block);
+
+    index_add(dest, curr_dir, dest_inode_block);
+    return IO_OK;
+}
+
+// copy file, or with recursive a file or a whole directory tree. The
+// metadata of the tree is read once, every block the copy needs is
+// allocated with a single bitmap update, and each new block is written
+// once. Only the current directory, the bitmap and the name index are
+// logged, so the size of the tree is limited by the index alone.
+io_status_t FileSys::cp(const char *src, const char *dest, bool recursive) {
+    IoCommand io_command("cp");
+    if (!recursive) {
+        return cp(src, dest);
+    }
+    
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+    
+    dirblock_t dir_block;
+    bfs.read_block(curr_dir, &dir_block);
+    
+    // Check if source exists
+    short src_block;
+    unsigned char src_type;
+    if (dir_find(dir_block, src, src_block, src_type) == -1) {
+        return IO_NOT_FOUND;
+    }
+    
+    // Check if destination already exists
+    short dest_block;
+    unsigned char dest_type;
+    if (dir_find(dir_block, dest, dest_block, dest_type) != -1) {
+        return IO_EXISTS;
+    }
+    
+    // Check if destination name is too long
+    if (strlen(dest) > MAX_FNAME_SIZE) {
+        return IO_NAME_TOO_LONG;
+    }
+    
+    if (!dir_has_room(dir_block, dest)) {
+        return IO_DIR_FULL;
+    }
+    
+    // Read the tree's directories and inodes, counting the blocks needed
+    map<short, datablock_t> meta;
+    int needed = plan_copy(src_block, src_type, meta);
+    
+    // the current directory and the name index updates for the copy must
+    // commit together
+    if (name_index.enabled()) {
+        vector<string> names(1, dest);
+        tree_names(src_block, src_type, names);
+        if (!bfs.txn_has_room(1 + name_index.update_blocks(names, true))) {
+            return IO_TXN_TOO_LARGE;
         }
     }
     
-    strcpy(dir_block.dir_entries[free_entry].name, dest);
-    dir_block.dir_entries[free_entry].block_num = dest_inode_block;
-    dir_block.num_entries++;
+    vector<short> blocks(needed);
+    if (!bfs.get_free_blocks(needed, &blocks[0])) {
+        return IO_DISK_FULL;
+    }
+    
+    int next = 0;
+    short copy = copy_tree(src_block, src_type, curr_dir, meta, blocks, next);
     
-    bfs.write_block(curr_dir, &dir_block);
+    dir_insert(dir_block, dest, src_type, copy);
+    write_dir(curr_dir, dir_block);
+    
+    index_add(dest, curr_dir, copy);
+    return IO_OK;
 }
 
-// move/rename file
-void FileSys::mv(const char *src, const char *dest) {
+// move/rename file or directory. Either argument may be a path, and a
+// destination that names a directory receives the source under its own
+// name. Only directory entries are relinked; no data block is touched.
+io_status_t FileSys::mv(const char *src, const char *dest) {
+    IoCommand io_command("mv");
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+    
     // Check if source exists
+    short src_dir;
+    string src_name;
+    if (!resolve_parent(src, src_dir, src_name) ||
+        src_name == "" || src_name == "." || src_name == "..") {
+        return IO_NOT_FOUND;
+    }
+    
+    dirblock_t src_block_dir;
+    bfs.read_block(src_dir, &src_block_dir);
+    
     short src_block;
-    int src_entry = find_file(src, src_block);
+    unsigned char src_type;
+    int src_entry = dir_find(src_block_dir, src_name.c_str(), src_block, src_type);
     if (src_entry == -1) {
-        cout << "File does not exist" << endl;
-        return;
+        return IO_NOT_FOUND;
     }
     
-    // Check if destination already exists
+    // Work out the target directory and name
+    short dest_dir;
+    string dest_name;
+    if (!resolve_parent(dest, dest_dir, dest_name)) {
+        return IO_NOT_FOUND;
+    }
+    if (dest_name == "" || dest_name == "." || dest_name == "..") {
+        if (dest_name != "") {
+            step_dir(dest_dir, dest_name, dest_dir);
+        } else {
+            dest_dir = ROOT_BLOCK;
+        }
+        dest_name = src_name;
+    }
+    
+    dirblock_t dest_block_dir;
+    bfs.read_block(dest_dir, &dest_block_dir);
+    
+    // Check if destination already exists; an existing directory
+    // receives the source under its own name
     short dest_block;
-    if (find_file(dest, dest_block) != -1) {
-        cout << "File exists" << endl;
-        return;
+    unsigned char dest_type;
+    if (dir_find(dest_block_dir, dest_name.c_str(), dest_block, dest_type) != -1) {
+        if (dest_type != DIR_ENTRY_DIR || dest_block == src_block) {
+            return IO_EXISTS;
+        }
+        dest_dir = dest_block;
+        dest_name = src_name;
+        bfs.read_block(dest_dir, &dest_block_dir);
+        if (dir_find(dest_block_dir, dest_name.c_str(), dest_block, dest_type) != -1) {
+            return IO_EXISTS;
+        }
     }
     
     // Check if destination name is too long
-    if (strlen(dest) > MAX_FNAME_SIZE) {
-        cout << "File name is too long" << endl;
-        return;
+    if (dest_name.length() > MAX_FNAME_SIZE) {
+        return IO_NAME_TOO_LONG;
     }
     
-    // Update directory entry name
-    dirblock_t dir_block;
-    bfs.read_block(curr_dir, &dir_block);
-    
-    strcpy(dir_block.dir_entries[src_entry].name, dest);
+    // A directory may not move into itself or one of its subdirectories
+    if (src_type == DIR_ENTRY_DIR && is_ancestor(src_block, dest_dir)) {
+        return IO_INTO_ITSELF;
+    }
     
-    bfs.write_block(curr_dir, &dir_block);
+    if (dest_dir == src_dir) {
+        // Replace the entry with one under the new name, which may need a
+        // different amount of room
+        dir_remove(src_block_dir, src_entry);
+        if (!dir_insert(src_block_dir, dest_name.c_str(), src_type, src_block)) {
+            return IO_DIR_FULL;
+        }
+        write_dir(src_dir, src_block_dir);
+    } else {
+        // Link into the target before unlinking from the source, so an
+        // interrupted move leaves two entries rather than none
+        if (!dir_insert(dest_block_dir, dest_name.c_str(), src_type, src_block)) {
+            return IO_DIR_FULL;
+        }
+        write_dir(dest_dir, dest_block_dir);
+        
+        dir_remove(src_block_dir, src_entry);
+        write_dir(src_dir, src_block_dir);
+        
+        if (src_type == DIR_ENTRY_DIR) {
+            dirblock_t moved;
+            bfs.read_block(src_block, &moved);
+            moved.parent = dest_dir;
+            write_dir(src_block, moved);
+        }
+    }
+
+    index_remove(src_name.c_str(), src_dir, src_block);
+    index_add(dest_name.c_str(), dest_dir, src_block);
+    return IO_OK;
 }
 
 // find files/directories by name
 void FileSys::find(const char *name) {
-    find_recursive(name, curr_dir, current_path);
+    IoCommand io_command("find");
+    ReadLock tree_lock(vol.namespace_lock);
+    
+    if (name_index.enabled()) {
+        find_indexed(name);
+        return;
+    }
+    find_recursive(name, curr_dir, current_path());
+}
+
+// Answer find from the name index. Each candidate is confirmed against
+// its parent directory and its path is rebuilt by following parent
+// links up to the current directory, so the cost depends only on the
+// number of matches and their depth.
+void FileSys::find_indexed(const char *name) {
+    vector<index_match_t> matches;
+    name_index.lookup(name, matches);
+
+    string cwd = current_path();
+    vector<string> paths;
+    for (size_t m = 0; m < matches.size(); m++) {
+        // Confirm the entry still carries this name
+        dirblock_t dir;
+        bfs.read_block(matches[m].parent, &dir);
+        if (dir.magic != DIR_MAGIC_NUM ||
+            entry_name(dir, matches[m].block_num) != name) {
+            continue;
+        }
+
+        // Walk up to the current directory, prepending each directory name
+        string rel = name;
+        short block_num = matches[m].parent;
+        int depth = 0;
+        while (block_num != curr_dir && depth < NUM_BLOCKS) {
+            if (block_num == 1 || dir.parent == 0) {
+                break;  // not below the current directory
+            }
+            short parent = dir.parent;
+            bfs.read_block(parent, &dir);
+            rel = entry_name(dir, block_num) + "/" + rel;
+            block_num = parent;
+            depth++;
+        }
+        if (block_num != curr_dir) {
+            continue;
+        }
+
+        paths.push_back((cwd == "/") ? "/" + rel : cwd + "/" + rel);
+    }
+
+    sort(paths.begin(), paths.end());
+    for (size_t i = 0; i < paths.size(); i++) {
+        cout << paths[i] << endl;
+    }
 }
 
 // Helper function for recursive find
 void FileSys::find_recursive(const char *name, short dir_block, const string& path) {
     dirblock_t dir;
-    bfs.read_block(dir_block, &dir);
+    {
+        ReadLock dir_lock(vol.block_lock(dir_block));
+        bfs.read_block(dir_block, &dir);
+    }
     
     // Search current directory
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir.dir_entries[i].block_num != 0) {
-            if (strcmp(dir.dir_entries[i].name, name) == 0) {
-                string full_path = (path == "/") ? "/" + string(name) : path + "/" + string(name);
-                cout << full_path << endl;
-            }
-            
-            // If it's a directory, recurse into it
-            if (is_directory(dir.dir_entries[i].block_num)) {
-                string subdir_path = (path == "/") ? "/" + string(dir.dir_entries[i].name) : 
-                                     path + "/" + string(dir.dir_entries[i].name);
-                find_recursive(name, dir.dir_entries[i].block_num, subdir_path);
-            }
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        if (strcmp(entry.name, name) == 0) {
+            string full_path = (path == "/") ? "/" + string(name) : path + "/" + string(name);
+            cout << full_path << endl;
+        }
+        
+        // If it's a directory, recurse into it
+        if (entry.type == DIR_ENTRY_DIR) {
+            string subdir_path = (path == "/") ? "/" + string(entry.name) : 
+                                 path + "/" + string(entry.name);
+            find_recursive(name, entry.block_num, subdir_path);
         }
     }
 }
 
 // display directory tree
 void FileSys::tree() {
-    cout << current_path << endl;
-    tree_recursive(curr_dir, "", true);
+    tree(false);
+}
+
+// display directory tree, optionally sorted by name
+void FileSys::tree(bool sorted) {
+    IoCommand io_command("tree");
+    ReadLock tree_lock(vol.namespace_lock);
+    
+    cout << current_path() << endl;
+    tree_recursive(curr_dir, "", sorted);
 }
 
-// Helper function for recursive tree display
-void FileSys::tree_recursive(short dir_block, const string& prefix, bool is_last) {
+// Helper function for recursive tree display. Entries are read in batches
+// from a cursor; each one is printed once the next is known, so the last
+// entry of a directory can be drawn with the closing branch.
+void FileSys::tree_recursive(short dir_block, const string& prefix, bool sorted) {
+    int cursor = open_cursor(dir_block, sorted);
+    
+    dir_entry_t entries[LISTING_BATCH];
+    dir_entry_t pending;
+    bool have_pending = false;
+    int count;
+    while ((count = readdir(cursor, entries, LISTING_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (have_pending) {
+                tree_entry(pending, prefix, false, sorted);
+            }
+            pending = entries[i];
+            have_pending = true;
+        }
+    }
+    closedir(cursor);
+    
+    if (have_pending) {
+        tree_entry(pending, prefix, true, sorted);
+    }
+}
+
+// Helper that prints one tree entry and recurses into directories
+void FileSys::tree_entry(const dir_entry_t &entry, const string& prefix, bool is_last_entry, bool sorted) {
+    cout << prefix;
+    cout << (is_last_entry ? "└── " : "├── ");
+    cout << entry.name;
+    
+    if (entry.type == DIR_ENTRY_DIR) {
+        cout << "/";
+    }
+    cout << endl;
+    
+    // If it's a directory, recurse
+    if (entry.type == DIR_ENTRY_DIR) {
+        string new_prefix = prefix + (is_last_entry ? "    " : "│   ");
+        tree_recursive(entry.block_num, new_prefix, sorted);
+    }
+}
+
+// Helper that opens a cursor over directory block dir_block. Sorted
+// cursors share the name-sorted snapshot the volume caches for the
+// directory, which is built on first use and dropped whenever the
+// directory is written. The caller holds the namespace lock, so no mv,
+// cp -r or rm -r is rewriting the directory.
+int FileSys::open_cursor(short dir_block, bool sorted) {
+    dir_cursor_t c;
+    c.sorted_order = sorted;
+    c.offset = 0;
+    c.pos = 0;
+    
+    ReadLock dir_lock(vol.block_lock(dir_block));
+    if (sorted) {
+        c.sorted = vol.sorted_listing(dir_block);
+    } else {
+        bfs.read_block(dir_block, &c.dir);
+    }
+    
+    int id = next_cursor++;
+    cursors[id] = c;
+    return id;
+}
+
+// Helper that queues an asynchronous operation on a file of the current
+// directory
+future<io_result_t> FileSys::queue_op(bool append, const char *name, const char *data,
+                                      const char *bytes, unsigned int size) {
+    async_op_t op;
+    op.append = append;
+    op.dir_block = curr_dir;
+    op.name = name;
+    op.data = data;
+    op.bytes = bytes;
+    op.size = size;
+    future<io_result_t> result = op.result.get_future();
+    pending.push_back(move(op));
+    return result;
+}
+
+// Helper that runs the queued operations on the calling thread
+void FileSys::run_pending() {
+    vector<async_op_t> batch;
+    batch.swap(pending);
+    run_batch(batch);
+}
+
+// Helper that runs a batch of operations. Operations on files of the same
+// directory are run together; each directory is handled on its own so a
+// batch never holds more than one directory lock.
+void FileSys::run_batch(vector<async_op_t> &batch) {
+    IoCommand io_command("submit");
+    ReadLock tree_lock(vol.namespace_lock);
+    
+    map<short, vector<async_op_t *> > groups;
+    for (size_t i = 0; i < batch.size(); i++) {
+        groups[batch[i].dir_block].push_back(&batch[i]);
+    }
+    for (map<short, vector<async_op_t *> >::iterator it = groups.begin();
+         it != groups.end(); ++it) {
+        run_group(it->first, it->second);
+    }
+}
+
+// Helper that runs the operations on files of one directory, in order.
+// The inodes they touch are read in one disk batch, then the data blocks
+// they read or extend in another; the operations run on these copies
+// and every changed block is written back in a final batch.
+void FileSys::run_group(short dir_block, vector<async_op_t *> &ops) {
+    ReadLock dir_lock(vol.block_lock(dir_block));
+    Transaction tx(bfs);
     dirblock_t dir;
     bfs.read_block(dir_block, &dir);
     
-    // Count non-empty entries
-    int count = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir.dir_entries[i].block_num != 0) {
-            count++;
+    vector<io_result_t> results(ops.size());
+    vector<short> inode_of(ops.size(), 0);
+    map<short, bool> written;	// inodes touched, and whether appended to
+    for (size_t i = 0; i < ops.size(); i++) {
+        short block_num;
+        unsigned char type;
+        results[i].status = IO_OK;
+        if (dir_find(dir, ops[i]->name.c_str(), block_num, type) == -1) {
+            results[i].status = IO_NOT_FOUND;
+        } else if (type != DIR_ENTRY_FILE) {
+            results[i].status = IO_IS_DIR;
+        } else {
+            inode_of[i] = block_num;
+            written[block_num] = written[block_num] || ops[i]->append;
         }
     }
     
-    int current = 0;
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir.dir_entries[i].block_num != 0) {
-            current++;
-            bool is_last_entry = (current == count);
-            
-            cout << prefix;
-            cout << (is_last_entry ? "└── " : "├── ");
-            cout << dir.dir_entries[i].name;
+    // lock the inodes in block order, as concurrent batches do
+    vector<short> inode_nums;
+    for (map<short, bool>::iterator it = written.begin(); it != written.end(); ++it) {
+        if (it->second) {
+            vol.block_lock(it->first).write_lock();
+        } else {
+            vol.block_lock(it->first).read_lock();
+        }
+        inode_nums.push_back(it->first);
+    }
+    
+    vector<inode_t> inode_buf(inode_nums.size());
+    bfs.read_blocks(inode_nums.data(), inode_nums.size(), inode_buf.data());
+    map<short, inode_t> inodes;
+    for (size_t i = 0; i < inode_nums.size(); i++) {
+        inodes[inode_nums[i]] = inode_buf[i];
+    }
+    
+    // reads need every data block, appends only the last one
+    vector<short> data_nums;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (inode_of[i] == 0) {
+            continue;
+        }
+        const inode_t &inode = inodes[inode_of[i]];
+        int last = -1;
+        for (int j = 0; j < MAX_DATA_BLOCKS; j++) {
+            if (inode.blocks[j] != 0) {
+                if (!ops[i]->append) {
+                    data_nums.push_back(inode.blocks[j]);
+                }
+                last = j;
+            }
+        }
+        if (ops[i]->append && last >= 0) {
+            data_nums.push_back(inode.blocks[last]);
+        }
+    }
+    
+    vector<datablock_t> data_buf(data_nums.size());
+    bfs.read_blocks(data_nums.data(), data_nums.size(), data_buf.data());
+    map<short, datablock_t> blocks;
+    for (size_t i = 0; i < data_nums.size(); i++) {
+        blocks[data_nums[i]] = data_buf[i];
+    }
+    
+    // run the operations on the copies
+    set<short> dirty;
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (inode_of[i] == 0) {
+            continue;
+        }
+        inode_t &inode = inodes[inode_of[i]];
+        
+        if (ops[i]->append) {
+            // stage the change so a failed append leaves nothing behind
+            inode_t staged = inode;
+            map<short, datablock_t> changed;
+            vector<short> new_blocks;
+            for (int j = MAX_DATA_BLOCKS - 1; j >= 0; j--) {
+                if (inode.blocks[j] != 0) {
+                    changed[inode.blocks[j]] = blocks[inode.blocks[j]];
+                    break;
+                }
+            }
+            if (ops[i]->bytes != NULL) {
+                results[i].status = append_staged(staged, ops[i]->bytes, ops[i]->size,
+                                                  changed, new_blocks);
+            } else {
+                results[i].status = append_staged(staged, ops[i]->data.data(),
+                                                  ops[i]->data.size(), changed, new_blocks);
+            }
+            if (results[i].status != IO_OK) {
+                if (!new_blocks.empty()) {
+                    bfs.reclaim_blocks(&new_blocks[0], new_blocks.size());
+                }
+                continue;
+            }
+            inode = staged;
+            dirty.insert(inode_of[i]);
+            for (map<short, datablock_t>::iterator it = changed.begin(); it != changed.end(); ++it) {
+                blocks[it->first] = it->second;
+                dirty.insert(it->first);
+            }
+        } else {
+            unsigned int bytes_left = inode.size;
+            for (int j = 0; j < MAX_DATA_BLOCKS && bytes_left > 0; j++) {
+                if (inode.blocks[j] != 0) {
+                    unsigned int bytes = (bytes_left > BLOCK_SIZE) ? BLOCK_SIZE : bytes_left;
+                    results[i].data.append(blocks[inode.blocks[j]].data, bytes);
+                    bytes_left -= bytes;
+                }
+            }
+        }
+    }
+    
+    // write back every changed block in one batch per kind, and commit
+    // before the inodes are unlocked and the results are published
+    vector<short> inode_dirty, data_dirty;
+    vector<datablock_t> inode_buf_out, data_buf_out;
+    for (set<short>::iterator it = dirty.begin(); it != dirty.end(); ++it) {
+        if (inodes.count(*it) != 0) {
+            datablock_t block;
+            memcpy(&block, &inodes[*it], sizeof(inode_t));
+            inode_dirty.push_back(*it);
+            inode_buf_out.push_back(block);
+        } else {
+            data_dirty.push_back(*it);
+            data_buf_out.push_back(blocks[*it]);
+        }
+    }
+    bfs.write_data_blocks(data_dirty.data(), data_dirty.size(), data_buf_out.data());
+    bfs.write_blocks(inode_dirty.data(), inode_dirty.size(), inode_buf_out.data());
+    tx.commit();
+    
+    for (size_t i = 0; i < inode_nums.size(); i++) {
+        vol.block_lock(inode_nums[i]).unlock();
+    }
+    for (size_t i = 0; i < ops.size(); i++) {
+        ops[i]->result.set_value(results[i]);
+    }
+}
+
+// Helper that appends data_len bytes of data to an in-memory inode. The
+// last data block must be in blocks, which receives every block changed
+// or added; every block allocated is listed in new_blocks.
+io_status_t FileSys::append_staged(inode_t &inode, const char *data,
+                                   unsigned int data_len,
+                                   map<short, datablock_t> &blocks,
+                                   vector<short> &new_blocks) {
+    // Check if append would exceed maximum file size
+    if (inode.size + data_len > MAX_FILE_SIZE) {
+        return IO_TOO_LARGE;
+    }
+    
+    unsigned int data_pos = 0;
+    
+    // Find last block with data
+    int last_block_index = -1;
+    for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (inode.blocks[i] != 0) {
+            last_block_index = i;
+        }
+    }
+    
+    // If file has data, try to fill the last block first
+    if (last_block_index >= 0) {
+        datablock_t &last_block = blocks[inode.blocks[last_block_index]];
+        
+        unsigned int bytes_in_last_block = inode.size % BLOCK_SIZE;
+        if (bytes_in_last_block == 0) {
+            bytes_in_last_block = BLOCK_SIZE;
+        }
+        
+        unsigned int space_left = BLOCK_SIZE - bytes_in_last_block;
+        if (space_left > 0) {
+            unsigned int bytes_to_copy = (data_len < space_left) ? data_len : space_left;
+            memcpy(&last_block.data[bytes_in_last_block], data, bytes_to_copy);
             
-            if (is_directory(dir.dir_entries[i].block_num)) {
-                cout << "/";
+            data_pos += bytes_to_copy;
+            inode.size += bytes_to_copy;
+        }
+    }
+    
+    // Append remaining data in new blocks
+    while (data_pos < data_len) {
+        // Find next free slot in inode
+        int free_slot = -1;
+        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] == 0) {
+                free_slot = i;
+                break;
+            }
+        }
+        
+        if (free_slot == -1) {
+            return IO_TOO_LARGE;
+        }
+        
+        // Get new data block
+        short new_block = bfs.get_free_block();
+        if (new_block == 0) {
+            return IO_DISK_FULL;
+        }
+        new_blocks.push_back(new_block);
+        
+        // Fill the new block, clearing the rest of it
+        datablock_t &new_data_block = blocks[new_block];
+        unsigned int bytes_left = data_len - data_pos;
+        unsigned int bytes_to_copy = (bytes_left < BLOCK_SIZE) ? bytes_left : BLOCK_SIZE;
+        
+        memcpy(new_data_block.data, &data[data_pos], bytes_to_copy);
+        memset(&new_data_block.data[bytes_to_copy], 0, BLOCK_SIZE - bytes_to_copy);
+        
+        inode.blocks[free_slot] = new_block;
+        
+        data_pos += bytes_to_copy;
+        inode.size += bytes_to_copy;
+    }
+    return IO_OK;
+}
+
+// Helper that waits for every submitted batch to finish
+void FileSys::wait_batches() {
+    for (size_t i = 0; i < batches.size(); i++) {
+        batches[i].wait();
+    }
+    batches.clear();
+}
+
+// Helper that writes a directory block and drops its cached listing
+void FileSys::write_dir(short block_num, dirblock_t &dir) {
+    bfs.write_block(block_num, &dir);
+    vol.forget_listing(block_num);
+}
+
+// Helper that appends every block of the file or directory tree at
+// block_num to blocks and drops the tree's entries from the name index
+void FileSys::collect_blocks(short block_num, unsigned char type, vector<short> &blocks) {
+    if (type == DIR_ENTRY_FILE) {
+        inode_t inode;
+        bfs.read_block(block_num, &inode);
+        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] != 0) {
+                blocks.push_back(inode.blocks[i]);
+            }
+        }
+    } else {
+        dirblock_t dir;
+        bfs.read_block(block_num, &dir);
+        int offset = 0;
+        dir_entry_t entry;
+        while (dir_next(dir, offset, entry)) {
+            index_remove(entry.name, block_num, entry.block_num);
+            collect_blocks(entry.block_num, entry.type, blocks);
+        }
+        vol.forget_listing(block_num);
+    }
+    blocks.push_back(block_num);
+}
+
+// Helper that reads the directories and inodes of the tree at block_num
+// into meta and returns the number of blocks a copy of it needs
+int FileSys::plan_copy(short block_num, unsigned char type, map<short, datablock_t> &meta) {
+    datablock_t &block = meta[block_num];
+    bfs.read_block(block_num, &block);
+    
+    int needed = 1;
+    if (type == DIR_ENTRY_FILE) {
+        inode_t inode;
+        memcpy(&inode, &block, sizeof(inode));
+        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] != 0) {
+                needed++;
+            }
+        }
+    } else {
+        dirblock_t dir;
+        memcpy(&dir, &block, sizeof(dir));
+        int offset = 0;
+        dir_entry_t entry;
+        while (dir_next(dir, offset, entry)) {
+            needed += plan_copy(entry.block_num, entry.type, meta);
+        }
+    }
+    return needed;
+}
+
+// Helper that appends the name of every file and directory below the
+// tree at block_num to names
+void FileSys::tree_names(short block_num, unsigned char type, vector<string> &names) {
+    if (type == DIR_ENTRY_FILE) {
+        return;
+    }
+    dirblock_t dir;
+    bfs.read_block(block_num, &dir);
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        names.push_back(entry.name);
+        tree_names(entry.block_num, entry.type, names);
+    }
+}
+
+// Helper that copies the tree at block_num into blocks taken in order
+// from blocks[next...]. Returns the block of the copy. The data blocks
+// of each file are read as one batch and written as one batch. Nothing
+// refers to the copy until the caller links it into a directory, so its
+// directories and inodes are written like data blocks: they reach the
+// disk before that directory commits, and only the directory is logged.
+short FileSys::copy_tree(short block_num, unsigned char type, short parent,
+                         map<short, datablock_t> &meta, const vector<short> &blocks, int &next) {
+    short new_block = blocks[next++];
+    
+    if (type == DIR_ENTRY_FILE) {
+        inode_t inode;
+        memcpy(&inode, &meta[block_num], sizeof(inode));
+        vector<short> src_nums;
+        vector<short> dest_nums;
+        for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] != 0) {
+                src_nums.push_back(inode.blocks[i]);
+                inode.blocks[i] = blocks[next++];
+                dest_nums.push_back(inode.blocks[i]);
+            }
+        }
+        if (!src_nums.empty()) {
+            vector<datablock_t> data(src_nums.size());
+            bfs.read_blocks(src_nums.data(), src_nums.size(), data.data());
+            bfs.write_data_blocks(dest_nums.data(), dest_nums.size(), data.data());
+        }
+        bfs.write_data_block(new_block, &inode);
+    } else {
+        dirblock_t src_dir;
+        memcpy(&src_dir, &meta[block_num], sizeof(src_dir));
+        
+        dirblock_t new_dir;
+        dir_init(new_dir, parent);
+        
+        int offset = 0;
+        dir_entry_t entry;
+        while (dir_next(src_dir, offset, entry)) {
+            short child = copy_tree(entry.block_num, entry.type, new_block, meta, blocks, next);
+            dir_insert(new_dir, entry.name, entry.type, child);
+            index_add(entry.name, new_block, child);
+        }
+        bfs.write_data_block(new_block, &new_dir);
+    }
+    return new_block;
+}
+
+// manage the name index
+io_status_t FileSys::index(const char *op) {
+    IoCommand io_command("index");
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+    string cmd(op);
+
+    if (cmd == "on" || cmd == "rebuild") {
+        if (cmd == "on" && name_index.enabled()) {
+            return IO_INDEX_ON;
+        }
+        name_index.drop();
+        if (!name_index.create() || !index_rebuild(1)) {
+            name_index.drop();
+            return IO_DISK_FULL;
+        }
+        name_index.publish();
+    } else if (cmd == "off") {
+        name_index.drop();
+    } else if (cmd == "status") {
+        if (!name_index.enabled()) {
+            cout << "Name index: off" << endl;
+            return IO_OK;
+        }
+        int num_records, num_blocks;
+        name_index.usage(num_records, num_blocks);
+        cout << "Name index: on, " << num_records << " names in "
+             << num_blocks << " blocks" << endl;
+    } else {
+        return IO_BAD_OP;
+    }
+    return IO_OK;
+}
+
+// manage snapshots of the volume. A rollback puts the tree back as it
+// was, so this session returns to the root directory.
+io_status_t FileSys::snapshot(const char *op, const char *name) {
+    IoCommand io_command("snapshot");
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+    string cmd(op);
+
+    if (cmd == "list") {
+        vector<snap_info_t> infos;
+        vol.snapshots.list(infos);
+        if (infos.empty()) {
+            cout << "No snapshots" << endl;
+        }
+        for (size_t i = 0; i < infos.size(); i++) {
+            cout << infos[i].name << ": " << infos[i].copied << " blocks copied";
+            if (infos[i].invalid) {
+                cout << " (invalid)";
             }
             cout << endl;
-            
-            // If it's a directory, recurse
-            if (is_directory(dir.dir_entries[i].block_num)) {
-                string new_prefix = prefix + (is_last_entry ? "    " : "│   ");
-                tree_recursive(dir.dir_entries[i].block_num, new_prefix, is_last_entry);
+        }
+        return IO_OK;
+    }
+
+    snap_status_t status;
+    if (cmd == "create") {
+        status = vol.snapshots.create(name);
+    } else if (cmd == "delete") {
+        status = vol.snapshots.remove(name);
+    } else if (cmd == "rollback") {
+        status = vol.snapshots.rollback(name);
+        if (status == SNAP_OK) {
+            tx.commit();
+            vol.forget_listings();
+            vol.read_ahead.clear();
+            name_index.load();
+            curr_dir = ROOT_BLOCK;
+        }
+    } else {
+        return IO_BAD_OP;
+    }
+
+    switch (status) {
+    case SNAP_EXISTS:
+        return IO_SNAP_EXISTS;
+    case SNAP_NOT_FOUND:
+        return IO_SNAP_NOT_FOUND;
+    case SNAP_TOO_MANY:
+        return IO_SNAP_TOO_MANY;
+    case SNAP_NAME_TOO_LONG:
+        return IO_SNAP_NAME_TOO_LONG;
+    case SNAP_DISK_FULL:
+        return IO_DISK_FULL;
+    case SNAP_INVALID:
+        return IO_SNAP_INVALID;
+    case SNAP_TOO_LARGE:
+        return IO_TXN_TOO_LARGE;
+    default:
+        return IO_OK;
+    }
+}
+
+// check the volume and repair its bitmap
+void FileSys::fsck() {
+    IoCommand io_command("fsck");
+    WriteLock tree_lock(vol.namespace_lock);
+    Transaction tx(bfs);
+
+    fsck_report_t report;
+    vol.fsck(true, report);
+    print_fsck(report);
+}
+
+// show the extents of fragmented files and the free runs of the disk
+void FileSys::frag() {
+    IoCommand io_command("frag");
+    ReadLock tree_lock(vol.namespace_lock);
+
+    frag_report_t report;
+    Defrag defrag(bfs);
+    defrag.report(report);
+    for (size_t i = 0; i < report.fragmented.size(); i++) {
+        const frag_file_t &file = report.fragmented[i];
+        cout << file.path << ": " << file.blocks << " blocks in "
+             << file.extents << " extents" << endl;
+    }
+    cout << report.files << " files, " << report.data_blocks
+         << " data blocks in " << report.extents << " extents, "
+         << report.fragmented.size() << " fragmented" << endl;
+    cout << report.free_blocks << " free blocks in " << report.free_runs
+         << " runs, largest run " << report.largest_free_run << " blocks" << endl;
+}
+
+// move the data blocks of fragmented files into contiguous runs. Each
+// step holds the tree exclusively and moves at most DEFRAG_STEP_BLOCKS
+// blocks; other sessions run between steps. Blocks shared with a
+// snapshot would only be copied for it, so snapshots rule defrag out.
+void FileSys::defrag(unsigned long max_steps) {
+    IoCommand io_command("defrag");
+    Defrag defrag(bfs);
+    defrag_step_t total = {0, 0, 0};
+    unsigned long steps = 0;
+    bool more = true;
+
+    while (more && (max_steps == 0 || steps < max_steps)) {
+        WriteLock tree_lock(vol.namespace_lock);
+        if (steps == 0) {
+            vector<snap_info_t> infos;
+            vol.snapshots.list(infos);
+            if (!infos.empty()) {
+                cout << "Cannot defragment while snapshots exist" << endl;
+                return;
+            }
+        }
+        defrag_step_t result;
+        more = defrag.step(result);
+        steps++;
+        total.files_moved += result.files_moved;
+        total.blocks_moved += result.blocks_moved;
+        total.no_room = result.no_room;
+    }
+
+    cout << "Moved " << total.blocks_moved << " blocks of " << total.files_moved
+         << " files in " << steps << (steps == 1 ? " step" : " steps") << endl;
+    if (total.no_room > 0) {
+        cout << total.no_room << " files have no free run large enough" << endl;
+    }
+    if (more) {
+        cout << "Fragmented files are left; run defrag again" << endl;
+    }
+}
+
+// punch every free block out of the disk image. Freed blocks are punched
+// as they are freed; this catches the rest (blocks never used since the
+// disk was formatted, or freed by fsck or a rollback).
+void FileSys::trim() {
+    IoCommand io_command("trim");
+    WriteLock tree_lock(vol.namespace_lock);
+
+    int runs;
+    int punched = bfs.trim(runs);
+    cout << "Trimmed " << punched << " free blocks in " << runs << " runs" << endl;
+}
+
+// Helper that prints what a check found and fixed
+void FileSys::print_fsck(const fsck_report_t &report) {
+    cout << report.directories << " directories, " << report.files
+         << " files, " << report.blocks_used << " blocks in use" << endl;
+    if (report.orphaned > 0) {
+        cout << "Orphaned blocks freed: " << report.orphaned << endl;
+    }
+    if (report.unmarked > 0) {
+        cout << "Blocks in use marked free: " << report.unmarked
+             << " (now marked used)" << endl;
+    }
+    for (size_t i = 0; i < report.problems.size(); i++) {
+        cout << report.problems[i] << endl;
+    }
+    if (report.orphaned == 0 && report.unmarked == 0 && report.problems.empty()) {
+        cout << "No problems found" << endl;
+    }
+}
+
+// Helper that adds every entry below dir_block to the name index and
+// repairs the parent links of subdirectories. Returns false if the disk
+// fills up.
+bool FileSys::index_rebuild(short dir_block) {
+    dirblock_t dir;
+    bfs.read_block(dir_block, &dir);
+
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        if (!name_index.insert(entry.name, dir_block, entry.block_num)) {
+            return false;
+        }
+
+        if (entry.type == DIR_ENTRY_DIR) {
+            dirblock_t sub;
+            bfs.read_block(entry.block_num, &sub);
+            if (sub.parent != dir_block) {
+                sub.parent = dir_block;
+                write_dir(entry.block_num, sub);
+            }
+            if (!index_rebuild(entry.block_num)) {
+                return false;
             }
         }
     }
+    return true;
+}
+
+// Helper that records a new entry in the name index. An index that
+// cannot grow is dropped rather than left incomplete; index status then
+// shows it is off.
+void FileSys::index_add(const char *name, short parent, short block_num) {
+    if (!name_index.insert(name, parent, block_num)) {
+        name_index.drop();
+    }
+}
+
+// Helper that forgets a removed entry in the name index
+void FileSys::index_remove(const char *name, short parent, short block_num) {
+    name_index.remove(name, parent, block_num);
+}
+
+// Helper that resolves all but the last component of path, which may be
+// absolute or relative to the current directory, to a directory block.
+// Sets leaf to the last component ("" for "/"). Returns false if a
+// component does not exist or is not a directory.
+bool FileSys::resolve_parent(const char *path, short &dir_block, string &leaf) {
+    string p(path);
+    dir_block = (!p.empty() && p[0] == '/') ? ROOT_BLOCK : curr_dir;
+    
+    vector<string> parts;
+    size_t start = 0;
+    while (start <= p.length()) {
+        size_t end = p.find('/', start);
+        if (end == string::npos) {
+            end = p.length();
+        }
+        if (end > start) {
+            parts.push_back(p.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    
+    leaf = parts.empty() ? "" : parts.back();
+    for (size_t i = 0; i + 1 < parts.size(); i++) {
+        if (!step_dir(dir_block, parts[i], dir_block)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper that follows one path component ("." and ".." included) from
+// directory dir_block. Returns false if it is not a directory.
+bool FileSys::step_dir(short dir_block, const string &name, short &next) {
+    dirblock_t dir;
+    bfs.read_block(dir_block, &dir);
+    
+    if (name == ".") {
+        next = dir_block;
+        return true;
+    }
+    if (name == "..") {
+        next = (dir_block == ROOT_BLOCK) ? ROOT_BLOCK : dir.parent;
+        return true;
+    }
+    
+    short block_num;
+    unsigned char type;
+    if (dir_find(dir, name.c_str(), block_num, type) == -1 || type != DIR_ENTRY_DIR) {
+        return false;
+    }
+    next = block_num;
+    return true;
+}
+
+// Helper that checks whether directory ancestor is dir_block or one of
+// the directories above it
+bool FileSys::is_ancestor(short ancestor, short dir_block) {
+    for (int depth = 0; depth < NUM_BLOCKS; depth++) {
+        if (dir_block == ancestor) {
+            return true;
+        }
+        if (dir_block == ROOT_BLOCK) {
+            return false;
+        }
+        dirblock_t dir;
+        bfs.read_block(dir_block, &dir);
+        dir_block = dir.parent;
+    }
+    return false;
+}
+
+// Helper that builds the absolute path of a directory from parent links.
+// Returns "" if the chain is broken: a block on it is no longer a
+// directory or is not listed by its parent.
+string FileSys::dir_path(short dir_block) {
+    string path;
+    for (int depth = 0; dir_block != ROOT_BLOCK; depth++) {
+        dirblock_t dir;
+        bfs.read_block(dir_block, &dir);
+        if (depth == NUM_BLOCKS || dir.magic != DIR_MAGIC_NUM) {
+            return "";
+        }
+        short parent = dir.parent;
+        
+        dirblock_t parent_dir;
+        bfs.read_block(parent, &parent_dir);
+        string name = entry_name(parent_dir, dir_block);
+        if (parent_dir.magic != DIR_MAGIC_NUM || name.empty()) {
+            return "";
+        }
+        path = "/" + name + path;
+        dir_block = parent;
+    }
+    return path.empty() ? "/" : path;
+}
+
+// Helper that returns the path of the current directory as it is now,
+// so a session sees a move made by another one. A current directory
+// that another session removed is left for the root. The caller holds
+// the namespace lock.
+string FileSys::current_path() {
+    string path = dir_path(curr_dir);
+    if (path.empty()) {
+        curr_dir = ROOT_BLOCK;
+        path = "/";
+    }
+    return path;
+}
+
+// Helper that returns the name under which dir refers to block_num
+string FileSys::entry_name(const dirblock_t &dir, short block_num) {
+    dir_entry_t entry;
+    if (dir_find_block(dir, block_num, entry) == -1) {
+        return "";
+    }
+    return entry.name;
 }
 
 // show help information
@@ -880,21 +2300,34 @@ void FileSys::help() {
     cout << "  cd <dir>        - Change to directory" << endl;
     cout << "  home            - Change to root directory" << endl;
     cout << "  rmdir <dir>     - Remove empty directory" << endl;
-    cout << "  ls              - List directory contents" << endl;
+    cout << "  ls [-s]         - List directory contents (-s: sorted by name)" << endl;
     cout << "  create <file>   - Create empty file" << endl;
     cout << "  append <file> <data> - Append data to file" << endl;
     cout << "  cat <file>      - Display file contents" << endl;
+    cout << "  import <host-file> <file> - Copy a host file into a new file" << endl;
+    cout << "  export <file> <host-file> - Copy a file to a host file" << endl;
     cout << "  tail <file> <n> - Display last N bytes of file" << endl;
-    cout << "  rm <file>       - Delete file" << endl;
+    cout << "  rm [-r] <name>  - Delete file (-r: file or directory tree)" << endl;
     cout << "  stat <name>     - Display file/directory statistics" << endl;
     cout << "  pwd             - Print working directory" << endl;
     cout << "  df              - Display disk usage" << endl;
+    cout << "  cache           - Display block cache, read-ahead and writeback counters" << endl;
+    cout << "  iostat [op]     - Display block I/O counters (on, off, reset)" << endl;
+    cout << "  sync            - Write all changed blocks to disk" << endl;
+    cout << "  fsync <file>    - Write a file's changed blocks to disk" << endl;
     cout << "  head <file> <n> - Display first N bytes of file" << endl;
     cout << "  wc <file>       - Display word count (lines, words, bytes)" << endl;
-    cout << "  cp <src> <dest> - Copy file" << endl;
-    cout << "  mv <src> <dest> - Move/rename file" << endl;
+    cout << "  cp [-r] <src> <dest> - Copy file (-r: file or directory tree)" << endl;
+    cout << "  mv <src> <dest> - Move/rename file or directory (paths allowed)" << endl;
     cout << "  find <name>     - Find files/directories by name" << endl;
-    cout << "  tree            - Display directory tree" << endl;
+    cout << "  index <op>      - Manage the name index (on, off, rebuild, status)" << endl;
+    cout << "  snapshot <op> [name] - Manage snapshots (create, list, delete, rollback)" << endl;
+    cout << "  fsck            - Check the disk and repair its free block bitmap" << endl;
+    cout << "  frag            - Display file and free space fragmentation" << endl;
+    cout << "  defrag [steps]  - Make fragmented files contiguous" << endl;
+    cout << "  trim            - Return free blocks to the host" << endl;
+    cout << "  tree [-s]       - Display directory tree (-s: sorted by name)" << endl;
+    cout << "  <cmd> | <cmd>   - Pipe output (see help pipe)" << endl;
     cout << "  help [command]  - Show help (general or for specific command)" << endl;
     cout << "  quit            - Exit the shell" << endl;
 }
@@ -915,9 +2348,10 @@ void FileSys::help(const char *command) {
         cout << "rmdir <dir> - Remove empty directory" << endl;
         cout << "  Removes the specified directory. The directory must be empty." << endl;
     } else if (cmd == "ls") {
-        cout << "ls - List directory contents" << endl;
+        cout << "ls [-s] - List directory contents" << endl;
         cout << "  Lists all files and directories in the current directory." << endl;
         cout << "  Directories are shown with a trailing '/' character." << endl;
+        cout << "  With -s, entries are sorted by name." << endl;
     } else if (cmd == "create") {
         cout << "create <file> - Create empty file" << endl;
         cout << "  Creates a new empty file with the specified name." << endl;
@@ -928,12 +2362,22 @@ void FileSys::help(const char *command) {
     } else if (cmd == "cat") {
         cout << "cat <file> - Display file contents" << endl;
         cout << "  Displays the entire contents of the specified file." << endl;
+    } else if (cmd == "import") {
+        cout << "import <host-file> <file> - Copy a host file into a new file" << endl;
+        cout << "  Copies the host file byte for byte (NUL bytes included) and shows" << endl;
+        cout << "  how fast it went. The host path is opened by the process running" << endl;
+        cout << "  the command (the daemon for clients)." << endl;
+    } else if (cmd == "export") {
+        cout << "export <file> <host-file> - Copy a file to a host file" << endl;
+        cout << "  Creates or replaces the host file with the file's bytes and shows" << endl;
+        cout << "  how fast it went." << endl;
     } else if (cmd == "tail") {
         cout << "tail <file> <n> - Display last N bytes of file" << endl;
         cout << "  Displays the last N bytes of the specified file." << endl;
     } else if (cmd == "rm") {
-        cout << "rm <file> - Delete file" << endl;
+        cout << "rm [-r] <name> - Delete file" << endl;
         cout << "  Permanently deletes the specified file." << endl;
+        cout << "  With -r, also deletes a directory and everything below it." << endl;
     } else if (cmd == "stat") {
         cout << "stat <name> - Display file/directory statistics" << endl;
         cout << "  Shows detailed information about a file or directory." << endl;
@@ -943,6 +2387,27 @@ void FileSys::help(const char *command) {
     } else if (cmd == "df") {
         cout << "df - Display disk usage" << endl;
         cout << "  Shows filesystem usage statistics including total, used, and free blocks." << endl;
+    } else if (cmd == "cache") {
+        cout << "cache - Display block cache, read-ahead and writeback counters" << endl;
+        cout << "  Shows how many blocks are cached, cache hits and misses, how many" << endl;
+        cout << "  blocks were read ahead for sequential readers (head, tail, wc), and" << endl;
+        cout << "  how many changed blocks are waiting to be written to disk." << endl;
+    } else if (cmd == "iostat") {
+        cout << "iostat [op] - Display block I/O counters and latencies" << endl;
+        cout << "  Counts the blocks read and written by file system calls and by" << endl;
+        cout << "  disk transfers, by block type and by command, with a latency" << endl;
+        cout << "  histogram in power-of-two buckets. Counting is off until" << endl;
+        cout << "  'iostat on'; 'iostat off' stops it and 'iostat reset' zeroes the" << endl;
+        cout << "  counters. With FILESYS_IOSTAT=<file> set, counting starts at mount" << endl;
+        cout << "  and the counters are written to <file> on unmount." << endl;
+    } else if (cmd == "sync") {
+        cout << "sync - Write all changed blocks to disk" << endl;
+        cout << "  Changed blocks are normally written back in the background; sync" << endl;
+        cout << "  writes them all now." << endl;
+    } else if (cmd == "fsync") {
+        cout << "fsync <file> - Write a file's changed blocks to disk" << endl;
+        cout << "  Writes back the file's data blocks, its inode and its directory" << endl;
+        cout << "  entry now." << endl;
     } else if (cmd == "head") {
         cout << "head <file> <n> - Display first N bytes of file" << endl;
         cout << "  Displays the first N bytes of the specified file." << endl;
@@ -950,18 +2415,68 @@ void FileSys::help(const char *command) {
         cout << "wc <file> - Display word count" << endl;
         cout << "  Shows the number of lines, words, and bytes in the file." << endl;
     } else if (cmd == "cp") {
-        cout << "cp <src> <dest> - Copy file" << endl;
+        cout << "cp [-r] <src> <dest> - Copy file" << endl;
         cout << "  Creates a copy of the source file with the destination name." << endl;
+        cout << "  With -r, the source may be a directory and its whole tree is copied." << endl;
     } else if (cmd == "mv") {
-        cout << "mv <src> <dest> - Move/rename file" << endl;
-        cout << "  Renames the source file to the destination name." << endl;
+        cout << "mv <src> <dest> - Move/rename file or directory" << endl;
+        cout << "  Renames the source to the destination name. Both may be paths" << endl;
+        cout << "  (absolute, or relative with . and ..), and a destination that is" << endl;
+        cout << "  a directory receives the source under its own name." << endl;
     } else if (cmd == "find") {
         cout << "find <name> - Find files/directories by name" << endl;
         cout << "  Searches for files and directories with the specified name" << endl;
         cout << "  starting from the current directory and all subdirectories." << endl;
+        cout << "  Uses the name index when it is on." << endl;
+    } else if (cmd == "index") {
+        cout << "index <op> - Manage the name index" << endl;
+        cout << "  on      - build the index so find does not walk the tree" << endl;
+        cout << "  off     - drop the index and free its blocks" << endl;
+        cout << "  rebuild - rebuild the index from the directory tree" << endl;
+        cout << "  status  - show whether the index is on and its size" << endl;
+    } else if (cmd == "fsck") {
+        cout << "fsck - Check the disk and repair its free block bitmap" << endl;
+        cout << "  Walks the directory tree with several threads and counts the" << endl;
+        cout << "  references to every block. Orphaned blocks are freed and blocks" << endl;
+        cout << "  in use are marked used; blocks used twice and bad entries are" << endl;
+        cout << "  reported. Runs by itself at mount if the disk was not unmounted" << endl;
+        cout << "  cleanly." << endl;
+    } else if (cmd == "frag") {
+        cout << "frag - Display file and free space fragmentation" << endl;
+        cout << "  Lists every file whose data blocks are not in one run on the" << endl;
+        cout << "  disk, with its blocks and extents (runs of consecutive blocks)," << endl;
+        cout << "  then the totals for all files and the free runs of the disk." << endl;
+    } else if (cmd == "defrag") {
+        cout << "defrag [steps] - Make fragmented files contiguous" << endl;
+        cout << "  Moves the data blocks of each fragmented file into the lowest" << endl;
+        cout << "  free run that holds them and frees the old blocks. Works in steps" << endl;
+        cout << "  of at most " << DEFRAG_STEP_BLOCKS << " blocks, letting other sessions run in between;" << endl;
+        cout << "  with a number, stops after that many steps. Not available while" << endl;
+        cout << "  snapshots exist." << endl;
+    } else if (cmd == "trim") {
+        cout << "trim - Return free blocks to the host" << endl;
+        cout << "  Punches every free block out of the disk image file, so it reads" << endl;
+        cout << "  back as zeros and the image takes less space on the host. Blocks" << endl;
+        cout << "  freed by rm, rmdir and the like are punched as they are freed;" << endl;
+        cout << "  trim also covers blocks that were never used. Blocks a snapshot" << endl;
+        cout << "  still needs are kept." << endl;
+    } else if (cmd == "snapshot") {
+        cout << "snapshot <op> [name] - Manage snapshots of the whole disk" << endl;
+        cout << "  create <name>   - freeze the current tree; blocks are only copied" << endl;
+        cout << "                    when they are changed afterwards" << endl;
+        cout << "  list            - show each snapshot and the blocks copied for it" << endl;
+        cout << "  delete <name>   - delete a snapshot and free the blocks only it used" << endl;
+        cout << "  rollback <name> - put the tree back as it was when the snapshot" << endl;
+        cout << "                    was taken and go to the root directory" << endl;
     } else if (cmd == "tree") {
-        cout << "tree - Display directory tree" << endl;
+        cout << "tree [-s] - Display directory tree" << endl;
         cout << "  Shows the directory structure as a tree starting from current directory." << endl;
+        cout << "  With -s, entries are sorted by name." << endl;
+    } else if (cmd == "pipe") {
+        cout << "<cmd> | <cmd> ... - Pipe the output of a command into the next" << endl;
+        cout << "  Up to 8 commands. After the first, only these read the output" << endl;
+        cout << "  of the one before: cat, head <n>, tail <n>, wc and append <file>." << endl;
+        cout << "  Example: cat big | head 100 | wc" << endl;
     } else if (cmd == "help") {
         cout << "help [command] - Show help" << endl;
         cout << "  Shows general help or detailed help for a specific command." << endl;
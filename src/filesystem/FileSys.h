@@ -1,55 +1,188 @@
 // Computing Systems: File System
 // Implements the file system commands that are available to the shell.
+// A FileSys is one session (working directory and open cursors) on a
+// volume; several sessions may share a volume from different threads.
 
 #ifndef FILESYS_H
 #define FILESYS_H
 
+#include <future>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include "BasicFileSys.h"
+#include "Blocks.h"
+#include "Defrag.h"
+#include "Directory.h"
+#include "NameIndex.h"
+#include "Pipe.h"
+#include "Volume.h"
 
 using namespace std;
 
+// status of a file system operation
+enum io_status_t {
+  IO_OK,		// done
+  IO_NOT_FOUND,		// no such file
+  IO_IS_DIR,		// name is a directory
+  IO_TOO_LARGE,		// append exceeds maximum file size
+  IO_DISK_FULL,		// no free block
+  IO_EXISTS,		// name is taken
+  IO_NOT_DIR,		// name is not a directory
+  IO_NOT_EMPTY,		// directory is not empty
+  IO_NAME_TOO_LONG,	// name is longer than MAX_FNAME_SIZE
+  IO_DIR_FULL,		// no room in the directory for the entry
+  IO_INTO_ITSELF,	// directory moved into its own subtree
+  IO_FILE_TOO_LARGE,	// host file is larger than MAX_FILE_SIZE
+  IO_HOST_OPEN,		// host file could not be opened
+  IO_HOST_READ,		// host file could not be read
+  IO_HOST_WRITE,	// host file could not be written
+  IO_BAD_OP,		// unknown index, snapshot or iostat operation
+  IO_INDEX_ON,		// name index is on already
+  IO_SNAP_EXISTS,	// a snapshot has that name already
+  IO_SNAP_NOT_FOUND,	// no snapshot has that name
+  IO_SNAP_TOO_MANY,	// MAX_SNAPSHOTS snapshots exist
+  IO_SNAP_NAME_TOO_LONG, // snapshot name is longer than SNAP_NAME_SIZE
+  IO_SNAP_INVALID,	// snapshot lost a block it could not copy
+  IO_TXN_TOO_LARGE	// more metadata blocks than one transaction holds
+};
+
+// the message the shell prints for a status ("" for IO_OK). The host
+// file statuses are followed by the path of the host file, and
+// IO_BAD_OP by the command and operation.
+const char *io_message(io_status_t status);
+
+// what stat reports about a file or directory
+struct file_info_t {
+  bool is_dir;
+  short block_num;	// directory block or inode block
+  unsigned int size;	// bytes in the file (0 for directories)
+  int num_blocks;	// data blocks of the file
+  short first_block;	// first data block (0 if none)
+};
+
+// what an import or export moved
+struct transfer_info_t {
+  unsigned int bytes;	// bytes copied
+  double seconds;	// time it took
+};
+
+// result of an asynchronous file operation
+struct io_result_t {
+  io_status_t status;
+  string data;		// file contents (reads only)
+};
+
+// The operations that change the tree or read a file return a status and
+// print nothing; the display commands (ls, cat, tree, df, ...) print to
+// cout for the shell. Those that can fail return a status as well and
+// leave the message to the shell. The library libfilesys holds everything from here
+// down, so a program can embed the file system without the shell.
 class FileSys {
   
   public:
-    // mounts the file system
-    void mount();
+    // creates a session with a volume of its own
+    FileSys();
+
+    // creates a session on a volume shared with other sessions
+    FileSys(Volume &volume);
+
+    ~FileSys();
+
+    // mounts the file system. Returns false if the disk layout is not
+    // supported.
+    bool mount();
 
     // unmounts the file system
     void unmount();
 
     // make a directory
-    void mkdir(const char *name);
+    io_status_t mkdir(const char *name);
 
     // switch to a directory
-    void cd(const char *name);
+    io_status_t cd(const char *name);
     
     // switch to home directory
     void home();
     
     // remove a directory
-    void rmdir(const char *name);
+    io_status_t rmdir(const char *name);
 
     // list the contents of current directory
     void ls();
 
+    // list the contents of current directory, optionally sorted by name
+    void ls(bool sorted);
+
+    // open a cursor over the entries of directory name ("." for the
+    // current directory), in slot order or sorted by name. Returns the
+    // cursor or -1 on error.
+    int opendir(const char *name, bool sorted);
+
+    // copy up to max entries from the cursor into entries. Returns the
+    // number copied, 0 at the end of the directory, -1 for a bad cursor.
+    int readdir(int cursor, dir_entry_t *entries, int max);
+
+    // release a cursor
+    void closedir(int cursor);
+
     // create an empty data file
-    void create(const char *name);
+    io_status_t create(const char *name);
 
     // append data to a data file
-    void append(const char *name, const char *data);
+    io_status_t append(const char *name, const char *data);
+
+    // append size bytes of data (any bytes, NUL included) to a data file
+    io_status_t append(const char *name, const char *data, unsigned int size);
+
+    // append the bytes in a pipe to a data file
+    io_status_t append(const char *name, const Pipe &input);
+
+    // copy up to size bytes of a data file, starting at offset, into
+    // buffer. bytes_read is set to the number copied.
+    io_status_t read(const char *name, unsigned int offset, char *buffer,
+                     unsigned int size, unsigned int &bytes_read);
 
     // display the contents of a data file
-    void cat(const char *name);
+    io_status_t cat(const char *name);
+
+    // read a data file into a pipe
+    io_status_t cat(const char *name, Pipe &out);
+
+    // copy a file of the host into a new data file, byte for byte, and
+    // report what was copied in info
+    io_status_t import_file(const char *host_path, const char *name,
+                            transfer_info_t &info);
+
+    // copy a data file to a file of the host, byte for byte, and report
+    // what was copied in info
+    io_status_t export_file(const char *name, const char *host_path,
+                            transfer_info_t &info);
 
     // display the last N bytes of the file
-    void tail(const char *name, unsigned int n);
+    io_status_t tail(const char *name, unsigned int n);
+
+    // queue a read of a whole data file. The future is ready once the
+    // batch the read belongs to has run.
+    future<io_result_t> read_async(const char *name);
+
+    // queue an append to a data file
+    future<io_result_t> append_async(const char *name, const char *data);
+
+    // run the operations queued since the last submit as one batch on a
+    // background thread. Their block reads and writes are merged and
+    // issued to the disk together. Batches may complete in any order.
+    void submit();
 
     // delete a data file
-    void rm(const char *name);
+    io_status_t rm(const char *name);
+
+    // delete a data file, or with recursive a whole directory tree
+    io_status_t rm(const char *name, bool recursive);
 
-    // display stats about file or directory
-    void stat(const char *name);
+    // describe a file or directory
+    io_status_t stat(const char *name, file_info_t &info);
 
     // print working directory
     void pwd();
@@ -57,17 +190,36 @@ class FileSys {
     // show disk free space
     void df();
 
+    // show block cache, read-ahead and writeback counters
+    void cache();
+
+    // show the block I/O counters (op ""), or turn counting on or off, or
+    // zero the counters (op "on", "off", "reset")
+    io_status_t iostat(const char *op);
+
+    // write every changed block back to the disk
+    void sync();
+
+    // write a data file's changed blocks back to the disk
+    io_status_t fsync(const char *name);
+
     // show first N bytes of file
-    void head(const char *name, unsigned int n);
+    io_status_t head(const char *name, unsigned int n);
 
     // show word count (lines, words, bytes)
-    void wc(const char *name);
+    io_status_t wc(const char *name);
+
+    // show word count of the bytes in a pipe
+    void wc(const Pipe &input);
 
     // copy file
-    void cp(const char *src, const char *dest);
+    io_status_t cp(const char *src, const char *dest);
+
+    // copy file, or with recursive a whole directory tree
+    io_status_t cp(const char *src, const char *dest, bool recursive);
 
-    // move/rename file
-    void mv(const char *src, const char *dest);
+    // move/rename file or directory, possibly into another directory
+    io_status_t mv(const char *src, const char *dest);
 
     // find files/directories by name
     void find(const char *name);
@@ -75,21 +227,103 @@ class FileSys {
     // display directory tree
     void tree();
 
+    // display directory tree, optionally sorted by name
+    void tree(bool sorted);
+
+    // manage the name index (on, off, rebuild, status)
+    io_status_t index(const char *op);
+
+    // manage snapshots (create, list, delete, rollback). name is ignored
+    // by list.
+    io_status_t snapshot(const char *op, const char *name);
+
+    // check the volume and repair its bitmap
+    void fsck();
+
+    // show the extents of fragmented files and the free runs of the disk
+    void frag();
+
+    // move the data blocks of fragmented files into contiguous runs, in
+    // steps of bounded I/O; at most max_steps steps (0 - until done)
+    void defrag(unsigned long max_steps);
+
+    // punch every free block out of the disk image
+    void trim();
+
     // show help information
     void help();
     void help(const char *command);
 
   private:
-    BasicFileSys bfs;	// basic file system
-    short curr_dir;	// current directory
-    string current_path;  // track current directory path
+    Volume *own_volume;	// volume owned by this session (NULL if shared)
+    Volume &vol;	// volume the session works on
+    BasicFileSys &bfs;	// basic file system of the volume
+    NameIndex &name_index; // optional name to block index of the volume
+    short curr_dir;	// current directory; its path is built from
+			// parent links when needed, since another
+			// session may move it
+
+    // state of an open directory cursor
+    struct dir_cursor_t {
+      bool sorted_order;	// entries come from the sorted snapshot
+      dirblock_t dir;		// copy of the directory (slot order)
+      int offset;		// next entry offset in dir
+      shared_ptr<const vector<dir_entry_t> > sorted; // sorted snapshot
+      size_t pos;		// next entry in sorted
+    };
+    map<int, dir_cursor_t> cursors;	// open cursors by id
+    int next_cursor;			// id of the next cursor
+
+    // a queued asynchronous operation
+    struct async_op_t {
+      bool append;		// append (true) or read (false)
+      short dir_block;		// directory the name is looked up in
+      string name;		// file name
+      string data;		// data to append
+      const char *bytes;	// or the caller's buffer holding it (NULL
+      unsigned int size;	// if none) and its size
+      promise<io_result_t> result;
+    };
+    vector<async_op_t> pending;		// queued, not yet submitted
+    vector<future<void> > batches;	// submitted batches
 
     // Helper functions
-    int find_file(const char *name, short &block_num);
-    bool is_directory(short block_num);
-    bool is_file(short block_num);
+    int find_file(const char *name, short &block_num, unsigned char &type);
     void find_recursive(const char *name, short dir_block, const string& path);
-    void tree_recursive(short dir_block, const string& prefix, bool is_last);
+    void find_indexed(const char *name);
+    bool index_rebuild(short dir_block);
+    void index_add(const char *name, short parent, short block_num);
+    void index_remove(const char *name, short parent, short block_num);
+    void print_fsck(const fsck_report_t &report);
+    string entry_name(const dirblock_t &dir, short block_num);
+    bool resolve_parent(const char *path, short &dir_block, string &leaf);
+    bool step_dir(short dir_block, const string &name, short &next);
+    bool is_ancestor(short ancestor, short dir_block);
+    string dir_path(short dir_block);
+    string current_path();
+    void collect_blocks(short block_num, unsigned char type, vector<short> &blocks);
+    int plan_copy(short block_num, unsigned char type, map<short, datablock_t> &meta);
+    void tree_names(short block_num, unsigned char type, vector<string> &names);
+    short copy_tree(short block_num, unsigned char type, short parent,
+                    map<short, datablock_t> &meta, const vector<short> &blocks, int &next);
+    void tree_recursive(short dir_block, const string& prefix, bool sorted);
+    void tree_entry(const dir_entry_t &entry, const string& prefix, bool is_last_entry, bool sorted);
+    int open_cursor(short dir_block, bool sorted);
+    void write_dir(short block_num, dirblock_t &dir);
+    future<io_result_t> queue_op(bool append, const char *name, const char *data,
+                                 const char *bytes, unsigned int size);
+    void run_pending();
+    void run_batch(vector<async_op_t> &batch);
+    void run_group(short dir_block, vector<async_op_t *> &ops);
+    io_status_t append_staged(inode_t &inode, const char *data,
+                              unsigned int data_len,
+                              map<short, datablock_t> &blocks,
+                              vector<short> &new_blocks);
+    void wait_batches();
+
+    // not copyable
+    FileSys(const FileSys &);
+    FileSys &operator=(const FileSys &);
 };
 
 #endif 
@@ -0,0 +1,201 @@
+// Computing Systems: Fsck
+// Checks a volume against its bitmap, walking the directory tree with
+// several threads, and rebuilds the bitmap if asked to.
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "Fsck.h"
+#include "Directory.h"
+
+// true if block_num can be a directory, inode or data block below root
+static bool valid_block(short block_num)
+{
+    return block_num >= FIRST_FREE_BLOCK && block_num < NUM_BLOCKS;
+}
+
+Fsck::Fsck(BasicFileSys &bfs, NameIndex &name_index, Snapshots &snapshots)
+  : bfs(bfs), name_index(name_index), snapshots(snapshots), busy(0)
+{
+}
+
+// checks the volume and fills report, rebuilding the bitmap with repair
+void Fsck::run(bool repair, fsck_report_t &report)
+{
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        refs[b] = 0;
+    }
+    directories = 0;
+    files = 0;
+    problems.clear();
+
+    // walk the tree from the root
+    for (int b = 0; b < FIRST_FREE_BLOCK; b++) {
+        refs[b] = 1;
+    }
+    dir_item_t root;
+    root.block_num = ROOT_BLOCK;
+    root.path = "/";
+    queue.push_back(root);
+
+    vector<thread> threads;
+    for (int i = 0; i < FSCK_THREADS; i++) {
+        threads.push_back(thread(&Fsck::walk, this));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    // blocks outside the tree
+    vector<short> owned;
+    name_index.blocks(owned);
+    snapshots.owned_blocks(owned);
+    for (size_t i = 0; i < owned.size(); i++) {
+        if (valid_block(owned[i])) {
+            refs[owned[i]]++;
+        }
+    }
+
+    // compare the counts with the bitmap
+    report.directories = directories;
+    report.files = files;
+    report.blocks_used = 0;
+    report.orphaned = 0;
+    report.unmarked = 0;
+    report.shared = 0;
+    report.bad = problems.size();
+
+    superblock_t bits;
+    bfs.copy_bitmap(bits);
+    superblock_t rebuilt;
+    memset(&rebuilt, 0, sizeof(rebuilt));
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        bool used = (bits.bitmap[b / 8] >> (b % 8)) & 1;
+        int count = refs[b];
+        if (count > 0) {
+            rebuilt.bitmap[b / 8] |= 1 << (b % 8);
+            report.blocks_used++;
+        }
+        if (count > 1) {
+            report.shared++;
+            problems.push_back("Block " + to_string(b) + " is used " +
+                               to_string(count) + " times");
+        }
+        if (used && count == 0) {
+            report.orphaned++;
+        } else if (!used && count > 0) {
+            report.unmarked++;
+        }
+    }
+
+    if (repair && (report.orphaned > 0 || report.unmarked > 0)) {
+        bfs.restore_bitmap(rebuilt);
+    }
+
+    sort(problems.begin(), problems.end());
+    report.problems.swap(problems);
+}
+
+// HELPER FUNCTIONS
+
+// Takes directories from the queue until it is empty and no thread can
+// add more
+void Fsck::walk()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    for (;;) {
+        while (queue.empty() && busy > 0) {
+            queue_cv.wait(lock);
+        }
+        if (queue.empty()) {
+            return;
+        }
+
+        dir_item_t item = queue.front();
+        queue.pop_front();
+        busy++;
+        lock.unlock();
+        check_dir(item);
+        lock.lock();
+        busy--;
+        if (queue.empty() && busy == 0) {
+            queue_cv.notify_all();
+        }
+    }
+}
+
+// Counts the references in one directory: its subdirectories are queued,
+// and the inodes of its files are read as one batch and their data
+// blocks counted. A block already counted is not followed again, so a
+// directory that appears twice is walked once.
+void Fsck::check_dir(const dir_item_t &item)
+{
+    dirblock_t dir;
+    bfs.read_block(item.block_num, &dir);
+    if (dir.magic != DIR_MAGIC_NUM) {
+        problem(item.path + " (block " + to_string(item.block_num) +
+                ") is not a directory");
+        return;
+    }
+    directories++;
+
+    vector<short> inode_blocks;
+    vector<string> inode_paths;
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        string path = (item.path == "/" ? "" : item.path) + "/" + entry.name;
+        if (!valid_block(entry.block_num)) {
+            problem(path + " points at block " + to_string(entry.block_num));
+            continue;
+        }
+        if (refs[entry.block_num]++ > 0) {
+            continue;
+        }
+
+        if (entry.type == DIR_ENTRY_DIR) {
+            dir_item_t sub;
+            sub.block_num = entry.block_num;
+            sub.path = path;
+            lock_guard<mutex> guard(queue_mutex);
+            queue.push_back(sub);
+            queue_cv.notify_one();
+        } else {
+            inode_blocks.push_back(entry.block_num);
+            inode_paths.push_back(path);
+        }
+    }
+    if (inode_blocks.empty()) {
+        return;
+    }
+
+    vector<inode_t> inodes(inode_blocks.size());
+    bfs.read_blocks(inode_blocks.data(), inode_blocks.size(), inodes.data());
+    for (size_t i = 0; i < inodes.size(); i++) {
+        if (inodes[i].magic != INODE_MAGIC_NUM) {
+            problem(inode_paths[i] + " (block " + to_string(inode_blocks[i]) +
+                    ") is not an inode");
+            continue;
+        }
+        files++;
+        for (int j = 0; j < MAX_DATA_BLOCKS; j++) {
+            short data_block = inodes[i].blocks[j];
+            if (data_block == 0) {
+                continue;
+            }
+            if (!valid_block(data_block)) {
+                problem(inode_paths[i] + " points at block " + to_string(data_block));
+                continue;
+            }
+            refs[data_block]++;
+        }
+    }
+}
+
+// Records a bad entry or pointer
+void Fsck::problem(const string &text)
+{
+    lock_guard<mutex> guard(problem_mutex);
+    problems.push_back(text);
+}
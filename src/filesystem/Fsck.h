@@ -0,0 +1,80 @@
+// Computing Systems: Fsck
+// Checks a volume against its bitmap. Several threads walk the directory
+// tree at once, each taking the next directory from a shared queue, and
+// count every reference they find to a block. The name index and the
+// snapshots add the blocks they own. Blocks marked used that nothing
+// refers to (orphans) and blocks in use that are marked free can then be
+// fixed by rebuilding the bitmap from the counts. Blocks referred to more
+// than once and entries that point at something other than a directory
+// or inode are only reported.
+
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BasicFileSys.h"
+#include "NameIndex.h"
+#include "Snapshots.h"
+
+using namespace std;
+
+// threads that walk the tree
+const int FSCK_THREADS = 4;
+
+// What a check found
+struct fsck_report_t {
+  int directories;	// directories walked
+  int files;		// data files found
+  int blocks_used;	// blocks something refers to
+  int orphaned;		// marked used, nothing refers to them
+  int unmarked;		// referred to, marked free
+  int shared;		// referred to more than once
+  int bad;		// entries and pointers that could not be followed
+  vector<string> problems;	// one line per shared or bad block, sorted
+};
+
+class Fsck {
+
+  public:
+    Fsck(BasicFileSys &bfs, NameIndex &name_index, Snapshots &snapshots);
+
+    // checks the volume and fills report. With repair the bitmap is
+    // rebuilt if it is wrong. No command may run at the same time.
+    void run(bool repair, fsck_report_t &report);
+
+  private:
+    // a directory waiting to be walked
+    struct dir_item_t {
+      short block_num;
+      string path;
+    };
+
+    BasicFileSys &bfs;		// basic file system
+    NameIndex &name_index;	// its blocks are in use
+    Snapshots &snapshots;	// their blocks are in use
+    atomic<int> refs[NUM_BLOCKS];	// references found to each block
+    atomic<int> directories;	// directories walked
+    atomic<int> files;		// data files found
+    mutex queue_mutex;		// guards queue and busy
+    condition_variable queue_cv;	// signalled when work is added or done
+    deque<dir_item_t> queue;	// directories not walked yet
+    int busy;			// threads walking a directory
+    mutex problem_mutex;	// guards problems
+    vector<string> problems;	// bad entries found by the walk
+
+    // Helper functions
+    void walk();
+    void check_dir(const dir_item_t &item);
+    void problem(const string &text);
+
+    // not copyable
+    Fsck(const Fsck &);
+    Fsck &operator=(const Fsck &);
+};
+
+#endif
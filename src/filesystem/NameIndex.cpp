@@ -0,0 +1,383 @@
+// Computing Systems: Name Index
+// Keeps an optional on-disk hash from file name to the (parent directory,
+// block) pairs carrying that name, so lookups by name do not have to walk
+// the directory tree.
+
+#include <map>
+#include <set>
+#include "NameIndex.h"
+#include "Blocks.h"
+
+NameIndex::NameIndex(BasicFileSys &bfs)
+  : bfs(bfs), head_block(0), building(false)
+{
+}
+
+// reads the location of the index from the volume block
+void NameIndex::load()
+{
+    lock_guard<mutex> guard(index_mutex);
+    volblock_t vol;
+    bfs.read_block(VOLUME_BLOCK, &vol);
+
+    head_block = vol.index_block;
+    building = false;
+}
+
+// true if the index exists and must be maintained
+bool NameIndex::enabled() const
+{
+    lock_guard<mutex> guard(index_mutex);
+    return head_block != 0;
+}
+
+// creates an empty index, which is not published yet. Returns false if
+// the disk is full.
+bool NameIndex::create()
+{
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    short block_num = bfs.get_free_block();
+    if (block_num == 0) {
+        return false;
+    }
+
+    indexhead_t head;
+    head.magic = INDEX_MAGIC_NUM;
+    head.num_buckets = INDEX_BUCKETS;
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        head.buckets[i] = 0;
+    }
+    bfs.write_data_block(block_num, &head);
+
+    head_block = block_num;
+    building = true;
+    return true;
+}
+
+// records the index made by create in the volume block
+void NameIndex::publish()
+{
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    building = false;
+    set_head(head_block);
+}
+
+// frees every index block and disables the index. A damaged index may
+// point at blocks that belong to files, so a chain is only followed
+// while its blocks are in range, carry INDEX_MAGIC_NUM and have not
+// been seen before; what is left behind is found by fsck.
+void NameIndex::drop()
+{
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return;
+    }
+
+    indexhead_t head;
+    head.magic = 0;
+    if (head_block >= FIRST_FREE_BLOCK && head_block < NUM_BLOCKS) {
+        bfs.read_block(head_block, &head);
+    }
+
+    if (head.magic == INDEX_MAGIC_NUM) {
+        set<short> seen;
+        for (int i = 0; i < INDEX_BUCKETS; i++) {
+            short curr = head.buckets[i];
+            while (curr >= FIRST_FREE_BLOCK && curr < NUM_BLOCKS &&
+                   seen.insert(curr).second) {
+                indexblock_t block;
+                bfs.read_block(curr, &block);
+                if (block.magic != INDEX_MAGIC_NUM) {
+                    break;
+                }
+                bfs.reclaim_block(curr);
+                curr = block.next;
+            }
+        }
+        bfs.reclaim_block(head_block);
+    }
+
+    building = false;
+    set_head(0);
+}
+
+// adds a record for name. Returns false if the disk is full.
+bool NameIndex::insert(const char *name, short parent, short block_num)
+{
+    if (!enabled()) {
+        return true;
+    }
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return true;
+    }
+
+    unsigned int h = hash(name);
+    int bucket = h % INDEX_BUCKETS;
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+
+    // Reuse a free record anywhere in the bucket chain
+    short curr = head.buckets[bucket];
+    while (curr != 0) {
+        indexblock_t block;
+        bfs.read_block(curr, &block);
+
+        if (block.num_records < INDEX_RECORDS) {
+            for (int i = 0; i < INDEX_RECORDS; i++) {
+                if (block.records[i].block_num == 0) {
+                    block.records[i].hash = h >> 16;
+                    block.records[i].parent = parent;
+                    block.records[i].block_num = block_num;
+                    block.num_records++;
+                    write_index_block(curr, &block);
+                    return true;
+                }
+            }
+        }
+        curr = block.next;
+    }
+
+    // Chain is full: push a new block on the front of the bucket
+    short new_block = bfs.get_free_block();
+    if (new_block == 0) {
+        return false;
+    }
+
+    indexblock_t block;
+    block.magic = INDEX_MAGIC_NUM;
+    block.num_records = 1;
+    block.next = head.buckets[bucket];
+    for (int i = 0; i < INDEX_RECORDS; i++) {
+        block.records[i].hash = 0;
+        block.records[i].parent = 0;
+        block.records[i].block_num = 0;
+    }
+    block.records[0].hash = h >> 16;
+    block.records[0].parent = parent;
+    block.records[0].block_num = block_num;
+    write_index_block(new_block, &block);
+
+    head.buckets[bucket] = new_block;
+    write_index_block(head_block, &head);
+    return true;
+}
+
+// removes the record for name, if any
+void NameIndex::remove(const char *name, short parent, short block_num)
+{
+    if (!enabled()) {
+        return;
+    }
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return;
+    }
+
+    int bucket = hash(name) % INDEX_BUCKETS;
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+
+    short prev = 0;
+    short curr = head.buckets[bucket];
+    while (curr != 0) {
+        indexblock_t block;
+        bfs.read_block(curr, &block);
+
+        for (int i = 0; i < INDEX_RECORDS; i++) {
+            if (block.records[i].block_num == block_num &&
+                block.records[i].parent == parent) {
+                block.records[i].block_num = 0;
+                block.num_records--;
+
+                if (block.num_records > 0) {
+                    write_index_block(curr, &block);
+                    return;
+                }
+
+                // Block is empty: unlink it from the chain and free it
+                if (prev == 0) {
+                    head.buckets[bucket] = block.next;
+                    write_index_block(head_block, &head);
+                } else {
+                    indexblock_t prev_block;
+                    bfs.read_block(prev, &prev_block);
+                    prev_block.next = block.next;
+                    write_index_block(prev, &prev_block);
+                }
+                bfs.reclaim_block(curr);
+                return;
+            }
+        }
+        prev = curr;
+        curr = block.next;
+    }
+}
+
+// most index blocks that inserting or removing names writes. An update
+// only writes blocks of its name's bucket and the header, so the bound
+// is the header plus the chains of the buckets named, and for inserts
+// the blocks those chains grow by once their free records are used up.
+int NameIndex::update_blocks(const vector<string> &names, bool inserting)
+{
+    if (!enabled()) {
+        return 0;
+    }
+    bfs.lock_until_commit(update_mutex);
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return 0;
+    }
+
+    map<int, int> per_bucket;
+    for (size_t i = 0; i < names.size(); i++) {
+        per_bucket[hash(names[i].c_str()) % INDEX_BUCKETS]++;
+    }
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+
+    int total = 1;
+    for (map<int, int>::iterator it = per_bucket.begin();
+         it != per_bucket.end(); ++it) {
+        int free_records = 0;
+        short curr = head.buckets[it->first];
+        while (curr != 0) {
+            indexblock_t block;
+            bfs.read_block(curr, &block);
+            free_records += INDEX_RECORDS - block.num_records;
+            total++;
+            curr = block.next;
+        }
+        if (inserting && it->second > free_records) {
+            total += (it->second - free_records + INDEX_RECORDS - 1) / INDEX_RECORDS;
+        }
+    }
+    return total;
+}
+
+// collects every record whose name hashes like name. Callers must
+// confirm the name against the parent directory.
+void NameIndex::lookup(const char *name, vector<index_match_t> &matches)
+{
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return;
+    }
+
+    unsigned int h = hash(name);
+    unsigned short tag = h >> 16;
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+
+    short curr = head.buckets[h % INDEX_BUCKETS];
+    while (curr != 0) {
+        indexblock_t block;
+        bfs.read_block(curr, &block);
+
+        for (int i = 0; i < INDEX_RECORDS; i++) {
+            if (block.records[i].block_num != 0 &&
+                block.records[i].hash == tag) {
+                index_match_t match;
+                match.parent = block.records[i].parent;
+                match.block_num = block.records[i].block_num;
+                matches.push_back(match);
+            }
+        }
+        curr = block.next;
+    }
+}
+
+// counts records and blocks used by the index
+void NameIndex::usage(int &num_records, int &num_blocks)
+{
+    lock_guard<mutex> guard(index_mutex);
+    num_records = 0;
+    num_blocks = 0;
+    if (head_block == 0) {
+        return;
+    }
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+    num_blocks++;
+
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        short curr = head.buckets[i];
+        while (curr != 0) {
+            indexblock_t block;
+            bfs.read_block(curr, &block);
+            num_records += block.num_records;
+            num_blocks++;
+            curr = block.next;
+        }
+    }
+}
+
+// collects every block used by the index
+void NameIndex::blocks(vector<short> &block_nums)
+{
+    lock_guard<mutex> guard(index_mutex);
+    if (head_block == 0) {
+        return;
+    }
+
+    indexhead_t head;
+    bfs.read_block(head_block, &head);
+    block_nums.push_back(head_block);
+
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        short curr = head.buckets[i];
+        while (curr != 0) {
+            indexblock_t block;
+            bfs.read_block(curr, &block);
+            block_nums.push_back(curr);
+            curr = block.next;
+        }
+    }
+}
+
+// HELPER FUNCTIONS
+
+// FNV-1a hash of a file name. The low bits pick the bucket and the high
+// bits are kept in the record to skip most collisions without reading
+// the parent directory.
+unsigned int NameIndex::hash(const char *name)
+{
+    unsigned int h = 2166136261u;
+    for (const char *p = name; *p != '\0'; p++) {
+        h ^= (unsigned char) *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Writes an index block: as a data block while the index is being built,
+// else logged with the calling thread's transaction
+void NameIndex::write_index_block(short block_num, void *block)
+{
+    if (building) {
+        bfs.write_data_block(block_num, block);
+    } else {
+        bfs.write_block(block_num, block);
+    }
+}
+
+// Records the index header block in the volume block
+void NameIndex::set_head(short block_num)
+{
+    volblock_t vol;
+    bfs.read_block(VOLUME_BLOCK, &vol);
+    vol.index_block = block_num;
+    bfs.write_block(VOLUME_BLOCK, &vol);
+
+    head_block = block_num;
+}
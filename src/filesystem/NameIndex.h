@@ -0,0 +1,96 @@
+// Computing Systems: Name Index
+// Keeps an optional on-disk hash from file name to the (parent directory,
+// block) pairs carrying that name, so lookups by name do not have to walk
+// the directory tree.
+//
+// Index blocks are logged in the journal with the directory change that
+// goes with them, so a crash leaves both or neither. They are shared by
+// every directory, so a transaction that updates the index holds
+// update_mutex until it commits: no other transaction can change a copy
+// of a block that is still private to it. Lookups do not wait; they see
+// the index as last committed, or as the calling thread's own
+// transaction has changed it.
+//
+// A new index is built in blocks nothing refers to until the volume
+// block points to them, so they are written like data blocks, which
+// reach the disk before the transaction that publishes the index
+// commits; only the volume block is logged.
+
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BasicFileSys.h"
+
+using namespace std;
+
+// A single index record: the entry lives in directory parent and refers
+// to block block_num.
+struct index_match_t {
+  short parent;
+  short block_num;
+};
+
+class NameIndex {
+
+  public:
+    NameIndex(BasicFileSys &bfs);
+
+    // reads the location of the index from the volume block
+    void load();
+
+    // true if the index exists and must be maintained
+    bool enabled() const;
+
+    // creates an empty index. Returns false if the disk is full. Until
+    // publish is called the index is only in memory: its blocks are
+    // written as data blocks and the volume block does not point to it.
+    bool create();
+
+    // records the index made by create in the volume block
+    void publish();
+
+    // frees every index block and disables the index. Blocks of a
+    // damaged index that do not look like index blocks are left for fsck.
+    void drop();
+
+    // adds a record for name. Returns false if the disk is full. Does
+    // nothing if the index is disabled.
+    bool insert(const char *name, short parent, short block_num);
+
+    // removes the record for name, if any
+    void remove(const char *name, short parent, short block_num);
+
+    // most index blocks that inserting (or removing) names writes: the
+    // header, the blocks of the buckets they hash to and, for inserts,
+    // the blocks the buckets must grow by (0 if the index is disabled).
+    // Holds update_mutex until the calling thread's transaction commits,
+    // so the answer stays true.
+    int update_blocks(const vector<string> &names, bool inserting);
+
+    // collects every record whose name hashes like name. Callers must
+    // confirm the name against the parent directory.
+    void lookup(const char *name, vector<index_match_t> &matches);
+
+    // counts records and blocks used by the index
+    void usage(int &num_records, int &num_blocks);
+
+    // collects every block used by the index
+    void blocks(vector<short> &block_nums);
+
+  private:
+    BasicFileSys &bfs;	// basic file system
+    short head_block;	// index header block (0 - no index)
+    bool building;	// made by create and not published yet
+    mutable mutex index_mutex;	// serializes index updates and lookups
+    mutex update_mutex;	// held by the transaction updating the index
+
+    // Helper functions
+    static unsigned int hash(const char *name);
+    void set_head(short block_num);
+    void write_index_block(short block_num, void *block);
+};
+
+#endif
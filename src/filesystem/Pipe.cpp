@@ -0,0 +1,75 @@
+// Computing Systems: Pipe
+// The bytes one command of a shell pipeline hands to the next.
+
+#include <cstring>
+
+#include "Pipe.h"
+
+Pipe::Pipe() : start(0), end(0)
+{
+}
+
+// bytes in the pipe
+unsigned int Pipe::size() const
+{
+    return end - start;
+}
+
+// the bytes in the pipe, one after another
+const char *Pipe::data() const
+{
+    return blocks.empty() ? "" : (const char *) blocks.data() + start;
+}
+
+// empties the pipe, keeping its buffers
+void Pipe::clear()
+{
+    fill(0, 0);
+}
+
+// empties the pipe and returns count blocks to fill with bytes bytes
+datablock_t *Pipe::fill(int count, unsigned int bytes)
+{
+    blocks.resize(count);
+    start = 0;
+    end = bytes;
+    return blocks.data();
+}
+
+// drops all but the first n bytes
+void Pipe::keep_first(unsigned int n)
+{
+    if (n < size()) {
+        end = start + n;
+    }
+}
+
+// drops all but the last n bytes
+void Pipe::keep_last(unsigned int n)
+{
+    if (n < size()) {
+        start = end - n;
+    }
+}
+
+// adds a character printed to the pipe
+int Pipe::overflow(int c)
+{
+    if (c != traits_type::eof()) {
+        char ch = c;
+        xsputn(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+}
+
+// adds text printed to the pipe, growing it a block at a time
+streamsize Pipe::xsputn(const char *s, streamsize n)
+{
+    size_t needed = (end + n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > blocks.size()) {
+        blocks.resize(needed);
+    }
+    memcpy((char *) blocks.data() + end, s, n);
+    end += n;
+    return n;
+}
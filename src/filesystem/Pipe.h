@@ -0,0 +1,53 @@
+// Computing Systems: Pipe
+// The bytes one command of a shell pipeline hands to the next. They are
+// kept in block-sized buffers laid end to end, the way a file's data
+// blocks hold it, so a file is read straight into a pipe and a pipe is
+// appended to a file from where it lies. head and tail only move the
+// ends. Commands that print text write it through the pipe's stream
+// buffer (cout.rdbuf(&pipe)).
+
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <streambuf>
+#include <vector>
+#include "Blocks.h"
+
+using namespace std;
+
+class Pipe : public streambuf {
+
+  public:
+    Pipe();
+
+    // bytes in the pipe
+    unsigned int size() const;
+
+    // the bytes in the pipe, one after another
+    const char *data() const;
+
+    // empties the pipe
+    void clear();
+
+    // empties the pipe and returns count blocks to fill with bytes bytes
+    datablock_t *fill(int count, unsigned int bytes);
+
+    // drops all but the first or the last n bytes
+    void keep_first(unsigned int n);
+    void keep_last(unsigned int n);
+
+  protected:
+    int overflow(int c);
+    streamsize xsputn(const char *s, streamsize n);
+
+  private:
+    vector<datablock_t> blocks;	// buffers, back to back
+    unsigned int start;		// offset of the first byte
+    unsigned int end;		// offset past the last byte
+
+    // not copyable
+    Pipe(const Pipe &);
+    Pipe &operator=(const Pipe &);
+};
+
+#endif
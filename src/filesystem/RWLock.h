@@ -0,0 +1,51 @@
+// Computing Systems: Reader/writer locks
+// Wraps pthread reader/writer locks and provides scoped guards so that
+// every return path of a command releases what it took.
+
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <pthread.h>
+
+// Reader/writer lock
+class RWLock {
+
+  public:
+    RWLock() { pthread_rwlock_init(&lock, NULL); }
+    ~RWLock() { pthread_rwlock_destroy(&lock); }
+
+    void read_lock() { pthread_rwlock_rdlock(&lock); }
+    void write_lock() { pthread_rwlock_wrlock(&lock); }
+    void unlock() { pthread_rwlock_unlock(&lock); }
+
+  private:
+    pthread_rwlock_t lock;
+
+    // not copyable
+    RWLock(const RWLock &);
+    RWLock &operator=(const RWLock &);
+};
+
+// Holds a lock for reading until the end of the scope
+class ReadLock {
+
+  public:
+    explicit ReadLock(RWLock &lock) : lock(lock) { lock.read_lock(); }
+    ~ReadLock() { lock.unlock(); }
+
+  private:
+    RWLock &lock;
+};
+
+// Holds a lock for writing until the end of the scope
+class WriteLock {
+
+  public:
+    explicit WriteLock(RWLock &lock) : lock(lock) { lock.write_lock(); }
+    ~WriteLock() { lock.unlock(); }
+
+  private:
+    RWLock &lock;
+};
+
+#endif
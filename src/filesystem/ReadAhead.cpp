@@ -0,0 +1,83 @@
+// Computing Systems: Read-ahead
+// Recognizes files that are read block by block in order and has the
+// block cache read the next blocks of their block map before they are
+// needed.
+
+#include <vector>
+
+#include "ReadAhead.h"
+
+ReadAhead::ReadAhead(BasicFileSys &bfs)
+  : bfs(bfs), hits(0), misses(0)
+{
+}
+
+// notes that data block index of a file is about to be read and queues
+// the blocks that follow it when the file is read sequentially
+void ReadAhead::access(short inode_block, const inode_t &inode, int index)
+{
+    vector<short> ahead;
+    {
+        lock_guard<mutex> guard(lock);
+
+        map<short, stream_t>::iterator it = streams.find(inode_block);
+        if (it == streams.end()) {
+            stream_t stream = {0, 0, -1};
+            it = streams.insert(make_pair(inode_block, stream)).first;
+        }
+        stream_t &s = it->second;
+
+        if (index == s.next_index && index > 0) {
+            // sequential: double the window up to the limit
+            s.window = (s.window == 0) ? MIN_READ_AHEAD : s.window * 2;
+            if (s.window > MAX_READ_AHEAD) {
+                s.window = MAX_READ_AHEAD;
+            }
+            if (bfs.is_cached(inode.blocks[index])) {
+                hits++;
+            } else {
+                misses++;
+            }
+        } else if (index == 0) {
+            // reading from the start is the usual beginning of a run
+            s.window = MIN_READ_AHEAD;
+            s.prefetched_to = 0;
+        } else {
+            // random access: halve the window and restart from here
+            s.window /= 2;
+            s.prefetched_to = index;
+        }
+        s.next_index = index + 1;
+
+        // queue what the window covers and was not queued before
+        int first = (s.prefetched_to > index) ? s.prefetched_to + 1 : index + 1;
+        int last = index + s.window;
+        for (int i = first; i <= last && i < MAX_DATA_BLOCKS; i++) {
+            if (inode.blocks[i] != 0) {
+                ahead.push_back(inode.blocks[i]);
+            }
+        }
+        if (last > s.prefetched_to) {
+            s.prefetched_to = last;
+        }
+    }
+
+    if (!ahead.empty()) {
+        bfs.prefetch_blocks(&ahead[0], ahead.size());
+    }
+}
+
+// forgets every file
+void ReadAhead::clear()
+{
+    lock_guard<mutex> guard(lock);
+    streams.clear();
+}
+
+// reads of sequential runs that found their block cached or not
+void ReadAhead::get_counters(unsigned long &num_hits, unsigned long &num_misses)
+{
+    lock_guard<mutex> guard(lock);
+    num_hits = hits;
+    num_misses = misses;
+}
@@ -0,0 +1,52 @@
+// Computing Systems: Read-ahead
+// Recognizes files that are read block by block in order and has the
+// block cache read the next blocks of their block map before they are
+// needed.
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <map>
+#include <mutex>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+
+using namespace std;
+
+// smallest and largest number of blocks read ahead of a sequential reader
+const int MIN_READ_AHEAD = 2;
+const int MAX_READ_AHEAD = 16;
+
+class ReadAhead {
+
+  public:
+    ReadAhead(BasicFileSys &bfs);
+
+    // notes that data block index of the file whose inode is inode_block
+    // is about to be read. Reading the block after the previous one grows
+    // the window of blocks read ahead; a jump shrinks it.
+    void access(short inode_block, const inode_t &inode, int index);
+
+    // forgets every file
+    void clear();
+
+    // reads of sequential runs that found their block cached (hits) or
+    // had to wait for the disk (misses)
+    void get_counters(unsigned long &hits, unsigned long &misses);
+
+  private:
+    // read-ahead state of one file
+    struct stream_t {
+      int next_index;		// index a sequential reader reads next
+      int window;		// blocks to keep read ahead (0 - none)
+      int prefetched_to;	// last index already queued
+    };
+
+    BasicFileSys &bfs;		// basic file system
+    mutex lock;			// guards everything below
+    map<short, stream_t> streams;	// by inode block
+    unsigned long hits;
+    unsigned long misses;
+};
+
+#endif
@@ -0,0 +1,460 @@
+// Computing Systems: Snapshots
+// Point-in-time views of the whole volume, sharing blocks with the live
+// tree until it overwrites them.
+
+#include <cstring>
+#include <set>
+
+#include "Snapshots.h"
+
+// true if block_num is marked used in bits
+static bool bit_set(const superblock_t &bits, short block_num)
+{
+    return (bits.bitmap[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+// marks block_num used or free in bits
+static void set_bit(superblock_t &bits, short block_num, bool used)
+{
+    if (used) {
+        bits.bitmap[block_num / 8] |= 1 << (block_num % 8);
+    } else {
+        bits.bitmap[block_num / 8] &= ~(1 << (block_num % 8));
+    }
+}
+
+Snapshots::Snapshots(BasicFileSys &bfs)
+  : bfs(bfs), table_block(0), num_snaps(0)
+{
+}
+
+// reads the snapshot table named by the volume block, with each
+// snapshot's bitmap and remap chain
+void Snapshots::load()
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    snaps.clear();
+
+    volblock_t vol;
+    bfs.read_block(VOLUME_BLOCK, &vol);
+    table_block = vol.snap_table;
+
+    snaptable_t table;
+    if (table_block != 0) {
+        bfs.read_block(table_block, &table);
+    }
+    if (table_block == 0 || table.magic != SNAP_MAGIC_NUM) {
+        num_snaps = 0;
+        return;
+    }
+
+    for (unsigned int i = 0; i < table.num_snapshots && i < MAX_SNAPSHOTS; i++) {
+        snapshot_t snap;
+        snap.name = table.snapshots[i].name;
+        snap.bitmap_block = table.snapshots[i].bitmap_block;
+        snap.index_block = table.snapshots[i].index_block;
+        snap.invalid = table.snapshots[i].invalid != 0;
+        bfs.read_block(snap.bitmap_block, &snap.bits);
+        snap.remap.assign(NUM_BLOCKS, 0);
+        snap.tail_records = 0;
+        snap.copied = 0;
+
+        short curr = table.snapshots[i].remap_head;
+        while (curr != 0) {
+            snapremap_t block;
+            bfs.read_block(curr, &block);
+            for (int r = 0; r < block.num_records; r++) {
+                snap.remap[block.records[r].orig] = block.records[r].copy;
+            }
+            snap.remap_blocks.push_back(curr);
+            snap.tail_records = block.num_records;
+            snap.copied += block.num_records;
+            curr = block.next;
+        }
+        snaps.push_back(snap);
+    }
+    num_snaps = snaps.size();
+}
+
+// forgets every snapshot
+void Snapshots::clear()
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    snaps.clear();
+    table_block = 0;
+    num_snaps = 0;
+}
+
+// takes a snapshot: a copy of the bitmap without the blocks snapshots
+// own, and a new table entry, committed together
+snap_status_t Snapshots::create(const char *name)
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    if (strlen(name) > (size_t) SNAP_NAME_SIZE) {
+        return SNAP_NAME_TOO_LONG;
+    }
+    if (find(name) >= 0) {
+        return SNAP_EXISTS;
+    }
+    if ((int) snaps.size() >= MAX_SNAPSHOTS) {
+        return SNAP_TOO_MANY;
+    }
+
+    map<short, datablock_t> out;
+    volblock_t vol;
+    bfs.read_block(VOLUME_BLOCK, &vol);
+
+    // the first snapshot creates the table
+    bool new_table = (table_block == 0);
+    if (new_table) {
+        table_block = alloc_block();
+        if (table_block == 0) {
+            return SNAP_DISK_FULL;
+        }
+        vol.snap_table = table_block;
+        memcpy(&out[VOLUME_BLOCK], &vol, BLOCK_SIZE);
+    }
+
+    snapshot_t snap;
+    snap.name = name;
+    snap.index_block = vol.index_block;
+    snap.invalid = false;
+    bfs.copy_bitmap(snap.bits);
+    mark_owned(snap.bits, false);
+    snap.remap.assign(NUM_BLOCKS, 0);
+    snap.tail_records = 0;
+    snap.copied = 0;
+
+    snap.bitmap_block = alloc_block();
+    if (snap.bitmap_block == 0) {
+        if (new_table) {
+            bfs.return_blocks(&table_block, 1);
+            table_block = 0;
+        }
+        return SNAP_DISK_FULL;
+    }
+    memcpy(&out[snap.bitmap_block], &snap.bits, BLOCK_SIZE);
+
+    snaps.push_back(snap);
+    table_image(out[table_block]);
+    commit(out);
+    num_snaps = snaps.size();
+    return SNAP_OK;
+}
+
+// deletes a snapshot. Its bitmap, remap chain and the copies no other
+// snapshot refers to are freed once the table no longer names them.
+snap_status_t Snapshots::remove(const char *name)
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    int idx = find(name);
+    if (idx < 0) {
+        return SNAP_NOT_FOUND;
+    }
+
+    snapshot_t snap;
+    snap.remap.swap(snaps[idx].remap);
+    snap.remap_blocks.swap(snaps[idx].remap_blocks);
+    snap.bitmap_block = snaps[idx].bitmap_block;
+    snaps.erase(snaps.begin() + idx);
+    num_snaps = snaps.size();
+
+    set<short> shared;
+    for (size_t s = 0; s < snaps.size(); s++) {
+        for (int b = 0; b < NUM_BLOCKS; b++) {
+            if (snaps[s].remap[b] != 0) {
+                shared.insert(snaps[s].remap[b]);
+            }
+        }
+    }
+
+    vector<short> freed;
+    freed.push_back(snap.bitmap_block);
+    freed.insert(freed.end(), snap.remap_blocks.begin(), snap.remap_blocks.end());
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (snap.remap[b] != 0 && shared.count(snap.remap[b]) == 0) {
+            freed.push_back(snap.remap[b]);
+        }
+    }
+
+    map<short, datablock_t> out;
+    table_image(out[table_block]);
+    commit(out);
+    bfs.reclaim_blocks(freed.data(), freed.size());
+    return SNAP_OK;
+}
+
+// makes the live tree what it was when the snapshot was taken: every
+// block copied since is written back, and the bitmap and the name index
+// location are put back. Blocks that belong to snapshots stay in use.
+snap_status_t Snapshots::rollback(const char *name)
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    int idx = find(name);
+    if (idx < 0) {
+        return SNAP_NOT_FOUND;
+    }
+    if (snaps[idx].invalid) {
+        return SNAP_INVALID;
+    }
+
+    // every block written back and the volume block commit together
+    int copies = 0;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (snaps[idx].remap[b] != 0) {
+            copies++;
+        }
+    }
+    if (!bfs.txn_has_room(copies + 1)) {
+        return SNAP_TOO_LARGE;
+    }
+
+    // writing a block back may copy it for newer snapshots first
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        short copy = snaps[idx].remap[b];
+        if (copy != 0) {
+            datablock_t block;
+            bfs.read_block(copy, &block);
+            bfs.write_block(b, &block);
+        }
+    }
+
+    superblock_t bits = snaps[idx].bits;
+    for (int b = 0; b < FIRST_FREE_BLOCK; b++) {
+        set_bit(bits, b, true);
+    }
+    mark_owned(bits, true);
+    bfs.restore_bitmap(bits);
+
+    volblock_t vol;
+    bfs.read_block(VOLUME_BLOCK, &vol);
+    vol.index_block = snaps[idx].index_block;
+    bfs.write_block(VOLUME_BLOCK, &vol);
+    return SNAP_OK;
+}
+
+// describes every snapshot, oldest first
+void Snapshots::list(vector<snap_info_t> &infos)
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    for (size_t i = 0; i < snaps.size(); i++) {
+        snap_info_t info;
+        info.name = snaps[i].name;
+        info.copied = snaps[i].copied;
+        info.invalid = snaps[i].invalid;
+        infos.push_back(info);
+    }
+}
+
+// collects every block that belongs to snapshots, each once
+void Snapshots::owned_blocks(vector<short> &block_nums)
+{
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    superblock_t bits;
+    memset(&bits, 0, sizeof(bits));
+    mark_owned(bits, true);
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (bit_set(bits, b)) {
+            block_nums.push_back(b);
+        }
+    }
+}
+
+// Copies block_num aside for every snapshot that covers it and has no
+// copy yet. They share one copy. If the disk is full those snapshots are
+// marked invalid instead, since the write cannot wait.
+void Snapshots::before_write(short block_num)
+{
+    if (num_snaps == 0 ||
+        (block_num != ROOT_BLOCK && block_num < FIRST_FREE_BLOCK)) {
+        return;
+    }
+
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    vector<snapshot_t *> needing;
+    for (size_t i = 0; i < snaps.size(); i++) {
+        if (!snaps[i].invalid && bit_set(snaps[i].bits, block_num) &&
+            snaps[i].remap[block_num] == 0) {
+            needing.push_back(&snaps[i]);
+        }
+    }
+    if (needing.empty()) {
+        return;
+    }
+
+    map<short, datablock_t> out;
+    bool table_dirty = false;
+    bool copy_used = false;
+    short copy = alloc_block();
+    if (copy != 0) {
+        bfs.read_block(block_num, &out[copy]);
+    }
+    for (size_t i = 0; i < needing.size(); i++) {
+        if (copy != 0 && add_record(*needing[i], block_num, copy, out, table_dirty)) {
+            copy_used = true;
+        } else {
+            needing[i]->invalid = true;
+            table_dirty = true;
+        }
+    }
+    if (copy != 0 && !copy_used) {
+        out.erase(copy);
+        bfs.return_blocks(&copy, 1);
+    }
+
+    if (table_dirty) {
+        table_image(out[table_block]);
+    }
+    commit(out);
+}
+
+// true if a snapshot covers block_num and has no copy of it yet, so the
+// freed block still holds the snapshot's only copy of its contents
+bool Snapshots::keeps_freed(short block_num)
+{
+    if (num_snaps == 0) {
+        return false;
+    }
+
+    lock_guard<recursive_mutex> guard(snap_mutex);
+    for (size_t i = 0; i < snaps.size(); i++) {
+        if (!snaps[i].invalid && bit_set(snaps[i].bits, block_num) &&
+            snaps[i].remap[block_num] == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// HELPER FUNCTIONS
+
+// Returns the position of the named snapshot, or -1
+int Snapshots::find(const char *name)
+{
+    for (size_t i = 0; i < snaps.size(); i++) {
+        if (snaps[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// true if a valid snapshot covers block_num
+bool Snapshots::covered(short block_num)
+{
+    for (size_t i = 0; i < snaps.size(); i++) {
+        if (!snaps[i].invalid && bit_set(snaps[i].bits, block_num)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Allocates a block for a snapshot's own use, skipping free blocks that
+// a snapshot still covers. Returns 0 if the disk is full.
+short Snapshots::alloc_block()
+{
+    vector<short> skipped;
+    short block_num;
+    while ((block_num = bfs.get_free_block()) != 0 && covered(block_num)) {
+        skipped.push_back(block_num);
+    }
+    bfs.return_blocks(skipped.data(), skipped.size());
+    return block_num;
+}
+
+// Marks every block that belongs to snapshots used or free in bits
+void Snapshots::mark_owned(superblock_t &bits, bool used)
+{
+    if (table_block != 0) {
+        set_bit(bits, table_block, used);
+    }
+    for (size_t i = 0; i < snaps.size(); i++) {
+        set_bit(bits, snaps[i].bitmap_block, used);
+        for (size_t r = 0; r < snaps[i].remap_blocks.size(); r++) {
+            set_bit(bits, snaps[i].remap_blocks[r], used);
+        }
+        for (int b = 0; b < NUM_BLOCKS; b++) {
+            if (snaps[i].remap[b] != 0) {
+                set_bit(bits, snaps[i].remap[b], used);
+            }
+        }
+    }
+}
+
+// Adds the record (orig, copy) to the end of a snapshot's remap chain,
+// growing the chain if its last block is full. Sets table_dirty if the
+// chain was empty. Returns false if the disk is full.
+bool Snapshots::add_record(snapshot_t &snap, short orig, short copy,
+                           map<short, datablock_t> &out, bool &table_dirty)
+{
+    if (snap.remap_blocks.empty() || snap.tail_records == SNAP_REMAP_RECORDS) {
+        short block_num = alloc_block();
+        if (block_num == 0) {
+            return false;
+        }
+
+        snapremap_t &block = (snapremap_t &) out[block_num];
+        memset(&block, 0, sizeof(block));
+        block.magic = SNAP_MAGIC_NUM;
+
+        if (snap.remap_blocks.empty()) {
+            table_dirty = true;
+        } else {
+            snapremap_t &last = (snapremap_t &) image(out, snap.remap_blocks.back());
+            last.next = block_num;
+        }
+        snap.remap_blocks.push_back(block_num);
+        snap.tail_records = 0;
+    }
+
+    snapremap_t &tail = (snapremap_t &) image(out, snap.remap_blocks.back());
+    tail.records[snap.tail_records].orig = orig;
+    tail.records[snap.tail_records].copy = copy;
+    tail.num_records = ++snap.tail_records;
+
+    snap.remap[orig] = copy;
+    snap.copied++;
+    return true;
+}
+
+// Returns the image of a block in out, reading it first if needed
+datablock_t &Snapshots::image(map<short, datablock_t> &out, short block_num)
+{
+    map<short, datablock_t>::iterator it = out.find(block_num);
+    if (it != out.end()) {
+        return it->second;
+    }
+    datablock_t &block = out[block_num];
+    bfs.read_block(block_num, &block);
+    return block;
+}
+
+// Builds the snapshot table from the snapshots in memory
+void Snapshots::table_image(datablock_t &block)
+{
+    snaptable_t &table = (snaptable_t &) block;
+    memset(&table, 0, sizeof(table));
+    table.magic = SNAP_MAGIC_NUM;
+    table.num_snapshots = snaps.size();
+    for (size_t i = 0; i < snaps.size(); i++) {
+        strncpy(table.snapshots[i].name, snaps[i].name.c_str(), SNAP_NAME_SIZE);
+        table.snapshots[i].bitmap_block = snaps[i].bitmap_block;
+        table.snapshots[i].remap_head =
+            snaps[i].remap_blocks.empty() ? 0 : snaps[i].remap_blocks.front();
+        table.snapshots[i].index_block = snaps[i].index_block;
+        table.snapshots[i].invalid = snaps[i].invalid;
+    }
+}
+
+// Commits the blocks in out as one transaction of their own
+void Snapshots::commit(map<short, datablock_t> &out)
+{
+    vector<short> nums;
+    vector<datablock_t> images;
+    for (map<short, datablock_t>::iterator it = out.begin(); it != out.end(); ++it) {
+        nums.push_back(it->first);
+        images.push_back(it->second);
+    }
+    bfs.commit_blocks(nums.data(), nums.size(), images.data());
+}
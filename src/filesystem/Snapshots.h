@@ -0,0 +1,122 @@
+// Computing Systems: Snapshots
+// Point-in-time views of the whole volume. Taking a snapshot copies the
+// bitmap into a block of its own, so it costs the same whatever the size
+// of the tree; every block marked there belongs to the snapshot. Those
+// blocks are shared with the live tree until it overwrites one. The old
+// contents are then copied to a new block first, and the pair goes on
+// the snapshot's remap chain. A block the live tree frees needs nothing
+// special: it is copied if it is ever written again.
+//
+// A copy and the remap record pointing at it are committed as a
+// transaction of their own before the write that needed them goes ahead,
+// so after a crash a snapshot never sees newer contents. Blocks that
+// belong to snapshots (the table, bitmaps, remap chains and copies) are
+// never taken from blocks a snapshot still covers.
+
+#ifndef SNAPSHOTS_H
+#define SNAPSHOTS_H
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+
+using namespace std;
+
+// Result of a snapshot operation
+enum snap_status_t {
+  SNAP_OK,		// done
+  SNAP_EXISTS,		// a snapshot has that name already
+  SNAP_NOT_FOUND,	// no snapshot has that name
+  SNAP_TOO_MANY,	// MAX_SNAPSHOTS snapshots exist
+  SNAP_NAME_TOO_LONG,	// name is longer than SNAP_NAME_SIZE
+  SNAP_DISK_FULL,	// no room for the snapshot's blocks
+  SNAP_INVALID,		// the disk filled up before a block could be copied
+  SNAP_TOO_LARGE	// too many blocks to write back in one transaction
+};
+
+// What list reports about a snapshot
+struct snap_info_t {
+  string name;
+  int copied;		// blocks copied since it was taken
+  bool invalid;		// lost a block when the disk filled up
+};
+
+class Snapshots : public WriteHook {
+
+  public:
+    Snapshots(BasicFileSys &bfs);
+
+    // reads the snapshot table named by the volume block
+    void load();
+
+    // forgets every snapshot (the disk is being unmounted)
+    void clear();
+
+    // takes a snapshot of the volume
+    snap_status_t create(const char *name);
+
+    // deletes a snapshot and frees the blocks only it used
+    snap_status_t remove(const char *name);
+
+    // makes the live tree what it was when the snapshot was taken. The
+    // snapshot is kept. No other command may run; sessions must leave
+    // directories that may no longer exist. Fails if more blocks have
+    // changed since than one transaction can write back.
+    snap_status_t rollback(const char *name);
+
+    // describes every snapshot, oldest first
+    void list(vector<snap_info_t> &infos);
+
+    // collects every block that belongs to snapshots, each once
+    void owned_blocks(vector<short> &block_nums);
+
+    // copies block_num aside for every snapshot that still needs its
+    // old contents
+    void before_write(short block_num);
+
+    // true if block_num must keep its contents after the live tree frees
+    // it, because a snapshot has not copied it
+    bool keeps_freed(short block_num);
+
+  private:
+    // a snapshot in memory
+    struct snapshot_t {
+      string name;
+      short bitmap_block;	// block holding bits
+      short index_block;	// name index header when taken
+      bool invalid;		// lost a block when the disk filled up
+      superblock_t bits;	// blocks in use when taken
+      vector<short> remap_blocks;	// remap chain, first to last
+      int tail_records;		// records in the last remap block
+      vector<short> remap;	// copy of each block (0 - not copied)
+      int copied;		// records in the remap chain
+    };
+
+    BasicFileSys &bfs;		// basic file system
+    short table_block;		// snapshot table (0 - none yet)
+    vector<snapshot_t> snaps;	// oldest first
+    atomic<int> num_snaps;	// lets writes skip the mutex when 0
+    recursive_mutex snap_mutex;	// guards the above; rollback writes
+				// blocks while holding it
+
+    // Helper functions
+    int find(const char *name);
+    bool covered(short block_num);
+    short alloc_block();
+    void mark_owned(superblock_t &bits, bool used);
+    bool add_record(snapshot_t &snap, short orig, short copy,
+                    map<short, datablock_t> &out, bool &table_dirty);
+    datablock_t &image(map<short, datablock_t> &out, short block_num);
+    void table_image(datablock_t &block);
+    void commit(map<short, datablock_t> &out);
+
+    // not copyable
+    Snapshots(const Snapshots &);
+    Snapshots &operator=(const Snapshots &);
+};
+
+#endif
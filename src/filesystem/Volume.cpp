@@ -0,0 +1,112 @@
+// Computing Systems: Volume
+// State of a mounted file system that is shared by all of its sessions:
+// the block layer, the name index, the snapshots, the locks and the
+// listing cache.
+
+#include <algorithm>
+#include <cstring>
+
+#include "Volume.h"
+
+// Orders directory entries by name
+static bool entry_less(const dir_entry_t &a, const dir_entry_t &b)
+{
+    return strcmp(a.name, b.name) < 0;
+}
+
+Volume::Volume()
+  : name_index(bfs), read_ahead(bfs), snapshots(bfs), checked_at_mount(false)
+{
+    bfs.set_write_hook(&snapshots);
+}
+
+// mounts the disk and loads the name index and the snapshots. The
+// bitmap of a disk that was not unmounted cleanly may still mark blocks
+// of transactions that never committed, so it is rebuilt from the tree.
+bool Volume::mount()
+{
+    if (!bfs.mount()) {
+        return false;
+    }
+    name_index.load();
+    snapshots.load();
+
+    checked_at_mount = !bfs.mounted_clean();
+    if (checked_at_mount) {
+        fsck(true, mount_report);
+    }
+    return true;
+}
+
+// unmounts the disk
+void Volume::unmount()
+{
+    forget_listings();
+    read_ahead.clear();
+    snapshots.clear();
+    bfs.unmount();
+}
+
+// reader/writer lock of a directory or inode block
+RWLock &Volume::block_lock(short block_num)
+{
+    return block_locks[block_num];
+}
+
+// name-sorted entries of a directory, built on first use
+shared_ptr<const vector<dir_entry_t> > Volume::sorted_listing(short dir_block)
+{
+    {
+        lock_guard<mutex> guard(listing_mutex);
+        map<short, shared_ptr<const vector<dir_entry_t> > >::iterator it =
+            sorted_listings.find(dir_block);
+        if (it != sorted_listings.end()) {
+            return it->second;
+        }
+    }
+
+    // build outside the mutex; the caller's directory lock keeps the
+    // block stable
+    dirblock_t dir;
+    bfs.read_block(dir_block, &dir);
+
+    vector<dir_entry_t> *listing = new vector<dir_entry_t>();
+    listing->reserve(dir.num_entries);
+    int offset = 0;
+    dir_entry_t entry;
+    while (dir_next(dir, offset, entry)) {
+        listing->push_back(entry);
+    }
+    sort(listing->begin(), listing->end(), entry_less);
+
+    shared_ptr<const vector<dir_entry_t> > result(listing);
+    lock_guard<mutex> guard(listing_mutex);
+    sorted_listings[dir_block] = result;
+    return result;
+}
+
+// drops the cached listing of a directory block once the calling
+// thread's transaction has committed: until then other threads read the
+// old block, and a listing built from it would outlive the change.
+// Cursors already open keep the snapshot they started with.
+void Volume::forget_listing(short dir_block)
+{
+    bfs.after_commit([this, dir_block] {
+        lock_guard<mutex> guard(listing_mutex);
+        sorted_listings.erase(dir_block);
+    });
+}
+
+// drops every cached listing
+void Volume::forget_listings()
+{
+    lock_guard<mutex> guard(listing_mutex);
+    sorted_listings.clear();
+}
+
+// checks the volume, rebuilding the bitmap with repair
+void Volume::fsck(bool repair, fsck_report_t &report)
+{
+    Fsck check(bfs, name_index, snapshots);
+    check.run(repair, report);
+}
@@ -0,0 +1,80 @@
+// Computing Systems: Volume
+// State of a mounted file system that is shared by all of its sessions:
+// the block layer, the name index, the snapshots, the locks and the
+// listing cache.
+
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "BasicFileSys.h"
+#include "Blocks.h"
+#include "Directory.h"
+#include "Fsck.h"
+#include "NameIndex.h"
+#include "ReadAhead.h"
+#include "RWLock.h"
+#include "Snapshots.h"
+
+using namespace std;
+
+// Locks are taken in this order: namespace_lock, then directory blocks
+// (parent before child), then inode blocks. The name index, the listing
+// cache, the bitmap and the disk have their own mutexes below those.
+class Volume {
+
+  public:
+    Volume();
+
+    // mounts the disk and loads the name index and the snapshots. A disk
+    // that was not unmounted cleanly is checked and its bitmap repaired.
+    // Returns false if the disk layout is not supported.
+    bool mount();
+
+    // unmounts the disk
+    void unmount();
+
+    // reader/writer lock of a directory or inode block
+    RWLock &block_lock(short block_num);
+
+    // name-sorted entries of a directory, built on first use. The caller
+    // must hold the directory's lock.
+    shared_ptr<const vector<dir_entry_t> > sorted_listing(short dir_block);
+
+    // drops the cached listing of a directory block once the calling
+    // thread's transaction has committed
+    void forget_listing(short dir_block);
+
+    // drops every cached listing
+    void forget_listings();
+
+    // checks the volume, rebuilding the bitmap with repair. No command
+    // may run at the same time.
+    void fsck(bool repair, fsck_report_t &report);
+
+    BasicFileSys bfs;		// basic file system
+    NameIndex name_index;	// optional name to block index
+    ReadAhead read_ahead;	// sequential read detection
+    Snapshots snapshots;	// point-in-time views of the volume
+    bool checked_at_mount;	// mount found the disk not cleanly unmounted
+    fsck_report_t mount_report;	// what that check found
+
+    // Held shared by commands that work inside one directory and
+    // exclusively by commands that restructure the tree (rm -r, cp -r,
+    // moves, index rebuilds, snapshots).
+    RWLock namespace_lock;
+
+  private:
+    RWLock block_locks[NUM_BLOCKS];	// one per block
+    mutex listing_mutex;		// guards sorted_listings
+    map<short, shared_ptr<const vector<dir_entry_t> > > sorted_listings;
+
+    // not copyable
+    Volume(const Volume &);
+    Volume &operator=(const Volume &);
+};
+
+#endif
@@ -2,12 +2,58 @@
 // Executes the file system program by starting the shell.
 
 #include <iostream>
+#include <cstdlib>
 #include <cstring>
 using namespace std;
 
 #include "Shell.h"
+#include "Daemon.h"
 #include "Blocks.h"
 
+// How a script is run
+struct script_mode_t {
+  bool quiet;		// --quiet: do not echo the commands
+  bool replay;		// --replay: time the commands
+  double rate;		// commands per second to replay at (0 - unpaced)
+};
+
+// Parses what follows the script name, from argv[first] on: nothing,
+// --quiet, or --replay with an optional rate. Returns false for anything
+// else.
+static bool parse_script_mode(int argc, char **argv, int first, script_mode_t &mode)
+{
+  mode.quiet = false;
+  mode.replay = false;
+  mode.rate = 0;
+  if (first == argc) {
+    return true;
+  }
+  if (strcmp(argv[first], "--quiet") == 0) {
+    mode.quiet = true;
+    return first + 1 == argc;
+  }
+  if (strcmp(argv[first], "--replay") != 0 || first + 2 < argc) {
+    return false;
+  }
+  mode.replay = true;
+  if (first + 1 < argc) {
+    char *end;
+    mode.rate = strtod(argv[first + 1], &end);
+    return *end == '\0' && mode.rate > 0;
+  }
+  return true;
+}
+
+// Runs a script the way mode says
+static void run_script(Shell &shell, char *file_name, const script_mode_t &mode)
+{
+  if (mode.replay) {
+    shell.replay_script(file_name, mode.rate);
+  } else {
+    shell.run_script(file_name, mode.quiet);
+  }
+}
+
 int main(int argc, char **argv)
 {
   // Uncomment this section to make sure the size of the blocks are
@@ -20,18 +66,48 @@ int main(int argc, char **argv)
 #endif
 
   Shell shell;
+  script_mode_t mode;
 
   if (argc == 1) {
     shell.run();
   }
-  else if (argc == 3 && strcmp(argv[1], "-s") == 0) {
-    shell.run_script(argv[2]);
+  else if (argc >= 3 && strcmp(argv[1], "-s") == 0 &&
+           parse_script_mode(argc, argv, 3, mode)) {
+    run_script(shell, argv[2], mode);
+  }
+  else if (argc == 2 && strcmp(argv[1], "-f") == 0) {
+    shell.check_disk();
+  }
+  else if (argc == 3 && strcmp(argv[1], "-d") == 0) {
+    Daemon daemon;
+    if (!daemon.run(argv[2])) {
+      return 1;
+    }
+  }
+  else if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    if (!shell.connect_to(argv[2])) {
+      return 1;
+    }
+    shell.run();
+  }
+  else if (argc >= 5 && strcmp(argv[1], "-c") == 0 &&
+           strcmp(argv[3], "-s") == 0 && parse_script_mode(argc, argv, 5, mode)) {
+    if (!shell.connect_to(argv[2])) {
+      return 1;
+    }
+    run_script(shell, argv[4], mode);
   }
   else {
     cerr << "Invalid command line" << endl;
     cerr << "Usage (one of the following): " << endl;
     cerr << "./filesys" << endl;
-    cerr << "./filesys -s <script-name> " << endl;
+    cerr << "./filesys -s <script-name> [--quiet]  (--quiet: do not echo commands)" << endl;
+    cerr << "./filesys -s <script-name> --replay [<commands-per-second>]" << endl;
+    cerr << "                                       (time each command, optionally paced)" << endl;
+    cerr << "./filesys -f                           (check DISK and repair its bitmap)" << endl;
+    cerr << "./filesys -d <socket>                  (serve DISK to clients)" << endl;
+    cerr << "./filesys -c <socket> [-s <script-name> [--quiet | --replay [<rate>]]]" << endl;
+    cerr << "                                       (run commands on a daemon)" << endl;
   }
 
   return 0;
@@ -0,0 +1,341 @@
+// Computing Systems: mkfs
+// Builds a disk image from a directory tree of the host, offline and in
+// one pass. The whole layout is planned in memory first: each directory
+// block is followed by the inodes of its files, then by the data blocks
+// of each file in order, then by its subdirectories, depth first. The
+// image is then written from start to end in one sequential write, with
+// the unused tail left as a hole. The result is a clean, journal-empty
+// volume that mounts without a check; the name index starts out off.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Blocks.h"
+#include "Directory.h"
+
+using namespace std;
+
+// image file written when none is named
+const char *const DEFAULT_IMAGE = "DISK";
+
+// A host directory entry to load
+struct host_entry_t {
+  string name;
+  string path;		// on the host
+  bool is_dir;
+  off_t size;		// bytes (files only)
+};
+
+// orders entries by name, so the same tree always gives the same image
+static bool by_name(const host_entry_t &a, const host_entry_t &b)
+{
+  return a.name < b.name;
+}
+
+class ImageBuilder {
+
+  public:
+    ImageBuilder() : directories(1), files(0), bytes(0), image(NUM_BLOCKS),
+                     next_block(FIRST_FREE_BLOCK)
+    {
+      memset(image.data(), 0, NUM_BLOCKS * BLOCK_SIZE);
+    }
+
+    // lays out the tree at host_root under the root directory and fills
+    // in the fixed blocks. Returns false, with error set, if the tree
+    // does not fit.
+    bool build(const string &host_root)
+    {
+      if (!load_dir(host_root, ROOT_BLOCK, ROOT_BLOCK)) {
+        return false;
+      }
+      format();
+      return true;
+    }
+
+    // writes the image to path in one pass. Returns false with error set
+    // if it could not be written.
+    bool write(const char *path, bool overwrite)
+    {
+      int flags = O_WRONLY | O_CREAT | O_TRUNC | (overwrite ? 0 : O_EXCL);
+      int fd = open(path, flags, 0644);
+      if (fd < 0) {
+        error = string(path) + ": " + strerror(errno);
+        if (errno == EEXIST) {
+          error += " (-f replaces it)";
+        }
+        return false;
+      }
+
+      // blocks past the last one used are zero, so they are left as a
+      // hole of the right size
+      const char *data = (const char *) image.data();
+      size_t size = (size_t) next_block * BLOCK_SIZE;
+      size_t done = 0;
+      while (done < size) {
+        ssize_t n = ::write(fd, data + done, size - done);
+        if (n <= 0) break;
+        done += n;
+      }
+      bool ok = done == size &&
+                ftruncate(fd, (off_t) NUM_BLOCKS * BLOCK_SIZE) == 0;
+      if (!ok) {
+        error = string(path) + ": " + strerror(errno);
+      }
+      close(fd);
+      return ok;
+    }
+
+    string error;		// why build or write failed
+    int blocks_used() const { return next_block; }
+    int directories;		// directories loaded, root included
+    int files;			// files loaded
+    unsigned long bytes;	// bytes of file data loaded
+
+  private:
+    vector<datablock_t> image;	// every block of the disk
+    int next_block;		// next block to lay out
+
+    // Takes count blocks from the next free block on. Returns the first,
+    // or 0 if the disk is full.
+    short alloc(int count, const string &path)
+    {
+      if (next_block + count > NUM_BLOCKS) {
+        error = path + ": the disk is full";
+        return 0;
+      }
+      short first = next_block;
+      next_block += count;
+      return first;
+    }
+
+    // Lists the regular files and directories in host_dir, by name.
+    // Anything else is skipped with a warning.
+    bool list_dir(const string &host_dir, vector<host_entry_t> &entries)
+    {
+      DIR *dir = opendir(host_dir.c_str());
+      if (dir == NULL) {
+        error = host_dir + ": " + strerror(errno);
+        return false;
+      }
+      struct dirent *d;
+      while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+          continue;
+        }
+        host_entry_t entry;
+        entry.name = d->d_name;
+        entry.path = host_dir + "/" + d->d_name;
+        struct stat st;
+        if (lstat(entry.path.c_str(), &st) != 0) {
+          error = entry.path + ": " + strerror(errno);
+          closedir(dir);
+          return false;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+          cerr << "Skipping " << entry.path << ": not a file or directory" << endl;
+          continue;
+        }
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.size = st.st_size;
+        entries.push_back(entry);
+      }
+      closedir(dir);
+      sort(entries.begin(), entries.end(), by_name);
+      return true;
+    }
+
+    // Lays out the directory at host_dir in block dir_block: the inodes
+    // of its files come next, then their data, then its subdirectories.
+    bool load_dir(const string &host_dir, short dir_block, short parent)
+    {
+      vector<host_entry_t> entries;
+      if (!list_dir(host_dir, entries)) {
+        return false;
+      }
+
+      dirblock_t dir;
+      dir_init(dir, parent);
+      vector<size_t> file_pos;
+      for (size_t i = 0; i < entries.size(); i++) {
+        if (!entries[i].is_dir) {
+          file_pos.push_back(i);
+        }
+      }
+
+      // inodes side by side, so a directory's inodes are read in one run
+      short inode_block = alloc(file_pos.size(), host_dir);
+      if (inode_block == 0 && !file_pos.empty()) {
+        return false;
+      }
+      for (size_t i = 0; i < file_pos.size(); i++) {
+        const host_entry_t &entry = entries[file_pos[i]];
+        if (!add_entry(dir, entry, DIR_ENTRY_FILE, inode_block + i) ||
+            !load_file(entry, inode_block + i)) {
+          return false;
+        }
+      }
+
+      for (size_t i = 0; i < entries.size(); i++) {
+        if (!entries[i].is_dir) {
+          continue;
+        }
+        short sub_block = alloc(1, entries[i].path);
+        if (sub_block == 0 ||
+            !add_entry(dir, entries[i], DIR_ENTRY_DIR, sub_block) ||
+            !load_dir(entries[i].path, sub_block, dir_block)) {
+          return false;
+        }
+        directories++;
+      }
+
+      memcpy(&image[dir_block], &dir, BLOCK_SIZE);
+      return true;
+    }
+
+    // Adds an entry to a directory being laid out
+    bool add_entry(dirblock_t &dir, const host_entry_t &entry,
+                   unsigned char type, short block_num)
+    {
+      if (entry.name.size() > (size_t) MAX_FNAME_SIZE) {
+        error = entry.path + ": the name is longer than " +
+                to_string(MAX_FNAME_SIZE) + " bytes";
+        return false;
+      }
+      if (!dir_insert(dir, entry.name.c_str(), type, block_num)) {
+        error = entry.path + ": no room in its directory block";
+        return false;
+      }
+      return true;
+    }
+
+    // Lays out a file: its data blocks are taken in one run and the host
+    // file is read straight into them
+    bool load_file(const host_entry_t &entry, short inode_block)
+    {
+      if (entry.size > MAX_FILE_SIZE) {
+        error = entry.path + ": larger than " + to_string(MAX_FILE_SIZE) +
+                " bytes";
+        return false;
+      }
+      int count = (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+      inode_t inode;
+      memset(&inode, 0, sizeof(inode));
+      inode.magic = INODE_MAGIC_NUM;
+      inode.size = entry.size;
+      if (count > 0) {
+        short first = alloc(count, entry.path);
+        if (first == 0) {
+          return false;
+        }
+        for (int i = 0; i < count; i++) {
+          inode.blocks[i] = first + i;
+        }
+        if (!read_host(entry, (char *) &image[first])) {
+          return false;
+        }
+      }
+      memcpy(&image[inode_block], &inode, BLOCK_SIZE);
+      files++;
+      bytes += entry.size;
+      return true;
+    }
+
+    // Reads the whole host file into buf
+    bool read_host(const host_entry_t &entry, char *buf)
+    {
+      int fd = open(entry.path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        error = entry.path + ": " + strerror(errno);
+        return false;
+      }
+      off_t done = 0;
+      while (done < entry.size) {
+        ssize_t n = read(fd, buf + done, entry.size - done);
+        if (n <= 0) break;
+        done += n;
+      }
+      close(fd);
+      if (done < entry.size) {
+        error = entry.path + ": changed while it was read";
+        return false;
+      }
+      return true;
+    }
+
+    // Fills in the superblock, the volume block and the journal header.
+    // The root directory is laid out by load_dir.
+    void format()
+    {
+      superblock_t super_block;
+      memset(&super_block, 0, sizeof(super_block));
+      for (int b = 0; b < next_block; b++) {
+        super_block.bitmap[b / 8] |= 1 << (b % 8);
+      }
+      memcpy(&image[SUPER_BLOCK], &super_block, BLOCK_SIZE);
+
+      volblock_t vol_block;
+      memset(&vol_block, 0, sizeof(vol_block));
+      vol_block.magic = VOLUME_MAGIC_NUM;
+      vol_block.version = VOLUME_VERSION;
+      vol_block.clean = 1;
+      memcpy(&image[VOLUME_BLOCK], &vol_block, BLOCK_SIZE);
+
+      // an empty journal: no descriptor carries its sequence number
+      journalhead_t head;
+      memset(&head, 0, sizeof(head));
+      head.magic = JOURNAL_MAGIC_NUM;
+      head.seq = 1;
+      memcpy(&image[JOURNAL_START], &head, BLOCK_SIZE);
+    }
+};
+
+static void usage()
+{
+  cerr << "Usage: ./filesys_mkfs [-f] <host-dir> [image]" << endl;
+  cerr << "  Builds a disk image (default " << DEFAULT_IMAGE << ") holding the" << endl;
+  cerr << "  files and directories below host-dir. -f replaces an existing image." << endl;
+}
+
+int main(int argc, char **argv)
+{
+  bool overwrite = false;
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-f") == 0) {
+    overwrite = true;
+    first = 2;
+  }
+  if (argc - first < 1 || argc - first > 2) {
+    usage();
+    return 1;
+  }
+  string host_root = argv[first];
+  const char *image_path = argc - first == 2 ? argv[first + 1] : DEFAULT_IMAGE;
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  ImageBuilder builder;
+  if (!builder.build(host_root) || !builder.write(image_path, overwrite)) {
+    cerr << "mkfs: " << builder.error << endl;
+    return 1;
+  }
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << builder.directories << " directories, " << builder.files << " files, "
+       << builder.blocks_used() << " of " << NUM_BLOCKS << " blocks used in "
+       << image_path << endl;
+  cout << "Loaded " << builder.bytes << " bytes in " << fixed << setprecision(3)
+       << secs * 1000 << " ms (" << setprecision(1)
+       << (secs > 0 ? builder.bytes / secs / 1e6 : 0.0) << " MB/s)" << endl;
+  return 0;
+}
@@ -1,20 +1,489 @@
 // Computing Systems: Shell
 // Implements a basic shell (command line interface) for the file system
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <map>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 using namespace std;
 
 #include "Shell.h"
 
 static const string PROMPT_STRING = "FS> ";	// shell prompt
+static const string MOUNT_ERROR = "Could not mount disk";
+
+// bytes a script is read in at a time
+static const size_t SCRIPT_CHUNK = 64 * 1024;
+
+// bytes of standard output a script collects before writing them
+static const size_t OUTPUT_BLOCK = 64 * 1024;
+
+// most commands a line may join with |
+static const int MAX_PIPE_STAGES = 8;
+
+// How a command's arguments are parsed (command_spec_t flags)
+static const unsigned char ARG_RECURSIVE = 0x1;	// -r may come first
+static const unsigned char ARG_REST = 0x2;	// rest of line is the 2nd arg
+static const unsigned char ARG_SORT = 0x4;	// optional arg must be -s
+static const unsigned char ARG_LIST = 0x8;	// "list" takes no 2nd arg
+static const unsigned char ARG_COUNT = 0x10;	// piped arg is a byte count
+
+// A shell command
+struct command_spec_t {
+  const char *name;
+  unsigned char op;		// OP_... sent to a daemon
+  int min_tokens;		// tokens on its line, name included
+  int max_tokens;
+  int pipe_tokens;		// tokens when reading a pipe (0 - cannot)
+  unsigned char flags;		// ARG_...
+};
+
+// Every command, in operation order
+static const command_spec_t COMMANDS[] = {
+  {"mkdir",    OP_MKDIR,    2, 2, 0, 0},
+  {"cd",       OP_CD,       2, 2, 0, 0},
+  {"home",     OP_HOME,     1, 1, 0, 0},
+  {"rmdir",    OP_RMDIR,    2, 2, 0, 0},
+  {"ls",       OP_LS,       1, 2, 0, ARG_SORT},
+  {"create",   OP_CREATE,   2, 2, 0, 0},
+  {"append",   OP_APPEND,   3, 3, 2, ARG_REST},
+  {"cat",      OP_CAT,      2, 2, 1, 0},
+  {"tail",     OP_TAIL,     3, 3, 2, ARG_COUNT},
+  {"rm",       OP_RM,       2, 2, 0, ARG_RECURSIVE},
+  {"stat",     OP_STAT,     2, 2, 0, 0},
+  {"pwd",      OP_PWD,      1, 1, 0, 0},
+  {"df",       OP_DF,       1, 1, 0, 0},
+  {"head",     OP_HEAD,     3, 3, 2, ARG_COUNT},
+  {"wc",       OP_WC,       2, 2, 1, 0},
+  {"cp",       OP_CP,       3, 3, 0, ARG_RECURSIVE},
+  {"mv",       OP_MV,       3, 3, 0, 0},
+  {"find",     OP_FIND,     2, 2, 0, 0},
+  {"tree",     OP_TREE,     1, 2, 0, ARG_SORT},
+  {"index",    OP_INDEX,    2, 2, 0, 0},
+  {"help",     OP_HELP,     1, 2, 0, 0},
+  {"quit",     OP_QUIT,     1, 1, 0, 0},
+  {"cache",    OP_CACHE,    1, 1, 0, 0},
+  {"sync",     OP_SYNC,     1, 1, 0, 0},
+  {"fsync",    OP_FSYNC,    2, 2, 0, 0},
+  {"snapshot", OP_SNAPSHOT, 2, 3, 0, ARG_LIST},
+  {"fsck",     OP_FSCK,     1, 1, 0, 0},
+  {"import",   OP_IMPORT,   3, 3, 0, 0},
+  {"export",   OP_EXPORT,   3, 3, 0, 0},
+  {"iostat",   OP_IOSTAT,   1, 2, 0, 0},
+  {"frag",     OP_FRAG,     1, 1, 0, 0},
+  {"defrag",   OP_DEFRAG,   1, 2, 0, 0},
+  {"trim",     OP_TRIM,     1, 1, 0, 0}
+};
+static const int NUM_COMMANDS = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+// slots in the name table, a power of two well above NUM_COMMANDS so
+// that a lookup rarely probes past its first slot
+static const unsigned int COMMAND_SLOTS = 128;
+
+// FNV-1a hash of a command name
+static unsigned int name_hash(const char *name)
+{
+  unsigned int hash = 2166136261u;
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char) *name) * 16777619u;
+  }
+  return hash;
+}
+
+// Open-addressed table from command name to command
+struct command_table_t {
+  const command_spec_t *slots[COMMAND_SLOTS];
+
+  command_table_t()
+  {
+    for (unsigned int i = 0; i < COMMAND_SLOTS; i++) {
+      slots[i] = NULL;
+    }
+    for (int c = 0; c < NUM_COMMANDS; c++) {
+      unsigned int i = name_hash(COMMANDS[c].name) & (COMMAND_SLOTS - 1);
+      while (slots[i] != NULL) {
+        i = (i + 1) & (COMMAND_SLOTS - 1);
+      }
+      slots[i] = &COMMANDS[c];
+    }
+  }
+};
+
+// Returns the command called name, or NULL if there is none
+static const command_spec_t *find_command(const char *name)
+{
+  static const command_table_t table;
+  unsigned int i = name_hash(name) & (COMMAND_SLOTS - 1);
+  for (; table.slots[i] != NULL; i = (i + 1) & (COMMAND_SLOTS - 1)) {
+    if (strcmp(table.slots[i]->name, name) == 0) {
+      return table.slots[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns the command for an operation, or NULL if there is none
+static const command_spec_t *command_for_op(unsigned char op)
+{
+  for (int c = 0; c < NUM_COMMANDS; c++) {
+    if (COMMANDS[c].op == op) {
+      return &COMMANDS[c];
+    }
+  }
+  return NULL;
+}
+
+// Cuts a line at each | outside double quotes, ending each command with
+// a '\0'. Returns the number of commands, or -1 if there are more than
+// MAX_PIPE_STAGES.
+static int split_pipeline(char *line, char **stages)
+{
+  int count = 1;
+  stages[0] = line;
+  bool quoted = false;
+  for (char *pos = line; *pos != '\0'; pos++) {
+    if (*pos == '"') {
+      quoted = !quoted;
+    } else if (*pos == '|' && !quoted) {
+      if (count == MAX_PIPE_STAGES) {
+        return -1;
+      }
+      *pos = '\0';
+      stages[count++] = pos + 1;
+    }
+  }
+  return count;
+}
+
+// Reads the byte count of head or tail. Returns false, after saying why,
+// if it is not a number.
+static bool byte_count(const char *text, unsigned long &n)
+{
+  errno = 0;
+  n = strtoul(text, NULL, 0);
+  if (0 != errno) {
+    cerr << "Invalid command line: " << text;
+    cerr << " is not a valid number of bytes" << endl;
+    return false;
+  }
+  return true;
+}
+
+// Parses a positive number of steps. Prints an error and returns false
+// if text is not one.
+static bool step_count(const char *text, unsigned long &n)
+{
+  char *end;
+  errno = 0;
+  n = strtoul(text, &end, 10);
+  if (0 != errno || *end != '\0' || n == 0) {
+    cerr << "Invalid command line: " << text;
+    cerr << " is not a valid number of steps" << endl;
+    return false;
+  }
+  return true;
+}
+
+// Prints the message for an operation that failed
+static void report(io_status_t status)
+{
+  if (status != IO_OK) {
+    cout << io_message(status) << endl;
+  }
+}
+
+// Prints the message for an import or export that failed. A host file
+// that could not be used is named.
+static void report(io_status_t status, const char *host_path)
+{
+  if (status == IO_HOST_OPEN || status == IO_HOST_READ ||
+      status == IO_HOST_WRITE) {
+    cout << io_message(status) << " " << host_path << endl;
+  } else {
+    report(status);
+  }
+}
+
+// Prints how many bytes an import or export moved, and how fast
+static void print_rate(const char *verb, const transfer_info_t &info)
+{
+  char line[160];
+  snprintf(line, sizeof(line), "%s %u bytes in %.3f ms (%.1f MB/s)", verb,
+           info.bytes, info.seconds * 1000,
+           info.seconds > 0 ? info.bytes / info.seconds / 1e6 : 0.0);
+  cout << line << endl;
+}
+
+// Prints the message for an index, snapshot or iostat operation that
+// failed. An unknown operation is named with its command.
+static void report(io_status_t status, const char *command, const char *op)
+{
+  if (status == IO_BAD_OP) {
+    cout << "Unknown " << command << " operation: " << op << endl;
+  } else {
+    report(status);
+  }
+}
+
+// true if line holds nothing but whitespace
+static bool blank(const char *line)
+{
+  for (; *line != '\0'; line++) {
+    if (!isspace((unsigned char) *line)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits the next whitespace-separated token off a line in place,
+// ending it with a '\0'. Returns NULL at the end of the line.
+static char *next_token(char *&pos)
+{
+  while (isspace((unsigned char) *pos)) {
+    pos++;
+  }
+  if (*pos == '\0') {
+    return NULL;
+  }
+  char *token = pos;
+  while (*pos != '\0' && !isspace((unsigned char) *pos)) {
+    pos++;
+  }
+  if (*pos != '\0') {
+    *pos++ = '\0';
+  }
+  return token;
+}
+
+// Standard output of a script. It is collected in blocks and written when
+// a block fills up, when the script ends, or just before something goes
+// to standard error (see ScriptErrors), so the two streams still come
+// out in the order they were produced. endl does not force a write.
+class ScriptOutput : public streambuf {
+
+  public:
+    ScriptOutput(streambuf *target) : target(target), buffer(OUTPUT_BLOCK)
+    {
+      setp(&buffer[0], &buffer[0] + buffer.size());
+    }
+
+    ~ScriptOutput()
+    {
+      drain();
+    }
+
+    // writes what has been collected
+    void drain()
+    {
+      if (pptr() > pbase()) {
+        target->sputn(pbase(), pptr() - pbase());
+        target->pubsync();
+        setp(&buffer[0], &buffer[0] + buffer.size());
+      }
+    }
+
+  protected:
+    int overflow(int c)
+    {
+      drain();
+      if (c != traits_type::eof()) {
+        *pptr() = c;
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    int sync()
+    {
+      return 0;
+    }
+
+  private:
+    streambuf *target;		// where the output goes
+    vector<char> buffer;	// output not written yet
+};
+
+// Standard error of a script: unbuffered, but writes the standard output
+// collected so far first
+class ScriptErrors : public streambuf {
+
+  public:
+    ScriptErrors(ScriptOutput &out, streambuf *target)
+      : out(out), target(target)
+    {
+    }
+
+  protected:
+    int overflow(int c)
+    {
+      out.drain();
+      return (c == traits_type::eof()) ? traits_type::not_eof(c) : target->sputc(c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n)
+    {
+      out.drain();
+      return target->sputn(s, n);
+    }
+
+    int sync()
+    {
+      return target->pubsync();
+    }
+
+  private:
+    ScriptOutput &out;		// standard output of the script
+    streambuf *target;		// where errors go
+};
+
+// Latencies of the commands of a replayed script, by command name. When
+// the replay is paced, a command that starts late because the ones before
+// ran long is timed from when it was due, so the wait counts too.
+class ReplayLog {
+
+  public:
+    explicit ReplayLog(double rate) : rate(rate), count(0), late(0)
+    {
+    }
+
+    // waits until the command on line is due and starts timing it
+    void start(const char *line)
+    {
+      const char *end = line;
+      while (*end != '\0' && !isspace((unsigned char) *end)) {
+        end++;
+      }
+      name.assign(line, end);
+
+      clock::time_point now = clock::now();
+      if (count == 0) {
+        first = now;
+      }
+      started = now;
+      if (rate > 0) {
+        clock::time_point due = first + chrono::duration_cast<clock::duration>(
+          chrono::duration<double>(count / rate));
+        if (due > now) {
+          this_thread::sleep_until(due);
+          started = clock::now();
+        } else if (due < now) {
+          started = due;
+          late++;
+        }
+      }
+    }
+
+    // stops timing the command started last
+    void finish()
+    {
+      clock::time_point now = clock::now();
+      if (!name.empty()) {
+        double seconds = chrono::duration<double>(now - started).count();
+        latencies[name].push_back(seconds);
+        all.push_back(seconds);
+      }
+      last = now;
+      count++;
+    }
+
+    // prints the rate reached and the latencies of all commands and of
+    // each command name
+    void report(ostream &out)
+    {
+      double elapsed = count > 0 ? chrono::duration<double>(last - first).count() : 0;
+      char line[160];
+      snprintf(line, sizeof(line), "Replayed %lu commands in %.3f s (%.1f commands/s",
+               count, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+      out << line;
+      if (rate > 0) {
+        snprintf(line, sizeof(line), ", target %.1f, %lu started late", rate, late);
+        out << line;
+      }
+      out << ")" << endl;
+
+      snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s %10s", "command",
+               "count", "p50 us", "p90 us", "p99 us", "max us");
+      out << line << endl;
+      print_row(out, "all", all);
+      for (map<string, vector<double> >::iterator it = latencies.begin();
+           it != latencies.end(); ++it) {
+        print_row(out, it->first.c_str(), it->second);
+      }
+    }
+
+  private:
+    typedef chrono::steady_clock clock;
+
+    double rate;		// commands per second (0 - unpaced)
+    unsigned long count;	// commands run
+    unsigned long late;		// paced commands that started after they were due
+    string name;		// command being timed
+    clock::time_point first;	// start of the first command
+    clock::time_point started;	// when the current command began, or was
+				// due if it began late
+    clock::time_point last;	// end of the last command
+    vector<double> all;		// seconds per command
+    map<string, vector<double> > latencies;	// seconds per command, by name
+
+    // nearest-rank percentile of sorted latencies, in microseconds
+    static double percentile(const vector<double> &sorted, double p)
+    {
+      size_t rank = (size_t) (p * sorted.size() + 0.999999);
+      rank = max((size_t) 1, min(rank, sorted.size()));
+      return sorted[rank - 1] * 1e6;
+    }
+
+    static void print_row(ostream &out, const char *label, vector<double> &times)
+    {
+      if (times.empty()) {
+        return;
+      }
+      sort(times.begin(), times.end());
+      char line[160];
+      snprintf(line, sizeof(line), "%-10s %8lu %10.1f %10.1f %10.1f %10.1f",
+               label, (unsigned long) times.size(), percentile(times, 0.50),
+               percentile(times, 0.90), percentile(times, 0.99),
+               times.back() * 1e6);
+      out << line << endl;
+    }
+};
+
+Shell::Shell() : server_fd(-1)
+{
+}
+
+// Creates a shell whose file system is a session on a shared volume
+Shell::Shell(Volume &volume) : filesys(volume), server_fd(-1)
+{
+}
+
+Shell::~Shell()
+{
+  if (server_fd != -1) {
+    close(server_fd);
+  }
+}
 
 // Executes the shell until the user quits.
 void Shell::run()
 {
-  // mount the file system
-  filesys.mount();
+  // mount the file system, unless a daemon runs the commands
+  if (server_fd == -1 && !filesys.mount()) {
+    cerr << MOUNT_ERROR << endl;
+    return;
+  }
   
   // continue until the user quits
   bool user_quit = false;
@@ -26,245 +495,584 @@ void Shell::run()
     getline(cin, command_str);
 
     // execute the command
-    user_quit = execute_command(command_str);
+    user_quit = execute_command(&command_str[0]);
   }
 
   // unmount the file system
-  filesys.unmount();
+  if (server_fd == -1) {
+    filesys.unmount();
+  }
 }
 
-// Execute a script.
-void Shell::run_script(char *file_name)
+// Execute a script. A quiet run does not echo the commands.
+void Shell::run_script(char *file_name, bool quiet)
+{
+  run_script(file_name, quiet, NULL);
+}
+
+// Replays a script quietly, timing each command, paced to rate commands
+// per second if rate is above 0, and prints the latencies at the end.
+void Shell::replay_script(char *file_name, double rate)
+{
+  ReplayLog replay(rate);
+  run_script(file_name, true, &replay);
+}
+
+// Runs a script. The file is read in large chunks and each line run in
+// place; a last line without a newline is not run. Output is written in
+// blocks. A quiet run does not echo the commands. Each command is timed
+// into replay unless it is NULL, and the latencies are printed last.
+void Shell::run_script(char *file_name, bool quiet, ReplayLog *replay)
 {
   // open script file
   ifstream infile;
-  infile.open(file_name);
+  infile.open(file_name, ios::binary);
   if (infile.fail()) {
     cerr << "Could not open script file" << endl;
     return;
   }
 
-  // mount the file system
-  filesys.mount();
+  // mount the file system, unless a daemon runs the commands
+  if (server_fd == -1 && !filesys.mount()) {
+    cerr << MOUNT_ERROR << endl;
+    return;
+  }
+
+  ScriptOutput out(cout.rdbuf());
+  ScriptErrors err(out, cerr.rdbuf());
+  streambuf *old_out = cout.rdbuf(&out);
+  streambuf *old_err = cerr.rdbuf(&err);
 
   // execute each line in the script
   bool user_quit = false;
-  string command_str;
-  getline(infile, command_str, '\n');
-  while (!infile.eof() && !user_quit) {
-    cout << PROMPT_STRING << command_str << endl;
-    user_quit = execute_command(command_str);
-    getline(infile, command_str);
+  vector<char> buffer(SCRIPT_CHUNK);
+  size_t held = 0;	// bytes of a line not complete yet
+  while (!user_quit) {
+    if (held == buffer.size()) {
+      buffer.resize(buffer.size() * 2);	// a line longer than the buffer
+    }
+    infile.read(&buffer[held], buffer.size() - held);
+    if (infile.gcount() == 0) {
+      break;
+    }
+    char *line = &buffer[0];
+    char *end = line + held + infile.gcount();
+
+    char *newline;
+    while (!user_quit &&
+           (newline = (char *) memchr(line, '\n', end - line)) != NULL) {
+      *newline = '\0';
+      if (!quiet) {
+        cout << PROMPT_STRING << line << '\n';
+      }
+      if (replay != NULL) {
+        replay->start(line);
+      }
+      user_quit = execute_command(line);
+      if (replay != NULL) {
+        replay->finish();
+      }
+      line = newline + 1;
+    }
+
+    // keep the start of an incomplete line for the next chunk
+    held = end - line;
+    memmove(&buffer[0], line, held);
   }
 
   // clean up
-  filesys.unmount();
+  if (server_fd == -1) {
+    filesys.unmount();
+  }
+  if (replay != NULL) {
+    replay->report(cout);
+  }
+  cout.rdbuf(old_out);
+  cerr.rdbuf(old_err);
   infile.close();
 }
 
-// Executes the command. Returns true for quit and false otherwise.
-bool Shell::execute_command(string command_str)
+// Execute a script, echoing each command.
+void Shell::run_script(char *file_name)
 {
-  // parse the command line
-  struct Command command = parse_command(command_str);
+  run_script(file_name, false);
+}
 
-  // look for the matching command
-  if (command.name == "") {
-    return false;
-  }
-  else if (command.name == "mkdir") {
-    filesys.mkdir(command.file_name.c_str());
+// Mounts the disk, checks it and unmounts it.
+void Shell::check_disk()
+{
+  if (!filesys.mount()) {
+    cerr << MOUNT_ERROR << endl;
+    return;
   }
-  else if (command.name == "cd") {
-    filesys.cd(command.file_name.c_str());
+  filesys.fsck();
+  filesys.unmount();
+}
+
+// Sends commands to the daemon listening on socket_path instead of
+// running them here. Returns false if the daemon cannot be reached.
+bool Shell::connect_to(const char *socket_path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    cerr << "Socket path is too long" << endl;
+    return false;
   }
-  else if (command.name == "home") {
-    filesys.home();
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    cerr << "Could not connect to daemon at " << socket_path << endl;
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
   }
-  else if (command.name == "rmdir") {
-    filesys.rmdir(command.file_name.c_str());
+  server_fd = fd;
+  return true;
+}
+
+// Starts the session of a shell on a shared volume
+bool Shell::open_session()
+{
+  return filesys.mount();
+}
+
+// Ends the session of a shell on a shared volume
+void Shell::close_session()
+{
+  filesys.unmount();
+}
+
+// Runs a request received from a client. Returns true for quit.
+bool Shell::execute_request(const request_t &request)
+{
+  if (request.op == OP_PIPELINE) {
+    string line = request.data;
+    return execute_command(&line[0]);
   }
-  else if (command.name == "ls") {
-    filesys.ls();
+
+  struct Command command;
+  command.spec = command_for_op(request.op);
+  command.file_name = request.file_name.c_str();
+  command.append_data = request.data.c_str();
+  command.recursive = (request.flags & FLAG_RECURSIVE) != 0;
+  command.piped = false;
+
+  if (command.spec == NULL) {
+    cerr << "Invalid request: unknown operation" << endl;
+    return false;
   }
-  else if (command.name == "create") {
-    filesys.create(command.file_name.c_str());
+  return dispatch(command);
+}
+
+// Executes the command. Returns true for quit and false otherwise.
+bool Shell::execute_command(char *command_str)
+{
+  char *stages[MAX_PIPE_STAGES];
+  int num_stages = split_pipeline(command_str, stages);
+  if (num_stages == -1) {
+    cerr << "Invalid command line: more than " << MAX_PIPE_STAGES;
+    cerr << " commands in pipeline" << endl;
+    return false;
   }
-  else if (command.name == "append") {
-    filesys.append(command.file_name.c_str(), command.append_data.c_str());
+
+  // parse the command line
+  if (num_stages == 1) {
+    struct Command command;
+    if (!parse_command(command_str, command, false)) {
+      return false;
+    }
+    if (server_fd != -1) {
+      return send_command(command);
+    }
+    return dispatch(command);
   }
-  else if (command.name == "cat") {
-    filesys.cat(command.file_name.c_str());
+
+  // a daemon gets the whole pipeline as it was typed
+  string line;
+  if (server_fd != -1) {
+    for (int i = 0; i < num_stages; i++) {
+      line += (i == 0) ? "" : "|";
+      line += stages[i];
+    }
   }
-  else if (command.name == "tail") {
-    errno = 0;
-    unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
-    if (0 == errno) {
-      filesys.tail(command.file_name.c_str(), n);
-    } else {
-      cerr << "Invalid command line: " << command.append_data;
-      cerr << " is not a valid number of bytes" << endl;
+
+  struct Command commands[MAX_PIPE_STAGES];
+  for (int i = 0; i < num_stages; i++) {
+    if (blank(stages[i])) {
+      cerr << "Invalid command line: missing command in pipeline" << endl;
+      return false;
+    }
+    if (!parse_command(stages[i], commands[i], i > 0)) {
       return false;
     }
   }
-  else if (command.name == "rm") {
-    filesys.rm(command.file_name.c_str());
+
+  if (server_fd != -1) {
+    request_t request;
+    request.op = OP_PIPELINE;
+    request.flags = 0;
+    request.data = line;
+    return send_request(request);
   }
-  else if (command.name == "stat") {
-    filesys.stat(command.file_name.c_str());
+  run_pipeline(commands, num_stages);
+  return false;
+}
+
+// Runs commands joined by |. The output of each command is kept in a
+// Pipe that the next one reads in place. A file read by the first
+// command goes into the pipe as its blocks; cat, head and tail after it
+// only move the ends of the pipe, and what is left is printed at the
+// end. Any other command prints into the next pipe.
+void Shell::run_pipeline(const struct Command *commands, int count)
+{
+  Pipe pipes[2];
+  int current = 0;	// pipe holding the output so far
+
+  for (int i = 0; i < count; i++) {
+    const struct Command &command = commands[i];
+    unsigned char op = command.spec->op;
+    bool last = (i == count - 1);
+
+    if (op == OP_CAT || op == OP_HEAD || op == OP_TAIL) {
+      if (!command.piped) {
+        io_status_t status = filesys.cat(command.file_name, pipes[current]);
+        if (status != IO_OK) {
+          report(status);
+          return;
+        }
+      }
+      if (op != OP_CAT) {
+        unsigned long n;
+        if (!byte_count(command.append_data, n)) {
+          return;
+        }
+        if (op == OP_HEAD) {
+          pipes[current].keep_first(n);
+        } else {
+          pipes[current].keep_last(n);
+        }
+      }
+      if (last) {
+        cout.write(pipes[current].data(), pipes[current].size());
+        cout << endl;
+      }
+      continue;
+    }
+
+    Pipe &out = pipes[1 - current];
+    out.clear();
+    streambuf *old_out = last ? NULL : cout.rdbuf(&out);
+    if (!command.piped) {
+      dispatch(command);
+    } else if (op == OP_WC) {
+      filesys.wc(pipes[current]);
+    } else {
+      report(filesys.append(command.file_name, pipes[current]));
+    }
+    if (!last) {
+      cout.rdbuf(old_out);
+    }
+    current = 1 - current;
   }
-  else if (command.name == "pwd") {
+}
+
+// Runs a parsed command on the file system. Returns true for quit.
+bool Shell::dispatch(const struct Command &command)
+{
+  unsigned long n;
+
+  switch (command.spec->op) {
+  case OP_MKDIR:
+    report(filesys.mkdir(command.file_name));
+    break;
+  case OP_CD:
+    report(filesys.cd(command.file_name));
+    break;
+  case OP_HOME:
+    filesys.home();
+    break;
+  case OP_RMDIR:
+    report(filesys.rmdir(command.file_name));
+    break;
+  case OP_LS:
+    filesys.ls(strcmp(command.file_name, "-s") == 0);
+    break;
+  case OP_CREATE:
+    report(filesys.create(command.file_name));
+    break;
+  case OP_APPEND:
+    report(filesys.append(command.file_name, command.append_data));
+    break;
+  case OP_CAT:
+    report(filesys.cat(command.file_name));
+    break;
+  case OP_TAIL:
+  case OP_HEAD:
+    if (!byte_count(command.append_data, n)) {
+      return false;
+    }
+    if (command.spec->op == OP_TAIL) {
+      report(filesys.tail(command.file_name, n));
+    } else {
+      report(filesys.head(command.file_name, n));
+    }
+    break;
+  case OP_RM:
+    report(filesys.rm(command.file_name, command.recursive));
+    break;
+  case OP_STAT:
+    print_stat(command.file_name);
+    break;
+  case OP_PWD:
     filesys.pwd();
-  }
-  else if (command.name == "df") {
+    break;
+  case OP_DF:
     filesys.df();
-  }
-  else if (command.name == "head") {
-    errno = 0;
-    unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
-    if (0 == errno) {
-      filesys.head(command.file_name.c_str(), n);
+    break;
+  case OP_WC:
+    report(filesys.wc(command.file_name));
+    break;
+  case OP_CP:
+    report(filesys.cp(command.file_name, command.append_data, command.recursive));
+    break;
+  case OP_MV:
+    report(filesys.mv(command.file_name, command.append_data));
+    break;
+  case OP_FIND:
+    filesys.find(command.file_name);
+    break;
+  case OP_TREE:
+    filesys.tree(strcmp(command.file_name, "-s") == 0);
+    break;
+  case OP_INDEX:
+    report(filesys.index(command.file_name), "index", command.file_name);
+    break;
+  case OP_HELP:
+    if (command.file_name[0] == '\0') {
+      filesys.help();
     } else {
-      cerr << "Invalid command line: " << command.append_data;
-      cerr << " is not a valid number of bytes" << endl;
+      filesys.help(command.file_name);
+    }
+    break;
+  case OP_QUIT:
+    return true;
+  case OP_CACHE:
+    filesys.cache();
+    break;
+  case OP_SYNC:
+    filesys.sync();
+    break;
+  case OP_FSYNC:
+    report(filesys.fsync(command.file_name));
+    break;
+  case OP_SNAPSHOT:
+    report(filesys.snapshot(command.file_name, command.append_data),
+           "snapshot", command.file_name);
+    break;
+  case OP_FSCK:
+    filesys.fsck();
+    break;
+  case OP_IMPORT:
+    transfer(true, command.file_name, command.append_data);
+    break;
+  case OP_EXPORT:
+    transfer(false, command.file_name, command.append_data);
+    break;
+  case OP_IOSTAT:
+    report(filesys.iostat(command.file_name), "iostat", command.file_name);
+    break;
+  case OP_FRAG:
+    filesys.frag();
+    break;
+  case OP_DEFRAG:
+    if (command.file_name[0] == '\0') {
+      n = 0;
+    } else if (!step_count(command.file_name, n)) {
       return false;
     }
+    filesys.defrag(n);
+    break;
+  case OP_TRIM:
+    filesys.trim();
+    break;
   }
-  else if (command.name == "wc") {
-    filesys.wc(command.file_name.c_str());
-  }
-  else if (command.name == "cp") {
-    filesys.cp(command.file_name.c_str(), command.append_data.c_str());
+
+  return false;
+}
+
+// Runs an import (from host_path to name) or an export (from name to
+// host_path) and prints its rate or why it failed.
+void Shell::transfer(bool import, const char *from, const char *to)
+{
+  transfer_info_t info;
+  io_status_t status = import ? filesys.import_file(from, to, info)
+                              : filesys.export_file(from, to, info);
+  if (status != IO_OK) {
+    report(status, import ? from : to);
+    return;
   }
-  else if (command.name == "mv") {
-    filesys.mv(command.file_name.c_str(), command.append_data.c_str());
+  print_rate(import ? "Imported" : "Exported", info);
+}
+
+// Prints what stat reports about a file or directory.
+void Shell::print_stat(const char *name)
+{
+  file_info_t info;
+  io_status_t status = filesys.stat(name, info);
+  if (status != IO_OK) {
+    report(status);
+    return;
   }
-  else if (command.name == "find") {
-    filesys.find(command.file_name.c_str());
+
+  if (info.is_dir) {
+    cout << "Directory name: " << name << "/" << endl;
+    cout << "Directory block: " << info.block_num << endl;
+  } else {
+    cout << "Inode block: " << info.block_num << endl;
+    cout << "Bytes in file: " << info.size << endl;
+    cout << "Number of blocks: " << info.num_blocks << endl;
+    cout << "First block: " << info.first_block << endl;
   }
-  else if (command.name == "tree") {
-    filesys.tree();
+}
+
+// Sends a parsed command to the daemon and prints its output. Returns
+// true for quit or a lost connection.
+bool Shell::send_command(const struct Command &command)
+{
+  if (strlen(command.file_name) > 0xFFFF || strlen(command.append_data) > 0xFFFF) {
+    cerr << "Invalid command line: argument is too long" << endl;
+    return false;
   }
-  else if (command.name == "help") {
-    if (command.file_name.empty()) {
-      filesys.help();
-    } else {
-      filesys.help(command.file_name.c_str());
-    }
+
+  request_t request;
+  request.op = command.spec->op;
+  request.flags = command.recursive ? FLAG_RECURSIVE : 0;
+  request.file_name = command.file_name;
+  request.data = command.append_data;
+  return send_request(request);
+}
+
+// Sends a request to the daemon and prints its output. Returns true for
+// quit or a lost connection.
+bool Shell::send_request(const request_t &request)
+{
+  if (request.data.size() > 0xFFFF) {
+    cerr << "Invalid command line: argument is too long" << endl;
+    return false;
   }
-  else if (command.name == "quit") {
+
+  string payload;
+  response_t response;
+  if (!send_frame(server_fd, encode_request(request)) ||
+      !recv_frame(server_fd, payload) ||
+      !decode_response(payload, response)) {
+    cerr << "Lost connection to daemon" << endl;
     return true;
   }
 
-  return false;
+  cout << response.out;
+  cerr << response.err;
+  return response.status == STATUS_QUIT;
 }
 
-// Parses a command line into a command struct. Returned name is blank
-// for invalid command lines.
-Shell::Command Shell::parse_command(string command_str)
+// Parses a command line into a command struct. The line is split in
+// place and the arguments point into it. A piped command reads the
+// output of the command before it instead of a file. Returns false for
+// empty and invalid command lines.
+bool Shell::parse_command(char *command_str, struct Command &command, bool piped)
 {
-  // empty command struct returned for errors
-  struct Command empty = {"", "", ""};
+  command.spec = NULL;
+  command.file_name = "";
+  command.append_data = "";
+  command.recursive = false;
+  command.piped = piped;
 
   // grab each of the tokens (if they exist)
-  struct Command command;
-  istringstream ss(command_str);
-  int num_tokens = 0;
-  
-  if (ss >> command.name) {
+  char *pos = command_str;
+  char *name = next_token(pos);
+  if (name == NULL) {
+    return false;
+  }
+  command.spec = find_command(name);
+  if (command.spec == NULL) {
+    cerr << "Invalid command line: " << name;
+    cerr << " is not a command" << endl;
+    return false;
+  }
+  if (piped && command.spec->pipe_tokens == 0) {
+    cerr << "Invalid command line: " << name;
+    cerr << " cannot read from a pipe" << endl;
+    return false;
+  }
+  int num_tokens = 1;
+  unsigned char flags = command.spec->flags;
+  if (piped) {
+    flags &= ~(ARG_RECURSIVE | ARG_REST);
+  }
+
+  char *file_name = next_token(pos);
+
+  // rm and cp take an optional -r flag before their arguments
+  if (file_name != NULL && (flags & ARG_RECURSIVE) &&
+      strcmp(file_name, "-r") == 0) {
+    command.recursive = true;
+    file_name = next_token(pos);
+  }
+
+  if (file_name != NULL) {
+    command.file_name = file_name;
     num_tokens++;
-    if (ss >> command.file_name) {
-      num_tokens++;
-      
-      // For append command, handle quoted strings
-      if (command.name == "append") {
-        // Get the rest of the line for append data
-        string rest_of_line;
-        getline(ss, rest_of_line);
-        
-        // Trim leading whitespace
-        size_t start = rest_of_line.find_first_not_of(" \t");
-        if (start != string::npos) {
-          rest_of_line = rest_of_line.substr(start);
-          
-          // Check if it's quoted
-          if (rest_of_line.length() >= 2 && rest_of_line[0] == '"' && rest_of_line.back() == '"') {
-            // Remove quotes
-            command.append_data = rest_of_line.substr(1, rest_of_line.length() - 2);
-            num_tokens++;
-          } else if (!rest_of_line.empty()) {
-            // Not quoted, use as is
-            command.append_data = rest_of_line;
-            num_tokens++;
-          }
-        }
-      } else {
-        // For other commands, use normal parsing
-        if (ss >> command.append_data) {
+
+    if (flags & ARG_REST) {
+      // the rest of the line, without leading blanks and surrounding quotes
+      pos += strspn(pos, " \t");
+      size_t length = strlen(pos);
+      if (length >= 2 && pos[0] == '"' && pos[length - 1] == '"') {
+        pos[length - 1] = '\0';
+        command.append_data = pos + 1;
+        num_tokens++;
+      } else if (length > 0) {
+        command.append_data = pos;
+        num_tokens++;
+      }
+    } else {
+      char *data = next_token(pos);
+      if (data != NULL) {
+        command.append_data = data;
+        num_tokens++;
+        if (next_token(pos) != NULL) {
           num_tokens++;
-          string junk;
-          if (ss >> junk) {
-            num_tokens++;
-          }
         }
       }
     }
   }
 
-  // Check for empty command line
-  if (num_tokens == 0) {
-    return empty;
-  }
-    
-  // Check for invalid command lines
-  if (command.name == "ls" ||
-      command.name == "home" ||
-      command.name == "pwd" ||
-      command.name == "df" ||
-      command.name == "tree" ||
-      command.name == "help" ||
-      command.name == "quit")
-  {
-    if (num_tokens != 1 && !(command.name == "help" && num_tokens == 2)) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
-    }
-  }
-  else if (command.name == "mkdir" ||
-      command.name == "cd"    ||
-      command.name == "rmdir" ||
-      command.name == "create"||
-      command.name == "cat"   ||
-      command.name == "rm"    ||
-      command.name == "stat"  ||
-      command.name == "wc"    ||
-      command.name == "find")
-  {
-    if (num_tokens != 2) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
+  // Check for invalid command lines: ls and tree take an optional -s
+  // flag, snapshot list no name, and piped head and tail only a count
+  bool valid = num_tokens >= command.spec->min_tokens &&
+    num_tokens <= command.spec->max_tokens;
+  if (piped) {
+    valid = num_tokens == command.spec->pipe_tokens;
+    if (flags & ARG_COUNT) {
+      command.append_data = command.file_name;
+      command.file_name = "";
     }
   }
-  else if (command.name == "append" || 
-           command.name == "tail" ||
-           command.name == "head" ||
-           command.name == "cp" ||
-           command.name == "mv")
-  {
-    if (num_tokens != 3) {
-      cerr << "Invalid command line: " << command.name;
-      cerr << " has improper number of arguments" << endl;
-      return empty;
-    }
+  if (valid && (flags & ARG_SORT) && num_tokens == 2) {
+    valid = strcmp(command.file_name, "-s") == 0;
+  }
+  if (valid && (flags & ARG_LIST)) {
+    valid = (num_tokens == 2) == (strcmp(command.file_name, "list") == 0);
+  }
+  if (!valid) {
+    cerr << "Invalid command line: " << command.spec->name;
+    cerr << " has improper number of arguments" << endl;
+    return false;
   }
-  else {
-    cerr << "Invalid command line: " << command.name;
-    cerr << " is not a command" << endl; 
-    return empty;
-  } 
 
-  return command;
+  return true;
 }
-
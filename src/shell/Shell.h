@@ -6,34 +6,100 @@
 
 #include <string>
 #include "FileSys.h"
+#include "Pipe.h"
+#include "Protocol.h"
+#include "Volume.h"
+
+struct command_spec_t;
+class ReplayLog;
 
 // Shell
 class Shell {
 
   public:
+    // Creates a shell with a file system of its own.
+    Shell();
+
+    // Creates a shell whose file system is a session on a volume that
+    // other shells share.
+    explicit Shell(Volume &volume);
+
+    ~Shell();
+
     // Executes the shell until the user quits.
     void run();
 
-    // Execute a script.
+    // Execute a script. A quiet run does not echo the commands.
     void run_script(char *file_name);
+    void run_script(char *file_name, bool quiet);
+
+    // Replays a script quietly, timing each command, and prints the
+    // latencies by command at the end. With a rate above 0 command i
+    // starts i / rate seconds after the first, and its latency counts
+    // from then.
+    void replay_script(char *file_name, double rate);
+
+    // Mounts the disk, checks it and unmounts it.
+    void check_disk();
+
+    // Sends commands to the daemon listening on socket_path instead of
+    // running them here. Returns false if the daemon cannot be reached.
+    bool connect_to(const char *socket_path);
+
+    // Starts and ends the session of a shell on a shared volume.
+    bool open_session();
+    void close_session();
+
+    // Runs a request received from a client. Returns true for quit.
+    bool execute_request(const request_t &request);
 
   private:
     FileSys filesys;  // file system
+    int server_fd;    // connection to a daemon (-1: run commands here)
 
-    // data structure for command line
+    // data structure for command line; the strings point into the line
     struct Command
     {
-      string name;		// name of command
-      string file_name;		// name of file
-      string append_data;	// append data (append only)
+      const command_spec_t *spec;	// the command
+      const char *file_name;	// name of file ("" if none)
+      const char *append_data;	// second argument ("" if none)
+      bool recursive;		// -r flag (rm and cp only)
+      bool piped;		// reads the output of the command before
     };
 
-    // Executes the command. Returns true for quit and false otherwise.
-    bool execute_command(string command_str);
+    // Runs a script, timing its commands into replay unless it is NULL.
+    void run_script(char *file_name, bool quiet, ReplayLog *replay);
+
+    // Executes the command, splitting the line in place. Returns true
+    // for quit and false otherwise.
+    bool execute_command(char *command_str);
+
+    // Runs a parsed command on the file system. Returns true for quit.
+    bool dispatch(const struct Command &command);
+
+    // Prints what stat reports about a file or directory.
+    void print_stat(const char *name);
+
+    // Runs an import or export and prints how fast it went.
+    void transfer(bool import, const char *from, const char *to);
+
+    // Runs parsed commands joined by |, each reading the output of the
+    // one before.
+    void run_pipeline(const struct Command *commands, int count);
+
+    // Sends a parsed command to the daemon and prints its output.
+    // Returns true for quit or a lost connection.
+    bool send_command(const struct Command &command);
+    bool send_request(const request_t &request);
+
+    // not copyable
+    Shell(const Shell &);
+    Shell &operator=(const Shell &);
 
-    // Parses a command line into a command struct. Returned name is blank
-    // for invalid command lines.
-    struct Command parse_command(string command_str);
+    // Parses a command line into a command struct, splitting it in
+    // place. A piped command reads the output of the command before it.
+    // Returns false for empty and invalid command lines.
+    bool parse_command(char *command_str, struct Command &command, bool piped);
 };
 
 #endif